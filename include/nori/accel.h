@@ -18,16 +18,27 @@
 
 #pragma once
 #include <nori/mesh.h>
+#include <nori/raypacket.h>
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Acceleration data structure for ray intersection queries
  *
  * The current implementation falls back to a brute force loop
- * through the geometry.
+ * through the geometry. Subclasses are registered with the object factory
+ * and selected in the scene description using an
+ * <tt>&lt;accel type=".."&gt;</tt> element.
+ *
+ * The accelerator only references its meshes; they are owned by the scene.
  */
-class Accel {
+class Accel : public NoriObject {
 public:
+    /// Create an empty accelerator
+    Accel() { }
+
+    /// Create an empty accelerator (there are no parameters)
+    Accel(const PropertyList &) { }
+
     /**
      * \brief Register a triangle mesh for inclusion in the acceleration
      * data structure
@@ -63,7 +74,103 @@ public:
      */
     virtual bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const;
 
+    /**
+     * \brief Determine whether a ray intersects any triangle (occlusion query)
+     *
+     * The default implementation performs a shadow ray query with
+     * \ref rayIntersect(). Subclasses can override it with a traversal that
+     * is specialized for finding any intersection instead of the closest.
+     */
+    virtual bool occluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Intersect a packet of rays against all triangles stored in
+     * the scene
+     *
+     * The default implementation traces the active rays one at a time.
+     * Subclasses can override it to traverse the whole packet at once.
+     *
+     * \param packet
+     *    Up to \ref RayPacket8::Size rays in structure-of-arrays layout
+     *
+     * \param active
+     *    Bit mask of the lanes of \c packet that hold valid rays
+     *
+     * \param its
+     *    Array of \ref RayPacket8::Size intersection records. Entry \c i
+     *    is filled if lane \c i found an intersection. May be \c nullptr
+     *    for shadow ray queries.
+     *
+     * \param shadowRay
+     *    \c true if this is a shadow ray query (see \ref rayIntersect())
+     *
+     * \return A bit mask of the lanes that found an intersection
+     */
+    virtual int rayIntersect8(const RayPacket8 &packet, int active,
+        Intersection *its, bool shadowRay) const;
+
+    /**
+     * \brief Intersect a stream of ray packets
+     *
+     * Traces <tt>packets[0..count)</tt> with \ref rayIntersect8(), using
+     * the active mask <tt>active[i]</tt> for packet \c i. The intersection
+     * records of packet \c i are written to
+     * <tt>its[i * RayPacket8::Size ..]</tt> (unless \c its is \c nullptr),
+     * and its hit mask to <tt>hits[i]</tt>.
+     */
+    void rayIntersectStream(const RayPacket8 *packets, const int *active,
+        size_t count, Intersection *its, int *hits, bool shadowRay) const;
+
+    /// Return the memory used by the data structure (excluding the meshes) in bytes
+    virtual size_t getMemoryUsage() const { return 0; }
+
+    /**
+     * \brief Return the number of nodes that were visited by the ray
+     * queries of the calling thread so far (for benchmarking)
+     *
+     * Nodes are only counted when Nori is compiled with \c NORI_ACCEL_STATS,
+     * otherwise this returns zero.
+     */
+#if defined(NORI_ACCEL_STATS)
+    static uint64_t getNodeVisits() { return s_nodeVisits; }
+#else
+    static uint64_t getNodeVisits() { return 0; }
+#endif
+
+    /// Reset the node visit counter of the calling thread
+#if defined(NORI_ACCEL_STATS)
+    static void resetNodeVisits() { s_nodeVisits = 0; }
+#else
+    static void resetNodeVisits() { }
+#endif
+
+    /// Return a brief string summary of the accelerator
+    virtual std::string toString() const { return "Accel[]"; }
+
+    EClassType getClassType() const { return EAccel; }
+
 protected:
+    /**
+     * \brief Counts the nodes visited by one ray query and adds them to the
+     * counter of the thread when the query returns
+     *
+     * Without \c NORI_ACCEL_STATS, this is empty and compiles away.
+     */
+    struct NodeVisitCounter {
+#if defined(NORI_ACCEL_STATS)
+        uint32_t count = 0;
+        ~NodeVisitCounter() { s_nodeVisits += count; }
+        void operator++(int) { ++count; }
+#else
+        void operator++(int) { }
+#endif
+    };
+
+#if defined(NORI_ACCEL_STATS)
+    /// Nodes visited by the ray queries of the current thread
+    static thread_local uint64_t s_nodeVisits;
+#endif
+
     Mesh         *m_mesh = nullptr; ///< Mesh (only a single one for now)
     BoundingBox3f m_bbox;           ///< Bounding box of the entire scene
 };
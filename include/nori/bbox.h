@@ -349,6 +349,7 @@ template <typename _PointType> struct TBoundingBox {
 
                 if (t1 > t2)
                     std::swap(t1, t2);
+                t2 *= SlabFarScale;
 
                 nearT = std::max(t1, nearT);
                 farT = std::min(t2, farT);
@@ -379,6 +380,7 @@ template <typename _PointType> struct TBoundingBox {
 
                 if (t1 > t2)
                     std::swap(t1, t2);
+                t2 *= SlabFarScale;
 
                 nearT = std::max(t1, nearT);
                 farT = std::min(t2, farT);
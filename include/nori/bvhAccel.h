@@ -22,6 +22,14 @@
 #include <nori/bbox.h>
 #include <nori/mesh.h>
 #include <nori/accel.h>
+#include <Eigen/Geometry>
+
+/* Number of triangles that are intersected at once in BVH leaves */
+#if defined(__AVX__)
+#define NORI_PACKET_WIDTH 8
+#else
+#define NORI_PACKET_WIDTH 4
+#endif
 
 NORI_NAMESPACE_BEGIN
 
@@ -43,11 +51,53 @@ NORI_NAMESPACE_BEGIN
  * \author Wenzel Jakob
  */
     class BVHAccel : public Accel {
+    friend class BVHNodePool;
     friend class BVHBuildTask;
+    friend class SBVHBuilder;
+    friend class LBVHBuilder;
+    friend class BVHOptimizer;
     public:
+        /// Order in which the two children of an inner node are visited
+        enum ETraversalOrder {
+            /// Always descend into the left child first
+            EFixedOrder = 0,
+
+            /// Visit the child on the near side of the split axis first
+            ESignOrder,
+
+            /// Test both children and visit the one with the smaller entry distance first
+            EDistanceOrder
+        };
+
+        /// Algorithm that constructs the hierarchy
+        enum EBuilder {
+            /// Binned SAH build (optionally with spatial splits)
+            ESAHBuilder = 0,
+
+            /// Linear build from sorted Morton codes, much faster but lower quality
+            ELBVHBuilder,
+
+            /// Binned SAH build over Morton code clusters, each built as an LBVH
+            EHLBVHBuilder
+        };
+
+        enum {
+            /// Upper limit for the number of bins used by the SAH build
+            MAX_BIN_COUNT = 128,
+
+            /// Version of the cache file format (increment when changing the node layout)
+            CACHE_VERSION = 2,
+
+            /// Refit subtrees with more nodes than this in parallel
+            REFIT_PARALLEL_THRESHOLD = 4096
+        };
+
         /// Create a new and empty BVHAccel
         BVHAccel() { m_meshOffset.push_back(0u); }
 
+        /// Create a new and empty BVHAccel with the build settings of a scene description
+        BVHAccel(const PropertyList& propList);
+
         /// Release all resources
         virtual ~BVHAccel() { clear(); };
 
@@ -57,13 +107,28 @@ NORI_NAMESPACE_BEGIN
         /**
          * \brief Register a triangle mesh for inclusion in the BVHAccel.
          *
-         * This function can only be used before \ref build() is called
+         * This function can only be used before \ref build() is called.
+         * All moving meshes must have the same number of keyframes.
          */
         void addMesh(Mesh* mesh) override;
 
         /// Build the BVH
         void build() override;
 
+        /**
+         * \brief Update the BVH after the vertices of its meshes have moved
+         *
+         * Recomputes the node bounds bottom-up (in parallel) while keeping
+         * the tree topology, which is much faster than \ref build() for
+         * small deformations or rigid motion. The quality of the tree
+         * degrades as triangles move away from each other, so the BVH is
+         * rebuilt instead once its SAH cost exceeds that of the last build
+         * by the factor set with \ref setRefitThreshold().
+         *
+         * \return \c true if the BVH was refitted, \c false if it was rebuilt
+         */
+        virtual bool refit();
+
         /**
          * \brief Intersect a ray against all triangle meshes registered
          * with the BVHAccel
@@ -82,19 +147,177 @@ NORI_NAMESPACE_BEGIN
         bool rayIntersect(const Ray3f& ray, Intersection& its,
             bool shadowRay = false) const override;
 
+        /**
+         * \brief Determine whether a ray intersects any triangle
+         *
+         * Unlike shadow ray queries with \ref rayIntersect(), this traversal
+         * does not order the children by the ray direction but visits the
+         * one with the larger surface area first, which is more likely to
+         * contain an occluder. It stops at the first intersection.
+         */
+        bool occluded(const Ray3f& ray) const override;
+
+        /**
+         * \brief Intersect a packet of rays against all triangle meshes
+         * registered with the BVHAccel
+         *
+         * All active rays descend the hierarchy together. Each node is first
+         * tested against an interval bound of the whole packet (frustum
+         * culling), and then against the individual rays with SIMD slab
+         * tests. Leaves are processed one triangle packet at a time: each
+         * packet is tested against all rays that reached the leaf before
+         * moving on to the next one, so that it is loaded only once.
+         * The triangle test itself still handles one ray at a time (against
+         * all lanes of the packet). See \ref Accel::rayIntersect8() for the
+         * parameters.
+         */
+        int rayIntersect8(const RayPacket8& packet, int active,
+            Intersection* its, bool shadowRay) const override;
+
         /// Return the total number of meshes registered with the BVH
         uint32_t getMeshCount() const { return (uint32_t)m_meshes.size(); }
 
         /// Return the total number of internally represented triangles 
         uint32_t getTriangleCount() const { return m_meshOffset.back(); }
 
+        /// Return the number of keyframes of the moving meshes (1 if nothing moves)
+        uint32_t getKeyframeCount() const { return m_keyframeCount; }
+
+        /// Set the child visiting order used by \ref rayIntersect()
+        void setTraversalOrder(ETraversalOrder order) { m_traversalOrder = order; }
+
+        /// Return the child visiting order used by \ref rayIntersect()
+        ETraversalOrder getTraversalOrder() const { return m_traversalOrder; }
+
+        /// Select the algorithm used by \ref build()
+        void setBuilder(EBuilder builder) { m_builder = builder; }
+
+        /// Return the algorithm used by \ref build()
+        EBuilder getBuilder() const { return m_builder; }
+
+        /**
+         * \brief Enable spatial splits (SBVH) during the SAH build
+         *
+         * Besides the usual object splits, the builder then also considers
+         * splitting a node along a plane and referencing the straddling
+         * triangles from both children. This reduces the overlap between
+         * nodes in scenes with large triangles at the cost of a longer build.
+         */
+        void setSpatialSplits(bool enabled) { m_spatialSplits = enabled; }
+
+        /// Are spatial splits enabled?
+        bool getSpatialSplits() const { return m_spatialSplits; }
+
+        /**
+         * \brief Set the fraction of additional triangle references that
+         * spatial splits may create (e.g. 0.3 for up to 30% duplicates)
+         */
+        void setDuplicationBudget(float budget) { m_duplicationBudget = budget; }
+
+        /// Return the fraction of additional triangle references that spatial splits may create
+        float getDuplicationBudget() const { return m_duplicationBudget; }
+
+        /**
+         * \brief Set the number of bins per axis used to evaluate the SAH
+         *
+         * More bins find better split planes but make the build slower.
+         * Must be between 2 and \ref MAX_BIN_COUNT.
+         */
+        void setBinCount(int binCount) {
+            if (binCount < 2 || binCount > MAX_BIN_COUNT)
+                throw NoriException("BVHAccel: the bin count must be between 2 and %i!", (int) MAX_BIN_COUNT);
+            m_binCount = binCount;
+        }
+
+        /// Return the number of bins per axis used to evaluate the SAH
+        int getBinCount() const { return m_binCount; }
+
+        /**
+         * \brief Set the number of triangles below which a subtree is
+         * built serially instead of spawning further parallel tasks
+         */
+        void setSerialThreshold(uint32_t threshold) { m_serialThreshold = threshold; }
+
+        /// Return the number of triangles below which a subtree is built serially
+        uint32_t getSerialThreshold() const { return m_serialThreshold; }
+
+        /**
+         * \brief Set the number of treelet restructuring passes that
+         * improve the tree after the build (0 disables the optimization)
+         *
+         * Optimization stops early once a pass no longer reduces the
+         * SAH cost noticeably.
+         */
+        void setOptimizationPasses(int passes) { m_optimizationPasses = passes; }
+
+        /// Return the number of treelet restructuring passes
+        int getOptimizationPasses() const { return m_optimizationPasses; }
+
+        /**
+         * \brief Limit the time spent on optimization passes (in seconds,
+         * 0 means no limit). A pass is always completed once started.
+         */
+        void setOptimizationTime(float seconds) { m_optimizationTime = seconds; }
+
+        /// Return the time limit of the optimization passes in seconds
+        float getOptimizationTime() const { return m_optimizationTime; }
+
+        /**
+         * \brief Cache built hierarchies in the given directory
+         *
+         * The nodes and triangle indices are stored in a file named after a
+         * hash of the mesh geometry and the build settings. Subsequent builds
+         * over identical meshes map this file instead of building the
+         * hierarchy again. An empty string disables the cache.
+         */
+        void setCacheDirectory(const std::string& directory) { m_cacheDirectory = directory; }
+
+        /// Return the directory of cached hierarchies (empty if disabled)
+        const std::string& getCacheDirectory() const { return m_cacheDirectory; }
+
+        /**
+         * \brief Set the factor by which the SAH cost may grow over that of
+         * the last build before \ref refit() rebuilds the BVH (0 never rebuilds)
+         */
+        void setRefitThreshold(float threshold) { m_refitThreshold = threshold; }
+
+        /// Return the SAH cost factor that makes \ref refit() rebuild the BVH
+        float getRefitThreshold() const { return m_refitThreshold; }
+
+        /**
+         * \brief Store the nodes in a compressed format after the build
+         *
+         * With 8 or 16 bits, the bounds of every node are quantized relative
+         * to the (decoded) bounds of its parent, which shrinks a node from
+         * 32 to 16 or 20 bytes at the cost of decoding the child boxes during
+         * the traversal. Rounding is conservative, so the decoded boxes only
+         * grow. 0 disables the compression. Packet queries then fall back to
+         * tracing the rays one by one.
+         */
+        void setQuantizationBits(int bits) {
+            if (bits != 0 && bits != 8 && bits != 16)
+                throw NoriException("BVHAccel: nodes can only be quantized to 8 or 16 bits!");
+            m_quantizationBits = bits;
+        }
+
+        /// Return the number of bits per quantized bound (0 if the nodes are not compressed)
+        int getQuantizationBits() const { return m_quantizationBits; }
+
         /// Return one of the registered meshes
         Mesh* getMesh(uint32_t idx) { return m_meshes[idx]; }
 
         /// Return one of the registered meshes (const version)
         const Mesh* getMesh(uint32_t idx) const { return m_meshes[idx]; }
 
+        /// Return the memory used by the nodes, indices and triangle packets
+        size_t getMemoryUsage() const override;
+
+        /// Return a brief string summary of the build settings
+        std::string toString() const override;
+
     protected:
+        template <typename T> struct BVHQuantizedNode;
+
         /**
          * \brief Compute the mesh and triangle indices corresponding to
          * a primitive index used by the underlying generic BVHAccel implementation.
@@ -120,6 +343,87 @@ NORI_NAMESPACE_BEGIN
         /// Compute internal tree statistics
         std::pair<float, uint32_t> statistics(uint32_t index = 0) const;
 
+        /// Gather the triangles into \ref m_packets in the order of \ref m_indices
+        void buildPackets();
+
+        /// Hash the mesh geometry and build settings that determine the hierarchy
+        uint64_t computeCacheKey() const;
+
+        /// Try to load the hierarchy from a cache file with the given key
+        bool loadCache(const std::string& filename, uint64_t key);
+
+        /// Write the hierarchy to a cache file
+        void saveCache(const std::string& filename, uint64_t key) const;
+
+        /**
+         * \brief Intersect a ray against the triangles referenced by the
+         * index range <tt>m_indices[start..end)</tt>
+         *
+         * On a hit, <tt>ray.maxt</tt>, <tt>its.t</tt>, <tt>its.uv</tt> and
+         * <tt>its.mesh</tt> are updated and \c f receives the mesh-local
+         * index of the closest triangle. Shadow rays return after the
+         * first hit. \c tray holds the per-ray data of the triangle test,
+         * which the traversal computes once per query.
+         *
+         * \return \c true if any of the triangles was hit
+         */
+        bool intersectTriangles(uint32_t start, uint32_t end, Ray3f& ray,
+            const TriangleRay& tray, Intersection& its, bool shadowRay, uint32_t& f) const;
+
+        /// Does the ray intersect any triangle of <tt>m_indices[start..end)</tt>?
+        bool occludedTriangles(uint32_t start, uint32_t end, const Ray3f& ray,
+            const TriangleRay& tray) const;
+
+        /// Mark the inner nodes whose right child has the larger surface area
+        void computeOcclusionOrder();
+
+        /// Compress the nodes after the build if requested by \ref setQuantizationBits()
+        void compressNodes();
+
+        /// Restore \ref m_nodes (without bounds) from the quantized nodes
+        template <typename T> void decompressTopology(const std::vector<BVHQuantizedNode<T>>& nodes);
+
+        /// Recompute the bounds of the subtree below \c node_idx
+        void refitSubtree(uint32_t node_idx);
+
+        /**
+         * \brief Compute the bounds of every node at every keyframe
+         *
+         * The tree is built over boxes that contain the moving triangles
+         * during the whole shutter interval. Rays instead test the node
+         * bounds interpolated to their time, which are much tighter for fast
+         * motion. Quantized hierarchies keep using the conservative boxes.
+         */
+        void computeMotionBounds();
+
+        /// Compute the keyframe bounds of the subtree below \c node_idx
+        void motionBoundsSubtree(uint32_t node_idx);
+
+        /**
+         * \brief Closest hit (or shadow ray) traversal that interpolates the
+         * node bounds to the time of the ray
+         */
+        bool rayIntersectMotion(Ray3f& ray, Intersection& its, bool shadowRay, uint32_t& f) const;
+
+        /// Convert \ref m_nodes into quantized nodes and release them
+        template <typename T> void quantize(std::vector<BVHQuantizedNode<T>>& result);
+
+        /// Closest hit (or shadow ray) traversal of the quantized nodes
+        template <typename T> bool rayIntersectQuantized(const std::vector<BVHQuantizedNode<T>>& nodes,
+            Ray3f& ray, Intersection& its, bool shadowRay, uint32_t& f) const;
+
+        /// Occlusion traversal of the quantized nodes
+        template <typename T> bool occludedQuantized(const std::vector<BVHQuantizedNode<T>>& nodes,
+            const Ray3f& ray) const;
+
+        /**
+         * \brief Fill in the position, texture coordinates and frames of an
+         * intersection record whose \c mesh, \c t and barycentric \c uv
+         * were set by \ref intersectTriangles() for triangle \c f, using
+         * the vertex positions at the given time
+         */
+        void finalizeIntersection(uint32_t f, float time, Intersection& its) const;
+
         /* BVH node in 32 bytes */
         struct BVHNode {
             union {
@@ -131,7 +435,9 @@ NORI_NAMESPACE_BEGIN
 
                 struct {
                     unsigned flag : 1;
-                    uint32_t axis : 31;
+                    uint32_t axis : 2;
+                    uint32_t rightLarger : 1; ///< Occlusion queries visit the right child first
+                    uint32_t unused : 28;
                     uint32_t rightChild;
                 } inner;
 
@@ -159,12 +465,110 @@ NORI_NAMESPACE_BEGIN
                 return leaf.start + leaf.size;
             }
         };
-    private:
+
+        /**
+         * \brief BVH node with bounds quantized relative to its parent
+         *
+         * The lower bounds count steps of <tt>(parent.max - parent.min) /
+         * (2^bits - 1)</tt> up from the parent's minimum and the upper bounds
+         * count steps down from its maximum, so that 0 decodes to the
+         * parent's bounds exactly. Nodes are stored in the same depth-first
+         * order as \ref BVHNode (16 bytes with 8-bit and 20 bytes with
+         * 16-bit bounds).
+         */
+        template <typename T> struct BVHQuantizedNode {
+            uint32_t leaf : 1;
+            uint32_t rightLarger : 1;  ///< Occlusion queries visit the right child first
+            uint32_t size : 30;        ///< Number of triangles of a leaf
+            uint32_t offset;           ///< First entry of \c m_indices (leaf) or right child (inner node)
+            T lower[3], upper[3];      ///< Quantized bounds
+
+            /// Decode the bounds, given the decoded bounds of the parent
+            BoundingBox3f decode(const BoundingBox3f& parent) const {
+                const float scale = 1.0f / (float) std::numeric_limits<T>::max();
+                BoundingBox3f result;
+                for (int a = 0; a < 3; ++a) {
+                    float step = (parent.max[a] - parent.min[a]) * scale;
+                    result.min[a] = parent.min[a] + lower[a] * step;
+                    result.max[a] = parent.max[a] - upper[a] * step;
+                }
+                return result;
+            }
+        };
+
+        typedef BVHQuantizedNode<uint8_t> BVHNode8;
+        typedef BVHQuantizedNode<uint16_t> BVHNode16;
+
+        /**
+         * \brief Packet of pre-transformed triangles in leaf order
+         *
+         * Packet \c k holds the triangles <tt>m_indices[k*W..(k+1)*W)</tt>
+         * in structure-of-arrays layout, storing the first vertex and both
+         * edge vectors that the Moeller-Trumbore test needs (or the three
+         * vertices for the watertight test, which must see the exact vertex
+         * positions shared by adjacent triangles). Leaves are
+         * intersected by streaming through the packets that overlap their
+         * index range and testing all lanes of a packet at once, without
+         * looking up the owning mesh or gathering vertices through its
+         * index buffer. Packets are not used if any mesh moves.
+         */
+        struct alignas(NORI_PACKET_WIDTH * sizeof(float)) BVHTrianglePacket {
+            float p0[3][NORI_PACKET_WIDTH];       ///< First vertices
+#if defined(NORI_WATERTIGHT)
+            float p1[3][NORI_PACKET_WIDTH];       ///< Second vertices
+            float p2[3][NORI_PACKET_WIDTH];       ///< Third vertices
+#else
+            float edge1[3][NORI_PACKET_WIDTH];    ///< Second minus first vertices
+            float edge2[3][NORI_PACKET_WIDTH];    ///< Third minus first vertices
+#endif
+            uint32_t mesh[NORI_PACKET_WIDTH];     ///< Index of the mesh in \c m_meshes
+            uint32_t index[NORI_PACKET_WIDTH];    ///< Triangle index within the mesh
+
+            /**
+             * \brief Intersect a ray against the lanes selected by \c mask
+             *
+             * \return The lane of the closest hit (with its barycentric
+             *    coordinates and distance), or -1 if no lane was hit
+             */
+            int rayIntersect(const Ray3f& ray, const TriangleRay& tray, int mask,
+                float& u, float& v, float& t) const;
+
+            /// Does the ray intersect any of the lanes selected by \c mask?
+            bool occluded(const Ray3f& ray, const TriangleRay& tray, int mask) const;
+
+            /**
+             * \brief Test all lanes selected by \c mask and return a bit mask of
+             * the hit ones. Their distance and barycentric coordinates are
+             * written to \c t, \c u and \c v (aligned arrays of the packet
+             * width) unless no lane was hit.
+             */
+            int hitMask(const Ray3f& ray, const TriangleRay& tray, int mask,
+                float* t, float* u, float* v) const;
+        };
+
+    protected:
         std::vector<Mesh*> m_meshes;       ///< List of meshes registered with the BVH
         std::vector<uint32_t> m_meshOffset; ///< Index of the first triangle for each shape
         std::vector<BVHNode> m_nodes;       ///< BVH nodes
-        std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes
-        BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
+        std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes (may contain duplicates)
+        std::vector<BVHTrianglePacket> m_packets; ///< Triangle packets in the order of \c m_indices
+        ETraversalOrder m_traversalOrder = ESignOrder; ///< Child visiting order
+        EBuilder m_builder = ESAHBuilder;   ///< Construction algorithm
+        int m_binCount = 32;                ///< Number of SAH bins per axis
+        uint32_t m_serialThreshold = 32;    ///< Build subtrees with fewer triangles serially
+        bool m_spatialSplits = false;       ///< Build with spatial splits?
+        float m_duplicationBudget = 0.3f;   ///< Allowed fraction of duplicated references
+        int m_optimizationPasses = 0;       ///< Number of treelet restructuring passes
+        float m_optimizationTime = 0.0f;    ///< Time limit of the optimization in seconds
+        std::string m_cacheDirectory;       ///< Directory of cached hierarchies
+        float m_refitThreshold = 1.5f;      ///< Relative SAH cost that makes refit() rebuild
+        float m_buildCost = 0.0f;           ///< SAH cost after the last build
+        int m_quantizationBits = 0;         ///< Bits per quantized bound (0: uncompressed)
+        std::vector<BVHNode8> m_nodes8;     ///< Compressed nodes (8-bit bounds)
+        std::vector<BVHNode16> m_nodes16;   ///< Compressed nodes (16-bit bounds)
+        BoundingBox3f m_rootBBox;           ///< Exact bounds of the root of the compressed nodes
+        uint32_t m_keyframeCount = 1;       ///< Keyframes of the moving meshes (1: nothing moves)
+        std::vector<BoundingBox3f> m_motionBounds; ///< Bounds of node \c i at keyframe \c k at <tt>i*K+k</tt>
 };
 
 NORI_NAMESPACE_END
@@ -49,6 +49,16 @@
 /* "Ray epsilon": relative error threshold for ray intersection computations */
 #define Epsilon 1e-4f
 
+/* Factor applied to the far distances of ray-box slab tests. Watertight
+   triangle tests need conservative box tests, so that rays through a
+   triangle on a box boundary do not miss the box due to rounding
+   ("Robust BVH Ray Traversal" by Ize, JCGT 2013) */
+#if defined(NORI_WATERTIGHT)
+#define SlabFarScale (1.0f + 4 * 1.1920929e-7f)
+#else
+#define SlabFarScale 1.0f
+#endif
+
 /* A few useful constants */
 #undef M_PI
 
@@ -122,6 +132,8 @@ class Bitmap;
 class BlockGenerator;
 class Camera;
 class ImageBlock;
+class Instance;
+class InstanceAccel;
 class Integrator;
 class KDTree;
 class Emitter;
@@ -143,6 +155,9 @@ using std::endl;
 
 typedef Eigen::Matrix<float,    Eigen::Dynamic, Eigen::Dynamic> MatrixXf;
 typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXu;
+typedef Eigen::Matrix<uint16_t, Eigen::Dynamic, Eigen::Dynamic> MatrixXh; ///< Half precision values (raw bits)
+typedef Eigen::Map<const MatrixXf> MatrixXfView; ///< Read-only view of external data (e.g. a memory-mapped file)
+typedef Eigen::Map<const MatrixXu> MatrixXuView; ///< Read-only view of external data (e.g. a memory-mapped file)
 
 /// Simple exception class, which stores a human-readable error description
 class NoriException : public std::runtime_error {
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <nori/common.h>
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+/// Incremental 64-bit FNV-1a hash that consumes 64-bit words
+struct FNVHash {
+    uint64_t value = 0xcbf29ce484222325ull;
+
+    void add(const void* data, size_t size) {
+        const uint8_t* ptr = (const uint8_t*)data;
+        size_t words = size / sizeof(uint64_t);
+        for (size_t i = 0; i < words; ++i) {
+            uint64_t word;
+            memcpy(&word, ptr + i * sizeof(uint64_t), sizeof(uint64_t));
+            value = (value ^ word) * 0x100000001b3ull;
+        }
+        for (size_t i = words * sizeof(uint64_t); i < size; ++i)
+            value = (value ^ ptr[i]) * 0x100000001b3ull;
+    }
+
+    template <typename T> void add(const T& v) { add(&v, sizeof(T)); }
+
+    /// Return the hash after a final avalanche step
+    uint64_t get() const {
+        uint64_t h = value;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+        return h ^ (h >> 31);
+    }
+};
+
+NORI_NAMESPACE_END
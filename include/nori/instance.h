@@ -0,0 +1,55 @@
+#pragma once
+
+#include <nori/mesh.h>
+#include <nori/transform.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Placement of a shared triangle mesh in the scene
+ *
+ * An instance refers to a mesh in its own object space and positions it
+ * using the \c toWorld transformation. The first instance of a mesh
+ * declares it with an \c id attribute, and further instances refer to it
+ * using <tt>&lt;ref id=".."/&gt;</tt>:
+ *
+ * \code
+ * <instance>
+ *     <mesh type="obj" id="chair">..</mesh>
+ *     <transform name="toWorld">..</transform>
+ * </instance>
+ * <instance>
+ *     <ref id="chair"/>
+ *     <transform name="toWorld">..</transform>
+ * </instance>
+ * \endcode
+ *
+ * The geometry of a mesh is stored (and its BVH built) only once, no
+ * matter how often it is instanced. See \ref InstanceAccel.
+ */
+class Instance : public NoriObject {
+public:
+    Instance(const PropertyList &propList);
+
+    /// Return the instanced mesh
+    Mesh *getMesh() const { return m_mesh; }
+
+    /// Return the transformation from object to world space
+    const Transform &getTransform() const { return m_toWorld; }
+
+    /// Register the instanced mesh
+    void addChild(NoriObject *obj) override;
+
+    /// Check that a mesh was specified
+    void activate() override;
+
+    std::string toString() const override;
+
+    EClassType getClassType() const override { return EInstance; }
+
+private:
+    Mesh *m_mesh = nullptr;
+    Transform m_toWorld;
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <nori/bvhAccel.h>
+#include <nori/transform.h>
+#include <map>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Two-level acceleration data structure for instanced meshes
+ *
+ * Every unique mesh gets its own bottom-level \ref BVHAccel in object
+ * space, and a small top-level BVH is built over the world-space bounds of
+ * the instances. Rays that reach an instance are transformed into its
+ * object space and traced through the shared bottom-level hierarchy, so
+ * that memory scales with the amount of unique geometry instead of the
+ * number of placed copies.
+ *
+ * Meshes that are not instanced are passed on to a regular accelerator,
+ * which is traced in addition to the instances.
+ *
+ * After \ref setTransform(), a subsequent \ref build() only rebuilds the
+ * top level; the bottom-level hierarchies are built once.
+ */
+class InstanceAccel : public Accel {
+public:
+    /**
+     * \brief Create a two-level hierarchy
+     *
+     * \param base
+     *    Accelerator for the meshes that are not instanced. Its build
+     *    settings are also used for the bottom-level hierarchies. The
+     *    instance accelerator takes ownership of it.
+     */
+    InstanceAccel(BVHAccel *base) : m_base(base) { }
+
+    /// Release all resources (including the base accelerator)
+    virtual ~InstanceAccel();
+
+    /// Register a mesh that is not instanced
+    void addMesh(Mesh *mesh) override;
+
+    /**
+     * \brief Place a copy of \c mesh in the scene
+     *
+     * Meshes are identified by their address: the geometry (and bottom-level
+     * hierarchy) of all instances of the same mesh is shared.
+     *
+     * \return The index of the new instance
+     */
+    uint32_t addInstance(Mesh *mesh, const Transform &toWorld);
+
+    /// Move an instance (call \ref build() afterwards to update the top level)
+    void setTransform(uint32_t index, const Transform &toWorld);
+
+    /// Return the transformation of an instance
+    const Transform &getTransform(uint32_t index) const { return m_instances[index].toWorld; }
+
+    /// Return the number of instances
+    uint32_t getInstanceCount() const { return (uint32_t) m_instances.size(); }
+
+    /// Build the missing bottom-level hierarchies and (re-)build the top level
+    void build() override;
+
+    /// Intersect a ray against the regular meshes and all instances
+    bool rayIntersect(const Ray3f &ray, Intersection &its,
+        bool shadowRay = false) const override;
+
+    /// Determine whether a ray intersects any regular mesh or instance
+    bool occluded(const Ray3f &ray) const override;
+
+    /// Return the memory used by all hierarchies and the instance records
+    size_t getMemoryUsage() const override;
+
+    /// Return a brief string summary of the two-level hierarchy
+    std::string toString() const override;
+
+protected:
+    /// Placement of a bottom-level hierarchy
+    struct InstanceRecord {
+        uint32_t blas;         ///< Index of the bottom-level hierarchy
+        bool flip;             ///< Does the transformation flip the orientation?
+        Transform toWorld;     ///< Object to world transformation
+        Transform toObject;    ///< World to object transformation
+        BoundingBox3f bbox;    ///< World space bounds
+    };
+
+    /// Top-level BVH node (left child at <tt>idx+1</tt>)
+    struct Node {
+        BoundingBox3f bbox;
+        uint32_t start;   ///< First entry of \c m_order (leaf) or right child (inner node)
+        uint16_t count;   ///< Number of instances (0 for inner nodes)
+        uint16_t axis;    ///< Split axis of an inner node
+    };
+
+    /// Recursively build the top level over <tt>m_order[start..end)</tt>
+    void buildTopLevel(uint32_t start, uint32_t end, int depth);
+
+    /// Transform an intersection with an instance into world space
+    void toWorld(const InstanceRecord &instance, Intersection &its) const;
+
+private:
+    BVHAccel *m_base;                           ///< Meshes that are not instanced
+    bool m_baseBuilt = false;                   ///< Was \c m_base built?
+    std::vector<BVHAccel *> m_blas;             ///< One hierarchy per unique mesh
+    uint32_t m_blasBuilt = 0;                   ///< Number of built entries of \c m_blas
+    std::map<const Mesh *, uint32_t> m_blasIndex; ///< Maps meshes to entries of \c m_blas
+    std::vector<InstanceRecord> m_instances;    ///< All instances
+    std::vector<uint32_t> m_order;              ///< Instance indices in leaf order
+    std::vector<Node> m_nodes;                  ///< Top-level BVH
+};
+
+NORI_NAMESPACE_END
@@ -23,6 +23,8 @@
 #include <nori/bbox.h>
 #include <nori/dpdf.h>
 #include <nori/emittersampler.h>
+#include <nori/quantize.h>
+#include <nori/watertight.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -72,6 +74,10 @@ struct Intersection {
  * for querying the individual triangles. Subclasses of \c Mesh implement
  * the specifics of how to create its contents (e.g. by loading from an
  * external file)
+ *
+ * The vertex and face data are accessed through read-only views, which
+ * either reference matrices owned by the mesh or, for binary meshes, the
+ * memory-mapped file itself.
  */
 class Mesh : public NoriObject, public IEmitterSampler {
 public:
@@ -96,16 +102,109 @@ public:
     //// Return an axis-aligned bounding box of the entire mesh
     const BoundingBox3f &getBoundingBox() const { return m_bbox; }
 
-    //// Return an axis-aligned bounding box containing the given triangle
+    /**
+     * \brief Return an axis-aligned bounding box containing the given
+     * triangle (over all keyframes if the mesh moves)
+     */
     BoundingBox3f getBoundingBox(uint32_t index) const;
 
+    //// Return an axis-aligned bounding box containing the given triangle at a keyframe
+    BoundingBox3f getBoundingBox(uint32_t index, uint32_t keyframe) const;
+
+    /**
+     * \brief Return the number of vertex keyframes
+     *
+     * Moving meshes store the vertex positions at two or more keyframes
+     * that are evenly spaced over the shutter interval; positions between
+     * two keyframes are interpolated linearly. Keyframe 0 holds the
+     * regular vertex positions, which are also used for emitter sampling.
+     */
+    uint32_t getKeyframeCount() const { return 1 + (uint32_t) m_keyframes.size(); }
+
+    /// Does the mesh move during the shutter interval?
+    bool isMoving() const { return !m_keyframes.empty(); }
+
+    /// Return the vertex positions of a keyframe
+    MatrixXfView getKeyframe(uint32_t keyframe) const {
+        if (keyframe == 0)
+            return m_V;
+        const MatrixXf &V = m_keyframes[keyframe - 1];
+        return MatrixXfView(V.data(), V.rows(), V.cols());
+    }
+
+    /**
+     * \brief Find the keyframes around a time of the shutter interval
+     *
+     * \param k
+     *    The keyframe before \c time
+     * \param alpha
+     *    Interpolation weight of keyframe <tt>k+1</tt>
+     */
+    void findKeyframe(float time, uint32_t &k, float &alpha) const {
+        float x = std::min(std::max(time, 0.0f), 1.0f) * m_keyframes.size();
+        k = std::min((uint32_t) x, (uint32_t) m_keyframes.size() - 1);
+        alpha = x - k;
+    }
+
+    /// Return the position of a vertex at the given time
+    Point3f getVertexPosition(uint32_t vertex, float time) const {
+        if (m_keyframes.empty())
+            return m_V.col(vertex);
+        uint32_t k;
+        float alpha;
+        findKeyframe(time, k, alpha);
+        return (1 - alpha) * getKeyframe(k).col(vertex) + alpha * getKeyframe(k + 1).col(vertex);
+    }
+
+    /// Does the mesh provide vertex normals?
+    bool hasVertexNormals() const { return m_N.size() > 0 || m_Nq.size() > 0; }
+
+    /// Does the mesh provide texture coordinates?
+    bool hasVertexTexCoords() const { return m_UV.size() > 0 || m_UVq.size() > 0; }
+
+    /// Return the normal of a vertex (of keyframe 0), decoding it if necessary
+    Normal3f getVertexNormal(uint32_t vertex) const {
+        if (m_Nq.size() > 0)
+            return decodeOctahedral(m_Nq(vertex));
+        return m_N.col(vertex);
+    }
+
+    /// Return the (unnormalized) normal of a vertex at the given time
+    Normal3f getVertexNormal(uint32_t vertex, float time) const {
+        if (m_keyframeNormals.empty())
+            return getVertexNormal(vertex);
+        uint32_t k;
+        float alpha;
+        findKeyframe(time, k, alpha);
+        Normal3f n0 = k == 0 ? getVertexNormal(vertex) : Normal3f(m_keyframeNormals[k - 1].col(vertex));
+        return (1 - alpha) * n0 + alpha * m_keyframeNormals[k].col(vertex);
+    }
+
+    /// Return the texture coordinates of a vertex, decoding them if necessary
+    Point2f getVertexTexCoord(uint32_t vertex) const {
+        if (m_UVq.size() > 0)
+            return Point2f(halfToFloat(m_UVq(0, vertex)), halfToFloat(m_UVq(1, vertex)));
+        return m_UV.col(vertex);
+    }
+
+    /// Return the vertices of a triangle at the given time
+    void getTriangle(int index, float time, Point3f &v0, Point3f &v1, Point3f &v2) const {
+        v0 = getVertexPosition(m_F(0, index), time);
+        v1 = getVertexPosition(m_F(1, index), time);
+        v2 = getVertexPosition(m_F(2, index), time);
+    }
+
     //// Return the centroid of the given triangle
     Point3f getCentroid(uint32_t index) const;
 
     /** \brief Ray-triangle intersection test
+     *
+     * Moving meshes are intersected at the time of the ray.
      *
      * Uses the algorithm by Moeller and Trumbore discussed at
-     * <tt>http://www.acm.org/jgt/papers/MollerTrumbore97/code.html</tt>.
+     * <tt>http://www.acm.org/jgt/papers/MollerTrumbore97/code.html</tt>,
+     * or the watertight test of \ref rayIntersectWatertight() when Nori
+     * is compiled with \c NORI_WATERTIGHT.
      *
      * Note that the test only applies to a single triangle in the mesh.
      * An acceleration data structure like \ref BVH is needed to search
@@ -127,19 +226,50 @@ public:
      * \return
      *   \c true if an intersection has been detected
      */
-    bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const;
+    bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
+        return rayIntersect(index, ray, TriangleRay(ray), u, v, t);
+    }
+
+    /**
+     * \brief Ray-triangle intersection test with per-ray data that the
+     * caller computed once for all triangles it tests (see \ref TriangleRay)
+     */
+    bool rayIntersect(uint32_t index, const Ray3f &ray, const TriangleRay &tray,
+                      float &u, float &v, float &t) const;
 
     /// Return a pointer to the vertex positions
-    const MatrixXf &getVertexPositions() const { return m_V; }
+    const MatrixXfView &getVertexPositions() const { return m_V; }
+
+    /**
+     * \brief Move the vertices of the mesh (e.g. for the next frame of an
+     * animation) while keeping its triangles
+     *
+     * Updates the bounding box and the triangle sampling distribution.
+     * Acceleration data structures containing the mesh have to be updated
+     * afterwards, e.g. using \ref BVHAccel::refit().
+     */
+    void setVertexPositions(const MatrixXf &V);
+
+    /**
+     * \brief Return a pointer to the vertex normals (or \c nullptr if there
+     * are none or they are compressed)
+     */
+    const MatrixXfView &getVertexNormals() const { return m_N; }
 
-    /// Return a pointer to the vertex normals (or \c nullptr if there are none)
-    const MatrixXf &getVertexNormals() const { return m_N; }
+    /**
+     * \brief Return a pointer to the texture coordinates (or \c nullptr if
+     * there are none or they are compressed)
+     */
+    const MatrixXfView &getVertexTexCoords() const { return m_UV; }
 
-    /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
-    const MatrixXf &getVertexTexCoords() const { return m_UV; }
+    /// Are the vertex normals and texture coordinates stored compressed?
+    bool hasCompressedAttributes() const { return m_Nq.size() > 0 || m_UVq.size() > 0; }
+
+    /// Return the memory used by the vertex and face data in bytes (including mapped files)
+    size_t getMemoryUsage() const;
 
     /// Return a pointer to the triangle vertex index list
-    const MatrixXu &getIndices() const { return m_F; }
+    const MatrixXuView &getIndices() const { return m_F; }
 
     /// Is this mesh an area emitter?
     bool isEmitter() const { return m_emitter != nullptr; }
@@ -178,13 +308,48 @@ protected:
     /// Create an empty mesh
     Mesh();
 
+    /**
+     * \brief Compress the vertex normals and texture coordinates
+     *
+     * Normals are stored octahedron-encoded in 32 bits (\ref
+     * encodeOctahedral()) and texture coordinates as half precision
+     * values, which saves 12 of the 20 bytes they take per vertex. They
+     * are only needed to shade an intersection, and are decoded there.
+     * Vertex positions keep their full precision, and the normals of
+     * moving meshes with keyframe normals are not compressed.
+     */
+    void compressAttributes();
+
+    /**
+     * \brief Let one of the views \ref m_V, \ref m_N, \ref m_UV or \ref m_F
+     * reference the given data, which has to outlive the mesh
+     */
+    template <typename Matrix>
+    static void setView(Eigen::Map<const Matrix> &view, const typename Matrix::Scalar *data,
+                        Eigen::Index rows, Eigen::Index cols) {
+        /* Eigen::Map cannot be reassigned, but it may be constructed anew */
+        new (&view) Eigen::Map<const Matrix>(data, rows, cols);
+    }
+
+    /// Let a view reference a matrix owned by the mesh (e.g. \ref m_VData)
+    template <typename Matrix>
+    static void setView(Eigen::Map<const Matrix> &view, const Matrix &matrix) {
+        setView(view, matrix.data(), matrix.rows(), matrix.cols());
+    }
+
 protected:
     bool isActivate = false;
     std::string m_name;                  ///< Identifying name
-    MatrixXf      m_V;                   ///< Vertex positions
-    MatrixXf      m_N;                   ///< Vertex normals
-    MatrixXf      m_UV;                  ///< Vertex texture coordinates
-    MatrixXu      m_F;                   ///< Faces
+    MatrixXfView  m_V{nullptr, 3, 0};    ///< Vertex positions
+    std::vector<MatrixXf> m_keyframes;   ///< Vertex positions of the further keyframes
+    std::vector<MatrixXf> m_keyframeNormals; ///< Vertex normals of the further keyframes (optional)
+    MatrixXfView  m_N{nullptr, 3, 0};    ///< Vertex normals
+    MatrixXfView  m_UV{nullptr, 2, 0};   ///< Vertex texture coordinates
+    MatrixXu      m_Nq;                  ///< Octahedron-encoded vertex normals (compressed meshes)
+    MatrixXh      m_UVq;                 ///< Half precision texture coordinates (compressed meshes)
+    MatrixXuView  m_F{nullptr, 3, 0};    ///< Faces
+    MatrixXf      m_VData, m_NData, m_UVData; ///< Storage of the views above (unless they reference a file)
+    MatrixXu      m_FData;               ///< Storage of \ref m_F (unless it references a file)
     BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
     Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
     BoundingBox3f m_bbox;                ///< Bounding box of the mesh
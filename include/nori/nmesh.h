@@ -0,0 +1,54 @@
+#pragma once
+
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Header of a binary mesh file (.nmesh)
+ *
+ * The header is followed by the vertex positions (3 floats per vertex),
+ * the vertex normals (3 floats, optional), the texture coordinates (2
+ * floats, optional) and the triangle indices (3 unsigned 32-bit integers
+ * per triangle). Each array has the column-major layout of the matching
+ * \ref Mesh matrix and starts at a multiple of \ref NMESH_ALIGNMENT bytes,
+ * so that a loaded mesh can reference the mapped file directly.
+ * All values are stored in little endian order.
+ *
+ * Meshes are converted from OBJ files with the \c obj2nmesh tool and
+ * loaded with the \c nmesh shape plugin.
+ */
+struct NMeshHeader {
+    enum {
+        /// Version of the file format
+        NMESH_VERSION = 1,
+
+        /// Alignment of the arrays in bytes
+        NMESH_ALIGNMENT = 64
+    };
+
+    /// Arrays contained in the file in addition to positions and indices
+    enum EFlags {
+        EHasNormals   = 0x01,
+        EHasTexCoords = 0x02
+    };
+
+    char magic[4];          ///< "NMSH"
+    uint32_t version;       ///< \ref NMESH_VERSION
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+    uint32_t flags;         ///< Combination of \ref EFlags
+    uint32_t padding;
+    uint64_t checksum;      ///< \ref FNVHash of everything after the header
+
+    /**
+     * \brief Compute the byte offsets of the positions, normals, texture
+     * coordinates and indices, and the total size of the file
+     */
+    size_t layout(size_t offsets[4]) const;
+};
+
+/// Write a mesh to a binary mesh file (throws a \ref NoriException upon failure)
+extern void writeNMesh(const std::string &filename, const Mesh &mesh);
+
+NORI_NAMESPACE_END
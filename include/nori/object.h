@@ -42,6 +42,8 @@ public:
         ESampler,
         ETest,
         EReconstructionFilter,
+        EInstance,
+        EAccel,
         EClassTypeCount
     };
 
@@ -98,6 +100,8 @@ public:
             case EIntegrator: return "integrator";
             case ESampler:    return "sampler";
             case ETest:       return "test";
+            case EInstance:   return "instance";
+            case EAccel:      return "accel";
             default:          return "<unknown>";
         }
     }
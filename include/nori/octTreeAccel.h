@@ -3,231 +3,147 @@
 #include <nori/bbox.h>
 #include <nori/mesh.h>
 #include <nori/accel.h>
+#include <algorithm>
 
-#include <iostream>
-#include <stack>
-#include <unordered_map>
 NORI_NAMESPACE_BEGIN
-class Element{
-public:
-    enum ElementType{
-        TRIANGLE,
-        OCTTREENODE
-    };
-
-    Element(ElementType type){
-        m_type = type;
-    }
-    virtual float surfaceArea() const { return 0.0; }
-    virtual bool inBBox(const BoundingBox3f& bbox) const { return false; }
-    virtual bool rayIntersect(Ray3f& ray, Intersection& its) { return false; }
-public:
-    ElementType m_type;
-    BoundingBox3f m_bbox;
-};
 
-class Triangle : public Element{
+/**
+ * \brief Octree acceleration data structure
+ *
+ * Every node splits its box at the center into eight octants. Triangles
+ * that lie completely inside an octant are passed on to the corresponding
+ * child. Up to \ref MAX_WIDTH of the remaining (straddling) triangles are
+ * stored at the node itself, and any further ones are referenced by all
+ * children whose box they overlap.
+ *
+ * The tree is stored as a flat array without pointers: the existing
+ * children of a node are stored next to each other and are found using a
+ * bit mask of the occupied octants and the index of the first child. The
+ * triangles of a node are a range of a shared triangle index array.
+ *
+ * Rays visit the children of a node in front-to-back order, which follows
+ * from the signs of the ray direction alone. The traversal is stackless:
+ * once a subtree is done, it returns to the parent via the stored parent
+ * index and continues with the next sibling in the same order.
+ */
+class OctTreeAccel : public Accel {
+    friend class OctTreeBuilder;
 public:
-    Triangle(Mesh* mesh, int i) : Element(TRIANGLE){
-        m_mesh = mesh;
-        idx = i;
-        //m_mesh->getTriangleIdx(i, m_i0, m_i1, m_i2);
-        m_bbox = m_mesh->getBoundingBox(i);
-    }
-
-    bool inBBox(const BoundingBox3f& bbox)const override {
-        const auto& F = m_mesh->getIndices();
-        const auto& V = m_mesh->getVertexPositions();
-        
-        uint32_t i0 = F(0, idx), i1 = F(1, idx), i2 = F(2, idx);
-        Point3f p0 = V.col(i0), p1 = V.col(i1), p2 = V.col(i2);
-        
-        if (bbox.contains(p0) && bbox.contains(p1) && bbox.contains(p2)) {
-			return true;
-		}
-
-        return false;
-    }
+    /// Create a new and empty octree
+    OctTreeAccel() { m_meshOffset.push_back(0u); }
 
-    bool rayIntersect(Ray3f& ray, Intersection& its) override {
-        if(m_bbox.rayIntersect(ray) == false) {
-			return false;
-		}
+    /// Create a new and empty octree (there are no parameters)
+    OctTreeAccel(const PropertyList &) : OctTreeAccel() { }
 
-        float u, v, t;
-        const auto& F = m_mesh->getIndices();
-        const auto& V = m_mesh->getVertexPositions();
+    /// Register a triangle mesh (only before \ref build() is called)
+    void addMesh(Mesh* mesh) override;
 
-        uint32_t i0 = F(0, idx), i1 = F(1, idx), i2 = F(2, idx);
-        Point3f p0 = V.col(i0), p1 = V.col(i1), p2 = V.col(i2);
-        /* Find vectors for two edges sharing v[0] */
-        Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
-
-        /* Begin calculating determinant - also used to calculate U parameter */
-        Vector3f pvec = ray.d.cross(edge2);
+    /// Build the octree over the triangles of all registered meshes
+    void build() override;
 
-        /* If determinant is near zero, ray lies in plane of triangle */
-        float det = edge1.dot(pvec);
+    /**
+     * \brief Intersect a ray against the triangles of the octree
+     *
+     * Shadow ray queries return as soon as any intersection is found.
+     */
+    bool rayIntersect(const Ray3f& ray, Intersection& its, bool shadowRay) const override;
 
-        if (det > -1e-8f && det < 1e-8f)
-            return false;
-        float inv_det = 1.0f / det;
+    /// Return the memory used by the nodes and triangle indices
+    size_t getMemoryUsage() const override {
+        return sizeof(OctTreeNode) * m_nodes.size() + sizeof(uint32_t) * m_indices.size();
+    }
 
-        /* Calculate distance from v[0] to ray origin */
-        Vector3f tvec = ray.o - p0;
+    /// Return a brief string summary of the octree
+    std::string toString() const override { return "OctTreeAccel[]"; }
 
-        /* Calculate U parameter and test bounds */
-        u = tvec.dot(pvec) * inv_det;
-        if (u < 0.0 || u > 1.0)
-            return false;
+    /// Return the total number of triangles of all meshes
+    uint32_t getTriangleCount() const { return m_meshOffset.back(); }
 
-        /* Prepare to test V parameter */
-        Vector3f qvec = tvec.cross(edge1);
+    using Accel::getBoundingBox;
 
-        /* Calculate V parameter and test bounds */
-        v = ray.d.dot(qvec) * inv_det;
-        if (v < 0.0 || u + v > 1.0)
-            return false;
+    /// Return an axis-aligned bounding box containing the given triangle
+    BoundingBox3f getBoundingBox(uint32_t index) const {
+        uint32_t meshIdx = findMesh(index);
+        return m_meshes[meshIdx]->getBoundingBox(index);
+    }
 
-        /* Ray intersects triangle -> compute t */
-        t = edge2.dot(qvec) * inv_det;
+    /// Does the given triangle belong to a moving mesh?
+    bool isMoving(uint32_t index) const {
+        return m_meshes[findMesh(index)]->isMoving();
+    }
 
-        bool rayHit = (t >= ray.mint && t <= ray.maxt);
-        if (rayHit) {
-            ray.maxt = its.t = t;
-            its.uv = Point2f(u, v);
-            its.mesh = m_mesh;
-        }
-        return rayHit;
+    /// Return the vertices of the given triangle (at the first keyframe)
+    void getTriangle(uint32_t index, Point3f& p0, Point3f& p1, Point3f& p2) const {
+        uint32_t meshIdx = findMesh(index);
+        m_meshes[meshIdx]->getTriangle(index, p0, p1, p2);
     }
 
-public:
-    //uint32_t m_i0;
-    //uint32_t m_i1;
-    //uint32_t m_i2;
-    Mesh* m_mesh;
-    int idx;
-};
+protected:
+    enum {
+        /// Maximum depth of the tree (deeper nodes are turned into leaves)
+        MAX_DEPTH = 12,
 
-#define MAX_DEPTH 12
-#define MAX_WIDTH 4
-#define RELASE_CONST 0.0
-class OctTreeNode : Element{
-public:
-    OctTreeNode(const BoundingBox3f& bbox) : Element(OCTTREENODE){
-        OctTreeNode::m_nodeCount++;
-        m_bbox = bbox;
-        for (int i = 0; i < MAX_WIDTH; i++) {
-            m_elements[i] = nullptr;
-        }
-        for (int i = 0; i < 8; i++) {
-			m_children[i] = nullptr;
-		}
-	}
-    ~OctTreeNode() {
-        for(int i = 0; i < 8; i++) {
-            delete m_children[i];
-        }
+        /// Maximum number of triangles stored at a node before subdividing it
+        MAX_WIDTH = 4,
 
-        for(Element* element : m_elements) {
-			delete element;
-		}
-    }
+        /**
+         * Nodes are not subdivided if their children would reference more
+         * than this many times as many triangles (due to straddling ones)
+         */
+        MAX_DUPLICATION = 2,
 
-    void print(int level) {
-        for (int i = 0; i < level; i++) {std::cout << "  ";}
-        std::cout << "level: " << level << "\n";
-        for (int i = 0; i < level; i++) { std::cout << "  "; }
-        std::cout << "bbox: " << m_bbox.min.toString() << m_bbox.max.toString() << "\n";
-        for (int i = 0; i < level; i++) { std::cout << "  "; }
-        int levelSize = 0;
-        for(int i = 0; i < MAX_WIDTH; i++) if(m_elements[i] != nullptr) levelSize++;
-        std::cout << "elements Num : " << levelSize << std::endl;
-        for (int i = 0; i < level; i++) { std::cout << "  "; }
-        // print elements
-        for (Element* element : m_elements) {
-            if (element == nullptr) break;
-            switch (element->m_type) {
-				case Element::TRIANGLE:
-					std::cout << "; triangle: " << ((Triangle*)element)->idx;
-					break;
-				default:
-					break;
-			}
-        }
-        std::cout << std::endl;
+        /// Returned by \ref nextChild() if no further child is hit
+        INVALID_NODE = 0xFFFFFFFFu
+    };
 
-        for (int i = 0; i < 8; i++) {
-            if (m_children[i] != nullptr) {
-				m_children[i]->print(level + 1);
-			}
-		}
-    }
-    static void validate(OctTreeNode* root, int size) {
-        std::cout << "Check Size: " << size << std::endl;
-        
-        bool shouldExit = false;
-        std::vector<bool> flags(size, false);
-
-        std::stack<OctTreeNode*> m_stack;
-        m_stack.push(root);
-        while (!m_stack.empty()) {
-            OctTreeNode* node = m_stack.top();
-			m_stack.pop();
-            for (Element* element : node->m_elements) {
-                if (element == nullptr) break;
-                if (element->m_type == Element::TRIANGLE) {
-					int idx = ((Triangle*)element)->idx;
-                    if (flags[idx]) {
-						std::cout << "Multiple Existance error: " << idx << std::endl;
-                        shouldExit = true;
-					}
-					flags[idx] = true;
-				}
-			}
-
-            for (int i = 0; i < 8; i++) {
-                if (node->m_children[i] != nullptr) {
-					m_stack.push(node->m_children[i]);
-				}
-			}
+    /// Octree node
+    struct OctTreeNode {
+        BoundingBox3f bbox;   ///< Bounds of the node (an octant of the parent)
+        uint32_t parent;      ///< Index of the parent node
+        uint32_t firstChild;  ///< Index of the first child
+        uint32_t start;       ///< First entry of \c m_indices
+        uint32_t size;        ///< Number of triangles stored at this node
+        uint8_t childMask;    ///< Bit \c i is set if the child in octant \c i exists
+        uint8_t octant;       ///< Octant of this node within its parent
+
+        /// Return the index of the child in the given (occupied) octant
+        uint32_t child(int octant) const {
+            return firstChild + (uint32_t) popcount(childMask & ((1u << octant) - 1));
         }
 
-        for (int i = 0; i < size; i++) {
-			if (!flags[i]) { 
-                std::cout << "Triangle Not Load error: " << i << std::endl;
-                shouldExit = true;
-            }
+        static int popcount(uint32_t mask) {
+            int count = 0;
+            for (; mask; mask &= mask - 1)
+                ++count;
+            return count;
         }
+    };
 
-        //if (shouldExit) { exit(-1); }
-    }
-
-    Element* rayIntersect(Ray3f& ray, Intersection& its) const;
-
-    static OctTreeNode* build(const BoundingBox3f& bbox, std::vector<Element*>& elements, int depth);
-public:
-    Element* m_elements[MAX_WIDTH];
-    OctTreeNode* m_children[8];
-
-    static int m_level;
-    static int m_nodeCount;
-    static int m_leafCount;
-    static int m_elementCount[MAX_WIDTH+1];
-};
-
-struct CompareOctTreeNodes {
-    bool operator()(const std::pair<float, OctTreeNode*>& a, const std::pair<float, OctTreeNode*>& b) const {
-        return a.first > b.first; // Min-heap: smallest distance has highest priority
+    /**
+     * \brief Compute the mesh and triangle indices corresponding to
+     * a triangle index of the octree (which spans all meshes)
+     */
+    uint32_t findMesh(uint32_t& idx) const {
+        auto it = std::upper_bound(m_meshOffset.begin(), m_meshOffset.end(), idx) - 1;
+        idx -= *it;
+        return (uint32_t) (it - m_meshOffset.begin());
     }
-};
 
-class OctTreeAccel : public Accel {
-public:
-    void build() override;
-    bool rayIntersect(const Ray3f& ray, Intersection& its, bool shadowRay) const override;
-public:
-    OctTreeNode* m_root;
+    /**
+     * \brief Return the first child of \c node in front-to-back order,
+     * starting at position \c rank of that order, whose box overlaps the
+     * ray segment. Returns \ref INVALID_NODE if there is none.
+     */
+    uint32_t nextChild(const OctTreeNode& node, int rank, const Ray3f& ray, int dirMask) const;
+
+    /// Compute the position, frames and texture coordinates of a hit
+    void finalizeIntersection(uint32_t f, float time, Intersection& its) const;
+
+private:
+    std::vector<Mesh*> m_meshes;       ///< Registered meshes
+    std::vector<uint32_t> m_meshOffset; ///< Index of the first triangle of each mesh
+    std::vector<OctTreeNode> m_nodes;  ///< Nodes, with the root at index 0
+    std::vector<uint32_t> m_indices;   ///< Triangle indices referenced by the nodes
 };
 
 NORI_NAMESPACE_END
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <nori/vector.h>
+#include <cstring>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Encode a unit vector with two 16-bit signed normalized values
+ *
+ * The octahedral mapping projects the sphere onto the octahedron
+ * |x|+|y|+|z|=1 and unfolds its lower half over the corners of the square
+ * [-1,1]^2, which distributes the quantization error almost uniformly.
+ * The angular error is below 0.005 degrees.
+ *
+ * "A Survey of Efficient Representations for Independent Unit Vectors" by
+ * Cigolle, Donow, Evangelakos, Mara, McGuire and Meyer (Journal of Computer
+ * Graphics Techniques, 2014)
+ */
+inline uint32_t encodeOctahedral(const Vector3f &n) {
+    float invL1 = 1.0f / (std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z()));
+    float u = n.x() * invL1, v = n.y() * invL1;
+    if (n.z() < 0) {
+        float uf = (1 - std::abs(v)) * (u >= 0 ? 1.0f : -1.0f);
+        float vf = (1 - std::abs(u)) * (v >= 0 ? 1.0f : -1.0f);
+        u = uf; v = vf;
+    }
+    auto quantize = [](float x) {
+        x = std::min(std::max(x, -1.0f), 1.0f);
+        return (uint32_t) (uint16_t) (int16_t) std::round(x * 32767.0f);
+    };
+    return quantize(u) | (quantize(v) << 16);
+}
+
+/// Decode a unit vector that was encoded with \ref encodeOctahedral()
+inline Vector3f decodeOctahedral(uint32_t value) {
+    float u = (int16_t) (value & 0xFFFF) * (1.0f / 32767.0f),
+          v = (int16_t) (value >> 16) * (1.0f / 32767.0f);
+    Vector3f n(u, v, 1 - std::abs(u) - std::abs(v));
+    if (n.z() < 0) {
+        n.x() = (1 - std::abs(v)) * (u >= 0 ? 1.0f : -1.0f);
+        n.y() = (1 - std::abs(u)) * (v >= 0 ? 1.0f : -1.0f);
+    }
+    return n.normalized();
+}
+
+/// Convert a single precision value to half precision (rounding to nearest even)
+inline uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+    uint16_t sign = (uint16_t) ((bits >> 16) & 0x8000);
+    bits &= 0x7FFFFFFF;
+
+    if (bits >= 0x7F800000) /* Infinity or NaN */
+        return sign | 0x7C00 | (bits > 0x7F800000 ? 0x200 : 0);
+    if (bits >= 0x477FF000) /* Rounds to infinity */
+        return sign | 0x7C00;
+    if (bits < 0x38800000) { /* Subnormal half precision value (or zero) */
+        float abs;
+        memcpy(&abs, &bits, sizeof(float));
+        return sign | (uint16_t) std::nearbyint(abs * 16777216.0f);
+    }
+
+    /* Rebias the exponent and round the mantissa */
+    bits += 0xC8000FFF + ((bits >> 13) & 1);
+    return sign | (uint16_t) (bits >> 13);
+}
+
+/// Convert a half precision value to single precision
+inline float halfToFloat(uint16_t value) {
+    uint32_t sign = (uint32_t) (value & 0x8000) << 16,
+             exponent = (value >> 10) & 0x1F,
+             mantissa = value & 0x3FF, bits;
+
+    if (exponent == 0) { /* Zero or subnormal */
+        float result = mantissa * (1.0f / 16777216.0f);
+        return sign ? -result : result;
+    } else if (exponent == 0x1F) { /* Infinity or NaN */
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+NORI_NAMESPACE_END
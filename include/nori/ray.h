@@ -30,6 +30,10 @@ NORI_NAMESPACE_BEGIN
  * infinity), as well as the componentwise reciprocals of the ray direction.
  * That is just done for convenience, as these values are frequently required.
  *
+ * For motion blur, every ray also carries a time within the shutter
+ * interval, normalized to [0, 1]. Rays that continue a path should inherit
+ * the time of the camera ray.
+ *
  * \remark Important: be careful when changing the ray direction. You must
  * call \ref update() to compute the componentwise reciprocals as well, or Nori's
  * ray-triangle intersection code will go haywire.
@@ -44,31 +48,39 @@ template <typename _PointType, typename _VectorType> struct TRay {
     VectorType dRcp; ///< Componentwise reciprocals of the ray direction
     Scalar mint;     ///< Minimum position on the ray segment
     Scalar maxt;     ///< Maximum position on the ray segment
+    Scalar time;     ///< Time within the shutter interval (in [0, 1])
 
     /// Construct a new ray
     TRay() : mint(Epsilon), 
-        maxt(std::numeric_limits<Scalar>::infinity()) { }
+        maxt(std::numeric_limits<Scalar>::infinity()), time(0) { }
     
     /// Construct a new ray
     TRay(const PointType &o, const VectorType &d) : o(o), d(d), 
-            mint(Epsilon), maxt(std::numeric_limits<Scalar>::infinity()) {
+            mint(Epsilon), maxt(std::numeric_limits<Scalar>::infinity()), time(0) {
         update();
     }
 
     /// Construct a new ray
     TRay(const PointType &o, const VectorType &d, 
-        Scalar mint, Scalar maxt) : o(o), d(d), mint(mint), maxt(maxt) {
+        Scalar mint, Scalar maxt) : o(o), d(d), mint(mint), maxt(maxt), time(0) {
+        update();
+    }
+
+    /// Construct a new ray at the given time
+    TRay(const PointType &o, const VectorType &d, Scalar time)
+        : o(o), d(d), mint(Epsilon),
+          maxt(std::numeric_limits<Scalar>::infinity()), time(time) {
         update();
     }
 
     /// Copy constructor
     TRay(const TRay &ray) 
      : o(ray.o), d(ray.d), dRcp(ray.dRcp),
-       mint(ray.mint), maxt(ray.maxt) { }
+       mint(ray.mint), maxt(ray.maxt), time(ray.time) { }
 
     /// Copy a ray, but change the covered segment of the copy
     TRay(const TRay &ray, Scalar mint, Scalar maxt) 
-     : o(ray.o), d(ray.d), dRcp(ray.dRcp), mint(mint), maxt(maxt) { }
+     : o(ray.o), d(ray.d), dRcp(ray.dRcp), mint(mint), maxt(maxt), time(ray.time) { }
 
     /// Update the reciprocal ray directions after changing 'd'
     void update() {
@@ -82,7 +94,7 @@ template <typename _PointType, typename _VectorType> struct TRay {
     TRay reverse() const {
         TRay result;
         result.o = o; result.d = -d; result.dRcp = -dRcp;
-        result.mint = mint; result.maxt = maxt;
+        result.mint = mint; result.maxt = maxt; result.time = time;
         return result;
     }
 
@@ -93,8 +105,9 @@ template <typename _PointType, typename _VectorType> struct TRay {
                 "  o = %s,\n"
                 "  d = %s,\n"
                 "  mint = %f,\n"
-                "  maxt = %f\n"
-                "]", o.toString(), d.toString(), mint, maxt);
+                "  maxt = %f,\n"
+                "  time = %f\n"
+                "]", o.toString(), d.toString(), mint, maxt, time);
     }
 };
 
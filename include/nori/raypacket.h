@@ -0,0 +1,49 @@
+#pragma once
+
+#include <nori/ray.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Packet of rays in structure-of-arrays layout
+ *
+ * Stores up to \ref Size rays that are traced together by
+ * \ref Accel::rayIntersect8(). Which lanes hold valid rays is
+ * specified separately by an active mask (bit \c i for lane \c i).
+ * Coherent rays (e.g. camera rays of neighboring pixels, or shadow
+ * rays towards the same light) benefit the most from packet tracing.
+ */
+struct RayPacket8 {
+    enum {
+        /// Number of rays in a packet
+        Size = 8
+    };
+
+    float o[3][Size];    ///< Ray origins
+    float d[3][Size];    ///< Ray directions
+    float mint[Size];    ///< Minimum positions on the ray segments
+    float maxt[Size];    ///< Maximum positions on the ray segments
+    float time[Size];    ///< Times within the shutter interval
+
+    /// Store a ray in the given lane
+    void set(int lane, const Ray3f &ray) {
+        for (int i = 0; i < 3; ++i) {
+            o[i][lane] = ray.o[i];
+            d[i][lane] = ray.d[i];
+        }
+        mint[lane] = ray.mint;
+        maxt[lane] = ray.maxt;
+        time[lane] = ray.time;
+    }
+
+    /// Return the ray stored in the given lane
+    Ray3f get(int lane) const {
+        Ray3f ray(Point3f(o[0][lane], o[1][lane], o[2][lane]),
+                  Vector3f(d[0][lane], d[1][lane], d[2][lane]),
+                  mint[lane], maxt[lane]);
+        ray.time = time[lane];
+        return ray;
+    }
+};
+
+NORI_NAMESPACE_END
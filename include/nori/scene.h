@@ -59,6 +59,26 @@ public:
     /// Return a reference to an array containing all meshes
     const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
 
+    /// Return a reference to an array containing all instances
+    const std::vector<Instance *> &getInstances() const { return m_instances; }
+
+    /**
+     * \brief Does any mesh move during the shutter interval?
+     *
+     * Only then do camera rays need a time; static scenes leave it at zero
+     * and draw no sample for it.
+     */
+    bool isMoving() const { return m_moving; }
+
+    /**
+     * \brief Return the two-level accelerator of the instances
+     *
+     * This is \c nullptr if the scene does not contain any instances.
+     * Moving instances with \ref InstanceAccel::setTransform() and calling
+     * \ref InstanceAccel::build() only rebuilds the top level.
+     */
+    InstanceAccel *getInstanceAccel() { return m_instanceAccel; }
+
     /**
      * \brief Intersect a ray against all triangles stored in the scene
      * and return detailed intersection information
@@ -81,22 +101,57 @@ public:
      * \brief Intersect a ray against all triangles stored in the scene
      * and \a only determine whether or not there is an intersection.
      *
-     * This method much faster than the other ray tracing function,
-     * but the performance comes at the cost of not providing any
-     * additional information about the detected intersection
-     * (not even its position).
+     * Kept for compatibility; this simply calls \ref occluded().
+     */
+    bool rayIntersect(const Ray3f &ray) const {
+        return occluded(ray);
+    }
+
+    /**
+     * \brief Determine whether a ray segment is blocked by any triangle
+     * (e.g. a shadow ray towards a light source)
      *
-     * \param ray
-     *    A 3-dimensional ray data structure with minimum/maximum
-     *    extent information
+     * This uses a dedicated traversal of the accelerator that stops at the
+     * first intersection found (see \ref Accel::occluded()).
      *
      * \return \c true if an intersection was found
      */
-    bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_accel->rayIntersect(ray, its, true);
+    bool occluded(const Ray3f &ray) const {
+        return m_accel->occluded(ray);
     }
 
+    /**
+     * \brief Intersect a batch of rays against all triangles stored in
+     * the scene and return detailed intersection information
+     *
+     * The rays are traced in packets of \ref RayPacket8::Size, which is
+     * considerably faster than individual queries for coherent rays (e.g.
+     * the camera rays of an image block).
+     *
+     * \param rays
+     *    The rays to be traced
+     *
+     * \param its
+     *    Resized to <tt>rays.size()</tt>; entry \c i is filled if
+     *    <tt>hits[i]</tt> is set
+     *
+     * \param hits
+     *    Resized to <tt>rays.size()</tt>; nonzero for every ray that
+     *    found an intersection
+     */
+    void rayIntersect(const std::vector<Ray3f> &rays, std::vector<Intersection> &its,
+                      std::vector<uint8_t> &hits) const;
+
+    /**
+     * \brief Determine for a batch of rays whether they intersect any
+     * triangle (e.g. a group of shadow rays)
+     *
+     * \param occluded
+     *    Resized to <tt>rays.size()</tt>; nonzero for every ray that
+     *    found an intersection
+     */
+    void rayIntersect(const std::vector<Ray3f> &rays, std::vector<uint8_t> &occluded) const;
+
     /// \brief Return an axis-aligned box that bounds the scene
     const BoundingBox3f &getBoundingBox() const {
         return m_accel->getBoundingBox();
@@ -123,10 +178,13 @@ public:
     EClassType getClassType() const { return EScene; }
 private:
     std::vector<Mesh *> m_meshes;
+    std::vector<Instance *> m_instances;
+    InstanceAccel *m_instanceAccel = nullptr; ///< Alias of \c m_accel if there are instances
     Integrator *m_integrator = nullptr;
     Sampler *m_sampler = nullptr;
     Camera *m_camera = nullptr;
     Accel *m_accel = nullptr;
+    bool m_moving = false;
 public:
     DiscretePDF m_dpdf;                  ///< Discrete PDF for sampling triangles
     std::vector<Emitter*> m_lights;      ///< List of all lights in the scene
@@ -81,11 +81,13 @@ public:
 
     /// Apply the homogeneous transformation to a ray
     Ray3f operator*(const Ray3f &r) const {
-        return Ray3f(
+        Ray3f result(
             operator*(r.o), 
             operator*(r.d), 
             r.mint, r.maxt
         );
+        result.time = r.time;
+        return result;
     }
 
     /// Return a string representation
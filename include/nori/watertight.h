@@ -0,0 +1,109 @@
+#pragma once
+
+#include <nori/ray.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Per-ray data of the watertight ray-triangle intersection test
+ *
+ * The test transforms the triangle vertices into a coordinate system in
+ * which the ray starts at the origin and points along the +Z axis, and
+ * then evaluates 2D edge functions. Points on an edge shared by two
+ * triangles produce the same edge function values for both of them, so
+ * that rays can no longer slip through the cracks between adjacent
+ * triangles. The ray-dependent part of the transformation (the axis
+ * permutation and shear) is computed once here.
+ *
+ * "Watertight Ray/Triangle Intersection" by Woop, Benthin and Wald
+ * (Journal of Computer Graphics Techniques, 2013)
+ */
+struct WatertightRay {
+    Point3f o;        ///< Ray origin
+    int kx, ky, kz;   ///< Permutation of the axes (\c kz is the dominant direction axis)
+    float Sx, Sy, Sz; ///< Shear constants
+
+    /// Create an uninitialized record
+    WatertightRay() { }
+
+    WatertightRay(const Ray3f &ray) : o(ray.o) {
+        /* Make the largest direction component the Z axis, and keep the
+           winding of the transformed triangles by swapping X and Y if
+           that component is negative */
+        ray.d.cwiseAbs().maxCoeff(&kz);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        if (ray.d[kz] < 0)
+            std::swap(kx, ky);
+
+        Sx = ray.d[kx] / ray.d[kz];
+        Sy = ray.d[ky] / ray.d[kz];
+        Sz = 1.0f / ray.d[kz];
+    }
+};
+
+/**
+ * \brief Per-ray data of the triangle test that Nori was compiled with
+ *
+ * Traversals create this once per query and pass it to every triangle
+ * test. It is a \ref WatertightRay with \c NORI_WATERTIGHT, and empty
+ * otherwise, since the Moeller-Trumbore test needs no per-ray setup.
+ */
+#if defined(NORI_WATERTIGHT)
+typedef WatertightRay TriangleRay;
+#else
+struct TriangleRay {
+    TriangleRay() { }
+    TriangleRay(const Ray3f &) { }
+};
+#endif
+
+/**
+ * \brief Watertight intersection of a ray with the triangle (p0, p1, p2)
+ *
+ * On success, \c t holds the ray distance, and \c u and \c v the
+ * barycentric coordinates of \c p1 and \c p2 (same convention as
+ * \ref Mesh::rayIntersect()). Edge function values of exactly zero are
+ * recomputed in double precision, as required for watertightness.
+ */
+inline bool rayIntersectWatertight(const WatertightRay &ray, const Point3f &p0,
+        const Point3f &p1, const Point3f &p2, float mint, float maxt,
+        float &u, float &v, float &t) {
+    /* Vertices relative to the ray origin */
+    Vector3f A = p0 - ray.o, B = p1 - ray.o, C = p2 - ray.o;
+
+    /* Shear and scale the vertices */
+    float Ax = A[ray.kx] - ray.Sx * A[ray.kz], Ay = A[ray.ky] - ray.Sy * A[ray.kz];
+    float Bx = B[ray.kx] - ray.Sx * B[ray.kz], By = B[ray.ky] - ray.Sy * B[ray.kz];
+    float Cx = C[ray.kx] - ray.Sx * C[ray.kz], Cy = C[ray.ky] - ray.Sy * C[ray.kz];
+
+    /* Scaled barycentric coordinates */
+    float U = Cx * By - Cy * Bx;
+    float V = Ax * Cy - Ay * Cx;
+    float W = Bx * Ay - By * Ax;
+
+    if (U == 0.0f || V == 0.0f || W == 0.0f) {
+        U = (float) ((double) Cx * (double) By - (double) Cy * (double) Bx);
+        V = (float) ((double) Ax * (double) Cy - (double) Ay * (double) Cx);
+        W = (float) ((double) Bx * (double) Ay - (double) By * (double) Ax);
+    }
+
+    /* The ray passes outside of an edge, or the triangle is seen edge-on */
+    if ((U < 0.0f || V < 0.0f || W < 0.0f) && (U > 0.0f || V > 0.0f || W > 0.0f))
+        return false;
+    float det = U + V + W;
+    if (det == 0.0f)
+        return false;
+
+    /* Scaled hit distance */
+    float T = ray.Sz * (U * A[ray.kz] + V * B[ray.kz] + W * C[ray.kz]);
+
+    float invDet = 1.0f / det;
+    t = T * invDet;
+    u = V * invDet;
+    v = W * invDet;
+
+    return t >= mint && t <= maxt;
+}
+
+NORI_NAMESPACE_END
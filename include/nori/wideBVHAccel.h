@@ -0,0 +1,85 @@
+#pragma once
+
+#include <nori/bvhAccel.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Wide (4-ary or 8-ary) Bounding Volume Hierarchy
+ *
+ * This accelerator first builds the binary SAH hierarchy of \ref BVHAccel
+ * and then collapses it into nodes with up to \c Width children. The child
+ * boxes of a node are stored in structure-of-arrays form, so that a single
+ * vectorized slab test (SSE for <tt>Width=4</tt>, AVX for <tt>Width=8</tt>)
+ * intersects all of them at once. Children are visited in front-to-back
+ * order of their entry distance (except by occlusion queries).
+ *
+ * The binary \ref BVHAccel remains the reference implementation.
+ *
+ * "Shallow Bounding Volume Hierarchies for Fast SIMD Ray Tracing of
+ * Incoherent Rays" by Dammertz et al. (Computer Graphics Forum, 2008)
+ */
+template <int Width> class WideBVHAccel : public BVHAccel {
+public:
+    /// Create a new and empty wide BVH
+    WideBVHAccel() { }
+
+    /// Create a new and empty wide BVH with the build settings of a scene description
+    WideBVHAccel(const PropertyList& propList) : BVHAccel(propList) { }
+
+    /// Build the binary BVH and collapse it into wide nodes
+    void build() override;
+
+    /// Refit the binary BVH and collapse it again (see \ref BVHAccel::refit())
+    bool refit() override;
+
+    /// Intersect a ray against all triangle meshes registered with the BVH
+    bool rayIntersect(const Ray3f& ray, Intersection& its,
+        bool shadowRay = false) const override;
+
+    /**
+     * \brief Determine whether a ray intersects any triangle
+     *
+     * The children of a node are stored in order of decreasing surface
+     * area, and this traversal visits them in that order.
+     */
+    bool occluded(const Ray3f& ray) const override;
+
+    /// Return the memory used by the binary and the wide nodes
+    size_t getMemoryUsage() const override;
+
+protected:
+    enum {
+        /// Marks a child slot that refers to a range of triangle indices
+        LEAF_FLAG = 0x80000000u,
+
+        /// Marks an unused child slot
+        EMPTY_SLOT = 0xFFFFFFFFu
+    };
+
+    /// Wide BVH node with child bounds in structure-of-arrays layout
+    struct alignas(Width * sizeof(float)) WideNode {
+        /// Child bounds: rows 0-2 hold the minima, rows 3-5 the maxima
+        float bounds[6][Width];
+
+        /// Wide node index, or <tt>LEAF_FLAG | start</tt> for leaves
+        uint32_t child[Width];
+
+        /// Number of triangles referenced by a leaf child
+        uint32_t count[Width];
+    };
+
+    /// Recursively convert the binary subtree below \c node_idx
+    uint32_t collapse(uint32_t node_idx);
+
+private:
+    std::vector<WideNode> m_wideNodes; ///< Collapsed BVH nodes
+};
+
+/// 4-wide BVH (SSE node tests)
+typedef WideBVHAccel<4> QBVHAccel;
+
+/// 8-wide BVH (AVX node tests)
+typedef WideBVHAccel<8> OBVHAccel;
+
+NORI_NAMESPACE_END
@@ -2,6 +2,8 @@ from __future__ import print_function
 import os
 import subprocess
 import sys
+import tempfile
+import xml.etree.ElementTree as ET
 
 TEST_SCENES = [
     "pa4/tests/test-mesh.xml",
@@ -30,6 +32,98 @@ TEST_WARPS = [
     ("microfacet_brdf", (0.30, 0.5)),
 ]
 
+# Scenes that are rendered again with each of the VARIANTS below
+VARIANT_SCENES = [
+    "pa4/tests/test-mesh.xml",
+    "pa4/tests/test-mesh-furnace.xml",
+]
+
+
+def add_accel(accel_type, **props):
+    """Select an accelerator by adding an <accel> element to every scene"""
+    def apply(scene):
+        accel = ET.Element("accel", type=accel_type)
+        for name, value in props.items():
+            tag = {bool: "boolean", int: "integer"}.get(type(value), "string")
+            value = str(value).lower() if isinstance(value, bool) else str(value)
+            ET.SubElement(accel, tag, name=name, value=value)
+        scene.insert(0, accel)
+        return True
+    return apply
+
+
+def set_mesh_property(tag, name, value):
+    """Add a property to every mesh"""
+    def apply(scene):
+        for mesh in scene.iter("mesh"):
+            mesh.append(ET.Element(tag, name=name, value=value))
+        return True
+    return apply
+
+
+def use_keyframes(scene):
+    """Turn every mesh into a moving mesh whose keyframes all coincide"""
+    for mesh in scene.iter("mesh"):
+        filename = mesh.find("string[@name='filename']").get("value")
+        mesh.append(ET.Element("string", name="keyframes", value=filename))
+    return True
+
+
+def use_nmesh(scene):
+    """Load the binary meshes converted with obj2nmesh"""
+    for mesh in scene.iter("mesh"):
+        mesh.set("type", "nmesh")
+        filename = mesh.find("string[@name='filename']")
+        filename.set("value", os.path.splitext(filename.get("value"))[0] + ".nmesh")
+    return True
+
+
+def use_instances(scene):
+    """Wrap the meshes that do not emit light into instances"""
+    applied = False
+    for i, mesh in enumerate(list(scene)):
+        if mesh.tag == "mesh" and mesh.find("emitter") is None:
+            instance = ET.Element("instance")
+            instance.append(mesh)
+            scene.remove(mesh)
+            scene.insert(i, instance)
+            applied = True
+    return applied
+
+
+VARIANTS = [
+    ("bvh-lbvh", add_accel("bvh", builder="lbvh")),
+    ("bvh-hlbvh", add_accel("bvh", builder="hlbvh")),
+    ("bvh-quantized8", add_accel("bvh", quantization=8)),
+    ("bvh-quantized16", add_accel("bvh", quantization=16)),
+    ("bvh-spatialsplits", add_accel("bvh", spatialSplits=True)),
+    ("bvh-optimized", add_accel("bvh", optimizationPasses=2)),
+    ("qbvh", add_accel("qbvh")),
+    ("obvh", add_accel("obvh")),
+    ("octree", add_accel("octree")),
+    ("instances", use_instances),
+    ("keyframes", use_keyframes),
+    ("compressed", set_mesh_property("boolean", "compressAttributes", "true")),
+    ("nmesh", use_nmesh),
+]
+
+
+def write_variant(path, apply):
+    """Write a copy of a test file with every scene modified by 'apply'
+    next to the original (so that relative mesh paths still resolve), or
+    return None if the variant does not apply to any scene"""
+    root = ET.parse(path).getroot()
+    applied = False
+    for scene in root.iter("scene"):
+        applied |= apply(scene)
+    if not applied:
+        return None
+    fd, variant_path = tempfile.mkstemp(suffix=".xml", dir=os.path.dirname(path))
+    with os.fdopen(fd, "wb") as f:
+        ET.ElementTree(root).write(f, encoding="utf-8", xml_declaration=True)
+    return variant_path
+
+
 def find_build_directory():
     root = os.path.join(".")
     if os.path.isfile(os.path.join(root, "nori")):
@@ -40,7 +134,7 @@ def find_build_directory():
     return os.path.join(root, "build")
 
 
-def test_warps_and_scenes(scenes, warps):
+def test_warps_and_scenes(scenes, variant_scenes, variants, warps):
     total = len(scenes) + len(warps)
     passed = 0
     failed = []
@@ -54,6 +148,21 @@ def test_warps_and_scenes(scenes, warps):
         else:
             failed.append(t)
 
+    for t in variant_scenes:
+        for (name, apply) in variants:
+            path = write_variant(os.path.join("scenes", t), apply)
+            if path is None:
+                continue
+            total += 1
+            try:
+                ret = subprocess.call([os.path.join(build_dir, "nori"), path])
+            finally:
+                os.remove(path)
+            if ret == 0:
+                passed += 1
+            else:
+                failed.append(t + " (" + name + ")")
+
     for (warp_type, param) in warps:
         args = [os.path.join(build_dir, "warptest"), warp_type]
         if param is not None:
@@ -83,5 +192,5 @@ def test_warps_and_scenes(scenes, warps):
 
 
 if __name__ == '__main__':
-    if not test_warps_and_scenes(TEST_SCENES, TEST_WARPS):
+    if not test_warps_and_scenes(TEST_SCENES, VARIANT_SCENES, VARIANTS, TEST_WARPS):
         sys.exit(1)
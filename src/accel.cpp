@@ -21,6 +21,10 @@
 #include <iostream>
 NORI_NAMESPACE_BEGIN
 
+#if defined(NORI_ACCEL_STATS)
+thread_local uint64_t Accel::s_nodeVisits = 0;
+#endif
+
 void Accel::addMesh(Mesh *mesh) {
     if (m_mesh)
         throw NoriException("Accel: only a single mesh is supported!");
@@ -37,11 +41,12 @@ bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) c
     uint32_t f = (uint32_t) -1;      // Triangle index of the closest intersection
 
     Ray3f ray(ray_); /// Make a copy of the ray (we will need to update its '.maxt' value)
+    TriangleRay tray(ray);
 
     /* Brute force search through all triangles */
     for (uint32_t idx = 0; idx < m_mesh->getTriangleCount(); ++idx) {
         float u, v, t;
-        if (m_mesh->rayIntersect(idx, ray, u, v, t)) {
+        if (m_mesh->rayIntersect(idx, ray, tray, u, v, t)) {
             /* An intersection was found! Can terminate
                immediately if this is a shadow ray query */
             if (shadowRay)
@@ -68,30 +73,30 @@ bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) c
 
         /* References to all relevant mesh buffers */
         const Mesh *mesh   = its.mesh;
-        const MatrixXf &V  = mesh->getVertexPositions();
-        const MatrixXf &N  = mesh->getVertexNormals();
-        const MatrixXf &UV = mesh->getVertexTexCoords();
-        const MatrixXu &F  = mesh->getIndices();
+        const MatrixXuView &F  = mesh->getIndices();
 
         /* Vertex indices of the triangle */
         uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
 
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+        /* Vertex positions at the time of the ray (moving meshes) */
+        Point3f p0 = mesh->getVertexPosition(idx0, ray.time),
+                p1 = mesh->getVertexPosition(idx1, ray.time),
+                p2 = mesh->getVertexPosition(idx2, ray.time);
 
         /* Compute the intersection positon accurately
            using barycentric coordinates */
         its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
 
         /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-                bary.y() * UV.col(idx1) +
-                bary.z() * UV.col(idx2);
+        if (mesh->hasVertexTexCoords())
+            its.uv = bary.x() * mesh->getVertexTexCoord(idx0) +
+                bary.y() * mesh->getVertexTexCoord(idx1) +
+                bary.z() * mesh->getVertexTexCoord(idx2);
 
         /* Compute the geometry frame */
         its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
 
-        if (N.size() > 0) {
+        if (mesh->hasVertexNormals()) {
             /* Compute the shading frame. Note that for simplicity,
                the current implementation doesn't attempt to provide
                tangents that are continuous across the surface. That
@@ -99,9 +104,9 @@ bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) c
                use anisotropic BRDFs, which need tangent continuity */
 
             its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                 bary.y() * N.col(idx1) +
-                 bary.z() * N.col(idx2)).normalized());
+                (bary.x() * mesh->getVertexNormal(idx0, ray.time) +
+                 bary.y() * mesh->getVertexNormal(idx1, ray.time) +
+                 bary.z() * mesh->getVertexNormal(idx2, ray.time)).normalized());
         } else {
             its.shFrame = its.geoFrame;
         }
@@ -110,5 +115,31 @@ bool Accel::rayIntersect(const Ray3f &ray_, Intersection &its, bool shadowRay) c
     return foundIntersection;
 }
 
+bool Accel::occluded(const Ray3f &ray) const {
+    Intersection its; /* Unused */
+    return rayIntersect(ray, its, true);
+}
+
+int Accel::rayIntersect8(const RayPacket8 &packet, int active,
+        Intersection *its, bool shadowRay) const {
+    int hits = 0;
+    Intersection unused;
+    for (int i = 0; i < RayPacket8::Size; ++i) {
+        if (!(active & (1 << i)))
+            continue;
+        if (rayIntersect(packet.get(i), its ? its[i] : unused, shadowRay))
+            hits |= 1 << i;
+    }
+    return hits;
+}
+
+void Accel::rayIntersectStream(const RayPacket8 *packets, const int *active,
+        size_t count, Intersection *its, int *hits, bool shadowRay) const {
+    for (size_t i = 0; i < count; ++i)
+        hits[i] = rayIntersect8(packets[i], active[i],
+            its ? its + i * RayPacket8::Size : nullptr, shadowRay);
+}
+
+NORI_REGISTER_CLASS(Accel, "bruteforce");
 NORI_NAMESPACE_END
 
@@ -20,14 +20,14 @@ public:
         Point2f sample = sampler->next2D();
         Vector3f sampleDir = its.shFrame.toWorld( Warp::squareToCosineHemisphere(sample) ).normalized();
 
-        Ray3f aoRay(its.p, sampleDir);
+        Ray3f aoRay(its.p, sampleDir, ray.time);
         aoRay.mint = 0.001;
 #ifdef GLOBALAO
         aoRay.maxt = std::numeric_limits<float>::infinity();
 #elif
         aoRay.maxt = _ALPHA;
 #endif
-        if(scene->rayIntersect(aoRay)) return Color3f(0.0f);
+        if(scene->occluded(aoRay)) return Color3f(0.0f);
 
         Normal3f n = its.shFrame.n.cwiseAbs();
         float cosTheta = std::max(0.0f, n.dot(sampleDir));
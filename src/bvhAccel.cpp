@@ -18,9 +18,20 @@
 
 #include <nori/bvhAccel.h>
 #include <nori/timer.h>
+#include <nori/mmap.h>
+#include <nori/watertight.h>
+#include <nori/hash.h>
+#include <filesystem/resolver.h>
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <random>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 /*
  * =======================================================================
@@ -33,12 +44,124 @@
 
 NORI_NAMESPACE_BEGIN
 
-/* Bin data structure for counting triangles and computing their bounding box */
+/* Bin data structure for counting triangles and computing their bounding box
+   (and the bounding box of their centroids) along all three axes at once */
 struct Bins {
-    static const int BIN_COUNT = 16;
-    Bins() { memset(counts, 0, sizeof(uint32_t) * BIN_COUNT); }
-    uint32_t counts[BIN_COUNT];
-    BoundingBox3f bbox[BIN_COUNT];
+    static const int MAX_BIN_COUNT = BVHAccel::MAX_BIN_COUNT;
+    Bins() { memset(counts, 0, sizeof(counts)); }
+    uint32_t counts[3][MAX_BIN_COUNT];
+    BoundingBox3f bbox[3][MAX_BIN_COUNT];
+    BoundingBox3f centroids[3][MAX_BIN_COUNT];
+
+    /// Clear the first \c binCount bins of every axis
+    void reset(int binCount) {
+        for (int axis = 0; axis < 3; ++axis) {
+            for (int i = 0; i < binCount; ++i) {
+                counts[axis][i] = 0;
+                bbox[axis][i].reset();
+                centroids[axis][i].reset();
+            }
+        }
+    }
+};
+
+/* Maps triangle centroids to bins that evenly subdivide the centroid bounds of a node */
+struct BinMapping {
+    float min[3], scale[3];
+    int binCount;
+
+    BinMapping(const BoundingBox3f& centroids, int binCount) : binCount(binCount) {
+        for (int axis = 0; axis < 3; ++axis) {
+            float extent = centroids.max[axis] - centroids.min[axis];
+            min[axis] = centroids.min[axis];
+            /* All centroids fall into the first bin along a degenerate axis */
+            scale[axis] = extent > 0 ? binCount / extent : 0.0f;
+        }
+    }
+
+    int operator()(const Point3f& centroid, int axis) const {
+        return std::min(std::max((int)((centroid[axis] - min[axis]) * scale[axis]), 0),
+            binCount - 1);
+    }
+};
+
+/**
+ * \brief Node storage of the BVH builders
+ *
+ * Inner nodes allocate their two children next to each other, so that
+ * subtrees can be built concurrently without knowing their final size and
+ * without reserving space for the worst case of <tt>2N-1</tt> nodes.
+ * While building, \c inner.rightChild holds the index of the left child,
+ * and the right child follows it. \ref store() then copies the nodes into
+ * the depth-first layout used by the traversal.
+ */
+class BVHNodePool {
+public:
+    typedef BVHAccel::BVHNode BVHNode;
+
+    /// Allocate \c count consecutive (cleared) nodes and return the index of the first one
+    uint32_t allocate(uint32_t count) {
+        auto it = nodes.grow_by(count);
+        uint32_t index = (uint32_t)(it - nodes.begin());
+        for (uint32_t i = 0; i < count; ++i)
+            nodes[index + i].data = 0;
+        return index;
+    }
+
+    /// Allocate both children of a node and return the index of the left one
+    uint32_t allocateChildren() { return allocate(2); }
+
+    BVHNode& operator[](uint32_t index) { return nodes[index]; }
+
+    /// Release all nodes
+    void clear() { nodes.clear(); }
+
+    /// Return the depth of the tree below node 0
+    int depth() const {
+        int result = 0;
+        std::vector<std::pair<uint32_t, int>> stack;
+        stack.push_back({ 0u, 0 });
+        while (!stack.empty()) {
+            std::pair<uint32_t, int> entry = stack.back();
+            stack.pop_back();
+            result = std::max(result, entry.second);
+            const BVHNode& node = nodes[entry.first];
+            if (node.isInner()) {
+                stack.push_back({ node.inner.rightChild, entry.second + 1 });
+                stack.push_back({ node.inner.rightChild + 1, entry.second + 1 });
+            }
+        }
+        return result;
+    }
+
+    /// Write the tree below node 0 in depth-first order (left child at <tt>idx+1</tt>)
+    void store(std::vector<BVHNode>& result) const {
+        const uint32_t NO_PARENT = 0xFFFFFFFFu;
+        result.clear();
+        result.reserve(nodes.size());
+
+        /* Pairs of a node and the output node whose right child it is */
+        std::vector<std::pair<uint32_t, uint32_t>> stack;
+        stack.push_back({ 0u, NO_PARENT });
+        while (!stack.empty()) {
+            std::pair<uint32_t, uint32_t> entry = stack.back();
+            stack.pop_back();
+
+            uint32_t out = (uint32_t)result.size();
+            if (entry.second != NO_PARENT)
+                result[entry.second].inner.rightChild = out;
+            result.push_back(nodes[entry.first]);
+
+            if (result.back().isInner()) {
+                uint32_t left = result.back().inner.rightChild;
+                stack.push_back({ left + 1, out });
+                stack.push_back({ left, NO_PARENT });
+            }
+        }
+    }
+
+private:
+    tbb::concurrent_vector<BVHNode> nodes;
 };
 
 /**
@@ -54,23 +177,37 @@ struct Bins {
 class BVHBuildTask : public tbb::task {
 private:
     BVHAccel& bvh;
+    BVHNodePool& nodes;
     uint32_t node_idx;
     uint32_t* start, * end, * temp;
+    BoundingBox3f centroids;
 
 public:
     /// Build-related parameters
     enum {
-        /// Switch to a serial build when less than 32 triangles are left
-        SERIAL_THRESHOLD = 32,
-
         /// Process triangles in batches of 1K for the purpose of parallelization
         GRAIN_SIZE = 1000,
 
         /// Heuristic cost value for traversal operations
-        TRAVERSAL_COST = 1,
+        TRAVERSAL_COST = 2,
+
+        /**
+         * Heuristic cost value for intersection operations (per triangle).
+         * Leaves test their triangles in packets, which makes one triangle
+         * about half as expensive as a box test
+         */
+        INTERSECTION_COST = 1,
 
-        /// Heuristic cost value for intersection operations
-        INTERSECTION_COST = 1
+        /// Nodes with more triangles are split even if the SAH suggests a leaf
+        MAX_LEAF_SIZE = 16
+    };
+
+    /// Best split plane found in the binned data of a node
+    struct Split {
+        int axis = -1, index = -1;
+        uint32_t count_left = 0;
+        BoundingBox3f bbox_left, bbox_right;
+        BoundingBox3f centroids_left, centroids_right;
     };
 
 public:
@@ -80,6 +217,9 @@ public:
      * \param bvh
      *    Reference to the underlying BVHAccel
      *
+     * \param nodes
+     *    Storage of the nodes that are being built
+     *
      * \param node_idx
      *    Index of the BVHAccel node that should be built
      *
@@ -93,24 +233,26 @@ public:
      *    Pointer into a temporary memory region that can be used for
      *    construction purposes. The usable length is <tt>end-start</tt>
      *    unsigned integers.
+     *
+     * \param centroids
+     *    Bounding box of the triangle centroids
      */
-    BVHBuildTask(BVHAccel& bvh, uint32_t node_idx, uint32_t* start, uint32_t* end, uint32_t* temp)
-        : bvh(bvh), node_idx(node_idx), start(start), end(end), temp(temp) { }
+    BVHBuildTask(BVHAccel& bvh, BVHNodePool& nodes, uint32_t node_idx, uint32_t* start, uint32_t* end,
+        uint32_t* temp, const BoundingBox3f& centroids)
+        : bvh(bvh), nodes(nodes), node_idx(node_idx), start(start), end(end), temp(temp), centroids(centroids) { }
 
     task* execute() {
         uint32_t size = (uint32_t)(end - start);
-        BVHAccel::BVHNode& node = bvh.m_nodes[node_idx];
+        BVHAccel::BVHNode& node = nodes[node_idx];
 
-        /* Switch to a serial build when less than SERIAL_THRESHOLD triangles are left */
-        if (size < SERIAL_THRESHOLD) {
-            execute_serially(bvh, node_idx, start, end, temp);
+        /* Switch to a serial build when less than m_serialThreshold triangles are left */
+        if (size < bvh.m_serialThreshold) {
+            std::unique_ptr<Bins> bins(new Bins());
+            execute_serially(bvh, nodes, node_idx, start, end, centroids, *bins);
             return nullptr;
         }
 
-        /* Always split along the largest axis */
-        int axis = node.bbox.getLargestAxis();
-        float min = node.bbox.min[axis], max = node.bbox.max[axis],
-            inv_bin_size = Bins::BIN_COUNT / (max - min);
+        BinMapping mapping(centroids, bvh.m_binCount);
 
         /* Accumulate all triangles into bins */
         Bins bins = tbb::parallel_reduce(
@@ -118,75 +260,70 @@ public:
             Bins(),
             /* MAP: Bin a number of triangles and return the resulting 'Bins' data structure */
             [&](const tbb::blocked_range<uint32_t>& range, Bins result) {
-                for (uint32_t i = range.begin(); i != range.end(); ++i) {
-                    uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-
-                    int index = std::min(std::max(
-                        (int)((centroid - min) * inv_bin_size), 0),
-                        (Bins::BIN_COUNT - 1));
-
-                    result.counts[index]++;
-                    result.bbox[index].expandBy(bvh.getBoundingBox(f));
-                }
+                binTriangles(bvh, start + range.begin(), start + range.end(), mapping, result);
                 return result;
             },
             /* REDUCE: Combine two 'Bins' data structures */
-            [](const Bins& b1, const Bins& b2) {
+            [&](const Bins& b1, const Bins& b2) {
                 Bins result;
-                for (int i = 0; i < Bins::BIN_COUNT; ++i) {
-                    result.counts[i] = b1.counts[i] + b2.counts[i];
-                    result.bbox[i] = BoundingBox3f::merge(b1.bbox[i], b2.bbox[i]);
+                for (int axis = 0; axis < 3; ++axis) {
+                    for (int i = 0; i < mapping.binCount; ++i) {
+                        result.counts[axis][i] = b1.counts[axis][i] + b2.counts[axis][i];
+                        result.bbox[axis][i] = BoundingBox3f::merge(b1.bbox[axis][i], b2.bbox[axis][i]);
+                        result.centroids[axis][i] = BoundingBox3f::merge(b1.centroids[axis][i], b2.centroids[axis][i]);
+                    }
                 }
                 return result;
             }
         );
 
         /* Choose the best split plane based on the binned data */
-        BoundingBox3f bbox_left[Bins::BIN_COUNT];
-        bbox_left[0] = bins.bbox[0];
-        for (int i = 1; i < Bins::BIN_COUNT; ++i) {
-            bins.counts[i] += bins.counts[i - 1];
-            bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins.bbox[i]);
-        }
-
-        BoundingBox3f bbox_right = bins.bbox[Bins::BIN_COUNT - 1], best_bbox_right;
-        int64_t best_index = -1;
-        float best_cost = (float)INTERSECTION_COST * size;
-        float tri_factor = (float)INTERSECTION_COST / node.bbox.getSurfaceArea();
+        Split split = findSplit(bins, mapping.binCount, node.bbox, size);
 
-        for (int i = Bins::BIN_COUNT - 2; i >= 0; --i) {
-            uint32_t prims_left = bins.counts[i], prims_right = (uint32_t)(end - start) - bins.counts[i];
-            float sah_cost = 2.0f * TRAVERSAL_COST +
-                tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
-                    prims_right * bbox_right.getSurfaceArea());
-            if (sah_cost < best_cost) {
-                best_cost = sah_cost;
-                best_index = i;
-                best_bbox_right = bbox_right;
-            }
-            bbox_right = BoundingBox3f::merge(bbox_right, bins.bbox[i]);
-        }
-
-        if (best_index == -1) {
-            /* Could not find a good split plane -- retry with
-               more careful serial code just to be sure.. */
-            execute_serially(bvh, node_idx, start, end, temp);
+        if (split.axis == -1 && size <= MAX_LEAF_SIZE) {
+            /* Splitting does not reduce the cost, make a leaf */
+            makeLeaf(bvh, node, start, size);
             return nullptr;
+        } else if (split.axis == -1) {
+            split = medianSplit(bvh, start, end, centroids);
+        } else {
+            partition(mapping, split, start, size);
         }
 
-        uint32_t left_count = bins.counts[best_index];
-        int node_idx_left = node_idx + 1;
-        int node_idx_right = node_idx + 2 * left_count;
+        uint32_t left_count = split.count_left;
+        uint32_t node_idx_left = nodes.allocateChildren();
+        uint32_t node_idx_right = node_idx_left + 1;
 
-        bvh.m_nodes[node_idx_left].bbox = bbox_left[best_index];
-        bvh.m_nodes[node_idx_right].bbox = best_bbox_right;
-        node.inner.rightChild = node_idx_right;
-        node.inner.axis = axis;
+        nodes[node_idx_left].bbox = split.bbox_left;
+        nodes[node_idx_right].bbox = split.bbox_right;
+        node.inner.rightChild = node_idx_left;
+        node.inner.axis = split.axis;
         node.inner.flag = 0;
 
+        /* Create an empty parent task */
+        tbb::task& c = *new (allocate_continuation()) tbb::empty_task;
+        c.set_ref_count(2);
+
+        /* Post right subtree to scheduler */
+        BVHBuildTask& b = *new (c.allocate_child())
+            BVHBuildTask(bvh, nodes, node_idx_right, start + left_count,
+                end, temp + left_count, split.centroids_right);
+        spawn(b);
+
+        /* Directly start working on left subtree */
+        recycle_as_child_of(c);
+        node_idx = node_idx_left;
+        end = start + left_count;
+        centroids = split.centroids_left;
+
+        return this;
+    }
+
+    /// Reorder the triangles of this task in parallel according to a binned split
+    void partition(const BinMapping& mapping, const Split& split, uint32_t* start, uint32_t size) {
+        int axis = split.axis, best_index = split.index;
         std::atomic<uint32_t> offset_left(0),
-            offset_right(bins.counts[best_index]);
+            offset_right(split.count_left);
 
         tbb::parallel_for(
             tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
@@ -194,16 +331,14 @@ public:
                 uint32_t count_left = 0, count_right = 0;
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-                    int index = (int)((centroid - min) * inv_bin_size);
+                    int index = mapping(bvh.getCentroid(f), axis);
                     (index <= best_index ? count_left : count_right)++;
                 }
                 uint32_t idx_l = offset_left.fetch_add(count_left);
                 uint32_t idx_r = offset_right.fetch_add(count_right);
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-                    int index = (int)((centroid - min) * inv_bin_size);
+                    int index = mapping(bvh.getCentroid(f), axis);
                     if (index <= best_index)
                         temp[idx_l++] = f;
                     else
@@ -212,298 +347,2939 @@ public:
             }
         );
         memcpy(start, temp, size * sizeof(uint32_t));
-        assert(offset_left == left_count && offset_right == size);
-
-        /* Create an empty parent task */
-        tbb::task& c = *new (allocate_continuation()) tbb::empty_task;
-        c.set_ref_count(2);
-
-        /* Post right subtree to scheduler */
-        BVHBuildTask& b = *new (c.allocate_child())
-            BVHBuildTask(bvh, node_idx_right, start + left_count,
-                end, temp + left_count);
-        spawn(b);
+        assert(offset_left == split.count_left && offset_right == size);
+    }
 
-        /* Directly start working on left subtree */
-        recycle_as_child_of(c);
-        node_idx = node_idx_left;
-        end = start + left_count;
+    /**
+     * \brief Split at the median centroid along the largest axis of the
+     * centroid bounds (or in half if all centroids coincide)
+     *
+     * Used for nodes that are too large for a leaf, but where the binned
+     * sweep found no split, e.g. because all centroids fall into one bin.
+     */
+    static Split medianSplit(const BVHAccel& bvh, uint32_t* start, uint32_t* end,
+        const BoundingBox3f& centroids) {
+        uint32_t size = (uint32_t)(end - start);
+        Split split;
+        split.axis = centroids.getMajorAxis();
+        split.count_left = size / 2;
+
+        std::nth_element(start, start + split.count_left, end, [&](uint32_t f1, uint32_t f2) {
+            return bvh.getCentroid(f1)[split.axis] < bvh.getCentroid(f2)[split.axis];
+        });
+
+        for (uint32_t i = 0; i < size; ++i) {
+            bool left = i < split.count_left;
+            (left ? split.bbox_left : split.bbox_right).expandBy(bvh.getBoundingBox(start[i]));
+            (left ? split.centroids_left : split.centroids_right).expandBy(bvh.getCentroid(start[i]));
+        }
+        return split;
+    }
 
-        return this;
+    /// Accumulate the triangles <tt>[start, end)</tt> into bins along all axes
+    static void binTriangles(const BVHAccel& bvh, const uint32_t* start, const uint32_t* end,
+        const BinMapping& mapping, Bins& bins) {
+        for (const uint32_t* it = start; it != end; ++it) {
+            uint32_t f = *it;
+            Point3f centroid = bvh.getCentroid(f);
+            BoundingBox3f bbox = bvh.getBoundingBox(f);
+            for (int axis = 0; axis < 3; ++axis) {
+                int index = mapping(centroid, axis);
+                bins.counts[axis][index]++;
+                bins.bbox[axis][index].expandBy(bbox);
+                bins.centroids[axis][index].expandBy(centroid);
+            }
+        }
     }
 
-    /// Single-threaded build function
-    static void execute_serially(BVHAccel& bvh, uint32_t node_idx, uint32_t* start, uint32_t* end, uint32_t* temp) {
-        BVHAccel::BVHNode& node = bvh.m_nodes[node_idx];
-        uint32_t size = (uint32_t)(end - start);
+    /// Sweep the bins of all axes and return the split with the lowest SAH cost
+    static Split findSplit(const Bins& bins, int binCount, const BoundingBox3f& bbox, uint32_t size) {
+        Split best;
         float best_cost = (float)INTERSECTION_COST * size;
-        int64_t best_index = -1, best_axis = -1;
-        float* left_areas = (float*)temp;
+        float tri_factor = (float)INTERSECTION_COST / bbox.getSurfaceArea();
 
-        /* Try splitting along every axis */
         for (int axis = 0; axis < 3; ++axis) {
-            /* Sort all triangles based on their centroid positions projected on the axis */
-            std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-                return bvh.getCentroid(f1)[axis] < bvh.getCentroid(f2)[axis];
-                });
-
-            BoundingBox3f bbox;
-            for (uint32_t i = 0; i < size; ++i) {
-                uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
-                left_areas[i] = (float)bbox.getSurfaceArea();
-            }
-            if (axis == 0)
-                node.bbox = bbox;
-
-            bbox.reset();
-
-            /* Choose the best split plane */
-            float tri_factor = INTERSECTION_COST / node.bbox.getSurfaceArea();
-            for (uint32_t i = size - 1; i >= 1; --i) {
-                uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
+            /* Only the areas are needed during the sweep */
+            float area_right[Bins::MAX_BIN_COUNT];
+            BoundingBox3f bbox_right;
+            for (int i = binCount - 1; i > 0; --i) {
+                bbox_right.expandBy(bins.bbox[axis][i]);
+                area_right[i] = bbox_right.getSurfaceArea();
+            }
 
-                float left_area = left_areas[i - 1];
-                float right_area = bbox.getSurfaceArea();
-                uint32_t prims_left = i;
-                uint32_t prims_right = size - i;
+            BoundingBox3f bbox_left;
+            uint32_t prims_left = 0;
+            for (int i = 0; i < binCount - 1; ++i) {
+                bbox_left.expandBy(bins.bbox[axis][i]);
+                prims_left += bins.counts[axis][i];
+                uint32_t prims_right = size - prims_left;
+                if (prims_left == 0 || prims_right == 0)
+                    continue;
 
                 float sah_cost = 2.0f * TRAVERSAL_COST +
-                    tri_factor * (prims_left * left_area +
-                        prims_right * right_area);
-
+                    tri_factor * (prims_left * bbox_left.getSurfaceArea() +
+                        prims_right * area_right[i + 1]);
                 if (sah_cost < best_cost) {
                     best_cost = sah_cost;
-                    best_index = i;
-                    best_axis = axis;
+                    best.axis = axis;
+                    best.index = i;
+                    best.count_left = prims_left;
                 }
             }
         }
 
-        if (best_index == -1) {
-            /* Splitting does not reduce the cost, make a leaf */
-            node.leaf.flag = 1;
-            node.leaf.start = (uint32_t)(start - bvh.m_indices.data());
-            node.leaf.size = size;
-            return;
+        if (best.axis != -1) {
+            for (int i = 0; i < binCount; ++i) {
+                bool left = i <= best.index;
+                (left ? best.bbox_left : best.bbox_right).expandBy(bins.bbox[best.axis][i]);
+                (left ? best.centroids_left : best.centroids_right).expandBy(bins.centroids[best.axis][i]);
+            }
         }
 
-        std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-            return bvh.getCentroid(f1)[best_axis] < bvh.getCentroid(f2)[best_axis];
+        return best;
+    }
+
+    /// Turn a node into a leaf referencing the given triangles
+    static void makeLeaf(BVHAccel& bvh, BVHAccel::BVHNode& node, uint32_t* start, uint32_t size) {
+        node.leaf.flag = 1;
+        node.leaf.start = (uint32_t)(start - bvh.m_indices.data());
+        node.leaf.size = size;
+    }
+
+    /// Single-threaded build function (uses \c bins as scratch space)
+    static void execute_serially(BVHAccel& bvh, BVHNodePool& nodes, uint32_t node_idx, uint32_t* start,
+        uint32_t* end, const BoundingBox3f& centroids, Bins& bins) {
+        BVHAccel::BVHNode& node = nodes[node_idx];
+        uint32_t size = (uint32_t)(end - start);
+
+        /* Small nodes do not need more bins than twice their triangle count */
+        BinMapping mapping(centroids, std::min(bvh.m_binCount, (int)std::max(2 * size, 2u)));
+        bins.reset(mapping.binCount);
+        binTriangles(bvh, start, end, mapping, bins);
+        Split split = findSplit(bins, mapping.binCount, node.bbox, size);
+
+        if (split.axis == -1 && size <= MAX_LEAF_SIZE) {
+            makeLeaf(bvh, node, start, size);
+            return;
+        } else if (split.axis == -1) {
+            split = medianSplit(bvh, start, end, centroids);
+        } else {
+            std::partition(start, end, [&](uint32_t f) {
+                return mapping(bvh.getCentroid(f), split.axis) <= split.index;
             });
+        }
 
-        uint32_t left_count = (uint32_t)best_index;
-        uint32_t node_idx_left = node_idx + 1;
-        uint32_t node_idx_right = node_idx + 2 * left_count;
-        node.inner.rightChild = node_idx_right;
-        node.inner.axis = best_axis;
+        uint32_t left_count = split.count_left;
+        uint32_t node_idx_left = nodes.allocateChildren();
+        uint32_t node_idx_right = node_idx_left + 1;
+        nodes[node_idx_left].bbox = split.bbox_left;
+        nodes[node_idx_right].bbox = split.bbox_right;
+        node.inner.rightChild = node_idx_left;
+        node.inner.axis = split.axis;
         node.inner.flag = 0;
 
-        execute_serially(bvh, node_idx_left, start, start + left_count, temp);
-        execute_serially(bvh, node_idx_right, start + left_count, end, temp + left_count);
+        execute_serially(bvh, nodes, node_idx_left, start, start + left_count, split.centroids_left, bins);
+        execute_serially(bvh, nodes, node_idx_right, start + left_count, end, split.centroids_right, bins);
     }
 };
 
-void BVHAccel::addMesh(Mesh* mesh) {
-    m_meshes.push_back(mesh);
-    m_meshOffset.push_back(m_meshOffset.back() + mesh->getTriangleCount());
-    m_bbox.expandBy(mesh->getBoundingBox());
-}
+/**
+ * \brief Builder for BVHs with spatial splits (SBVH)
+ *
+ * Large triangles that overlap many others (walls, floors, table tops)
+ * force centroid-based object splits to create strongly overlapping
+ * children. Besides binned object splits, this builder also considers
+ * splitting the node along a plane and clipping the triangles that
+ * straddle it, which then get referenced by both children. Spatial splits
+ * are only tried where the best object split leaves a significant overlap,
+ * and the total number of references is limited by a duplication budget
+ * that is distributed among the subtrees in proportion to their size.
+ *
+ * Subtrees are built in parallel and concatenated into the depth-first
+ * node layout that the traversal code expects.
+ *
+ * "Spatial Splits in Bounding Volume Hierarchies" by Martin Stich,
+ * Heiko Friedrich and Andreas Dietrich (Proc. High Performance Graphics, 2009)
+ */
+class SBVHBuilder {
+public:
+    typedef BVHAccel::BVHNode BVHNode;
 
-void BVHAccel::clear() {
-    for (auto mesh : m_meshes)
-        delete mesh;
-    m_meshes.clear();
-    m_meshOffset.clear();
-    m_meshOffset.push_back(0u);
-    m_nodes.clear();
-    m_indices.clear();
-    m_bbox.reset();
-    m_nodes.shrink_to_fit();
-    m_meshes.shrink_to_fit();
-    m_meshOffset.shrink_to_fit();
-    m_indices.shrink_to_fit();
-}
+    /// Build-related parameters
+    enum {
+        /// Build subtrees with more references than this in parallel
+        PARALLEL_THRESHOLD = 4096,
 
-void BVHAccel::build() {
-    uint32_t size = getTriangleCount();
-    if (size == 0)
-        return;
-    cout << "Constructing a SAH BVHAccel (" << m_meshes.size()
-        << (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
-        << size << " triangles) .. ";
-    cout.flush();
-    Timer timer;
+        /// Limit the depth so that the traversal stacks cannot overflow
+        MAX_DEPTH = 60
+    };
 
-    /* Conservative estimate for the total number of nodes */
-    m_nodes.resize(2 * size);
-    memset(m_nodes.data(), 0, sizeof(BVHNode) * m_nodes.size());
-    m_nodes[0].bbox = m_bbox;
-    m_indices.resize(size);
+    /// Reference to a triangle, or to a part of it after spatial splits
+    struct Reference {
+        uint32_t index;
+        BoundingBox3f bbox;
+    };
 
-    if (sizeof(BVHNode) != 32)
-        throw NoriException("BVHAccel Node is not packed! Investigate compiler settings.");
+    /// Nodes and triangle indices of a subtree in depth-first order
+    struct Subtree {
+        std::vector<BVHNode> nodes;
+        std::vector<uint32_t> indices;
+    };
+
+    /**
+     * \param bvh
+     *    Reference to the underlying BVHAccel
+     *
+     * \param rootArea
+     *    Surface area of the scene bounding box
+     */
+    SBVHBuilder(const BVHAccel& bvh, float rootArea)
+        : bvh(bvh), binCount(bvh.m_binCount), minOverlap(rootArea * 1e-5f), spatialSplits(0) { }
 
-    for (uint32_t i = 0; i < size; ++i)
-        m_indices[i] = i;
+    /// Return the number of spatial splits that were performed
+    uint32_t getSpatialSplitCount() const { return spatialSplits; }
 
-    uint32_t* indices = m_indices.data(), * temp = new uint32_t[size];
-    BVHBuildTask& task = *new(tbb::task::allocate_root())
-        BVHBuildTask(*this, 0u, indices, indices + size, temp);
-    tbb::task::spawn_root_and_wait(task);
-    delete[] temp;
-    std::pair<float, uint32_t> stats = statistics();
+    /**
+     * \brief Recursively build the subtree over the given references
+     *
+     * \param refs
+     *    Triangle references of the subtree (consumed by the build)
+     *
+     * \param bbox
+     *    Bounding box of the references
+     *
+     * \param maxRefs
+     *    Upper limit on the number of references in the subtree,
+     *    including duplicates created by spatial splits
+     */
+    void build(std::vector<Reference>& refs, const BoundingBox3f& bbox,
+        size_t maxRefs, int depth, Subtree& result) {
+        uint32_t size = (uint32_t)refs.size();
+        Split split;
+        split.cost = (float)BVHBuildTask::INTERSECTION_COST * size;
+
+        if (size > 1 && depth < MAX_DEPTH) {
+            Split objectSplit = findObjectSplit(refs, bbox);
+            if (objectSplit.cost < split.cost)
+                split = objectSplit;
+
+            /* Only try a spatial split if the children of the best object
+               split overlap noticeably and the budget is not exhausted */
+            BoundingBox3f overlap = objectSplit.bboxLeft;
+            overlap.clip(objectSplit.bboxRight);
+            if (maxRefs > size && (objectSplit.axis < 0 ||
+                    surfaceArea(overlap) > minOverlap)) {
+                Split spatialSplit = findSpatialSplit(refs, bbox);
+                if (spatialSplit.cost < split.cost)
+                    split = spatialSplit;
+            }
+        }
 
-    /* The node array was allocated conservatively and now contains
-       many unused entries -- do a compactification pass. */
-    std::vector<BVHNode> compactified(stats.second);
-    std::vector<uint32_t> skipped_accum(m_nodes.size());
+        std::vector<Reference> left, right;
+        if (split.axis >= 0) {
+            if (split.spatial)
+                performSpatialSplit(refs, split, maxRefs, left, right);
+            else
+                performObjectSplit(refs, split, left, right);
+        }
 
-    for (int64_t i = stats.second - 1, j = m_nodes.size(), skipped = 0; i >= 0; --i) {
-        while (m_nodes[--j].isUnused())
-            skipped++;
-        BVHNode& new_node = compactified[i];
-        new_node = m_nodes[j];
-        skipped_accum[j] = (uint32_t)skipped;
+        if (left.empty() || right.empty()) {
+            if (split.axis >= 0) {
+                refs = left.empty() ? std::move(right) : std::move(left);
+                size = (uint32_t)refs.size();
+            }
 
-        if (new_node.isInner()) {
-            new_node.inner.rightChild = (uint32_t)
-                (i + new_node.inner.rightChild - j -
-                    (skipped - skipped_accum[new_node.inner.rightChild]));
+            if (size > BVHBuildTask::MAX_LEAF_SIZE && depth < MAX_DEPTH) {
+                /* Too large for a leaf: split at the median instead */
+                split.axis = medianSplit(refs, left, right);
+                split.spatial = false;
+            }
+            else {
+                /* Splitting does not reduce the cost, make a leaf */
+                BVHNode node;
+                node.data = 0;
+                node.bbox = bbox;
+                node.leaf.flag = 1;
+                node.leaf.size = size;
+                node.leaf.start = 0;
+                result.nodes.push_back(node);
+                result.indices.resize(size);
+                for (uint32_t i = 0; i < size; ++i)
+                    result.indices[i] = refs[i].index;
+                return;
+            }
+        }
+        if (split.spatial)
+            spatialSplits++;
+        std::vector<Reference>().swap(refs);
+
+        /* Distribute the remaining duplication budget */
+        size_t total = left.size() + right.size();
+        size_t extra = maxRefs > total ? maxRefs - total : 0;
+        size_t extraLeft = (size_t)((double)extra * left.size() / total);
+        size_t maxLeft = left.size() + extraLeft;
+        size_t maxRight = right.size() + extra - extraLeft;
+
+        BoundingBox3f bboxLeft = computeBoundingBox(left),
+            bboxRight = computeBoundingBox(right);
+
+        Subtree subtreeLeft, subtreeRight;
+        if (size > PARALLEL_THRESHOLD) {
+            tbb::parallel_invoke(
+                [&] { build(left, bboxLeft, maxLeft, depth + 1, subtreeLeft); },
+                [&] { build(right, bboxRight, maxRight, depth + 1, subtreeRight); }
+            );
         }
+        else {
+            build(left, bboxLeft, maxLeft, depth + 1, subtreeLeft);
+            build(right, bboxRight, maxRight, depth + 1, subtreeRight);
+        }
+
+        /* Concatenate the node and both subtrees */
+        uint32_t nodesLeft = (uint32_t)subtreeLeft.nodes.size();
+        BVHNode node;
+        node.data = 0;
+        node.bbox = bbox;
+        node.inner.flag = 0;
+        node.inner.axis = split.axis;
+        node.inner.rightChild = 1 + nodesLeft;
+
+        result.nodes.reserve(1 + nodesLeft + subtreeRight.nodes.size());
+        result.nodes.push_back(node);
+        append(result, subtreeLeft, 1u, 0u);
+        append(result, subtreeRight, 1u + nodesLeft,
+            (uint32_t)subtreeLeft.indices.size());
     }
-    cout << "done (took " << timer.elapsedString() << " and "
-        << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t) * m_indices.size())
-        << ", SAH cost = " << stats.first
-        << ")." << endl;
 
-    m_nodes = std::move(compactified);
-}
+protected:
+    /// Describes the best split found for a node
+    struct Split {
+        float cost;
+        int axis = -1;
+        bool spatial = false;
+        float position = 0;           ///< Spatial split: plane position
+        int bin = 0;                  ///< Object split: last bin of the left child
+        float min = 0, invBinSize = 0; ///< Object split: centroid binning
+        BoundingBox3f bboxLeft, bboxRight;
+    };
 
-std::pair<float, uint32_t> BVHAccel::statistics(uint32_t node_idx) const {
-    const BVHNode& node = m_nodes[node_idx];
-    if (node.isLeaf()) {
-        return std::make_pair((float)BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
-    }
-    else {
-        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
-        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
-        float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
-        float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
-        float saCur = node.bbox.getSurfaceArea();
-        float sahCost =
-            2 * BVHBuildTask::TRAVERSAL_COST +
-            (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
-        return std::make_pair(
-            sahCost,
-            stats_left.second + stats_right.second + 1u
-        );
+    /**
+     * \brief Split the references in half at the median centroid along the
+     * axis of the largest centroid extent and return that axis
+     *
+     * Used for nodes that are too large for a leaf, but where neither an
+     * object split nor a spatial split reduces the cost.
+     */
+    static int medianSplit(const std::vector<Reference>& refs,
+        std::vector<Reference>& left, std::vector<Reference>& right) {
+        BoundingBox3f centroids;
+        for (const Reference& ref : refs)
+            centroids.expandBy(ref.bbox.getCenter());
+        int axis = centroids.getMajorAxis();
+
+        left = refs;
+        auto median = left.begin() + left.size() / 2;
+        std::nth_element(left.begin(), median, left.end(), [axis](const Reference& r1, const Reference& r2) {
+            return r1.bbox.getCenter()[axis] < r2.bbox.getCenter()[axis];
+        });
+        right.assign(median, left.end());
+        left.erase(median, left.end());
+        return axis;
     }
-}
 
-bool BVHAccel::rayIntersect(const Ray3f& _ray, Intersection& its, bool shadowRay) const {
-    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    /// Surface area that is zero for invalid boxes
+    static float surfaceArea(const BoundingBox3f& bbox) {
+        return bbox.isValid() ? bbox.getSurfaceArea() : 0.0f;
+    }
 
-    its.t = std::numeric_limits<float>::infinity();
+    static BoundingBox3f computeBoundingBox(const std::vector<Reference>& refs) {
+        BoundingBox3f bbox;
+        for (const Reference& ref : refs)
+            bbox.expandBy(ref.bbox);
+        return bbox;
+    }
 
-    /* Use an adaptive ray epsilon */
-    Ray3f ray(_ray);
-    if (ray.mint == Epsilon)
-        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+    /// SAH cost of splitting a node (matches \ref BVHAccel::statistics())
+    static float splitCost(float invArea, uint32_t countLeft, const BoundingBox3f& bboxLeft,
+        uint32_t countRight, const BoundingBox3f& bboxRight) {
+        return 2.0f * BVHBuildTask::TRAVERSAL_COST +
+            BVHBuildTask::INTERSECTION_COST * invArea *
+            (countLeft * surfaceArea(bboxLeft) + countRight * surfaceArea(bboxRight));
+    }
 
-    if (m_nodes.empty() || ray.maxt < ray.mint)
-        return false;
+    /// Append a subtree whose root will be stored at \c nodeOffset
+    static void append(Subtree& result, const Subtree& subtree,
+        uint32_t nodeOffset, uint32_t indexOffset) {
+        for (BVHNode node : subtree.nodes) {
+            if (node.isLeaf())
+                node.leaf.start += indexOffset;
+            else
+                node.inner.rightChild += nodeOffset;
+            result.nodes.push_back(node);
+        }
+        result.indices.insert(result.indices.end(),
+            subtree.indices.begin(), subtree.indices.end());
+    }
 
-    bool foundIntersection = false;
-    uint32_t f = 0;
+    /// Binned SAH object split over the reference centroids on all axes
+    Split findObjectSplit(const std::vector<Reference>& refs, const BoundingBox3f& bbox) const {
+        Split best;
+        best.cost = std::numeric_limits<float>::infinity();
+        uint32_t size = (uint32_t)refs.size();
+        float invArea = 1.0f / bbox.getSurfaceArea();
 
-    while (true) {
-        const BVHNode& node = m_nodes[node_idx];
+        BoundingBox3f centroids;
+        for (const Reference& ref : refs)
+            centroids.expandBy(ref.bbox.getCenter());
 
-        if (!node.bbox.rayIntersect(ray)) {
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
-        }
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = centroids.min[axis], extent = centroids.max[axis] - min;
+            if (!(extent > 0))
+                continue;
+            float invBinSize = binCount / extent;
+
+            uint32_t counts[BVHAccel::MAX_BIN_COUNT] = { 0 };
+            BoundingBox3f bins[BVHAccel::MAX_BIN_COUNT];
+            for (const Reference& ref : refs) {
+                int index = binIndex(ref.bbox.getCenter()[axis], min, invBinSize);
+                counts[index]++;
+                bins[index].expandBy(ref.bbox);
+            }
 
-        if (node.isInner()) {
-            stack[stack_idx++] = node.inner.rightChild;
-            node_idx++;
-            assert(stack_idx < 64);
-        }
-        else {
-            for (uint32_t i = node.start(), end = node.end(); i < end; ++i) {
-                uint32_t idx = m_indices[i];
-                const Mesh* mesh = m_meshes[findMesh(idx)];
-
-                float u, v, t;
-                if (mesh->rayIntersect(idx, ray, u, v, t)) {
-                    if (shadowRay)
-                        return true;
-                    foundIntersection = true;
-                    ray.maxt = its.t = t;
-                    its.uv = Point2f(u, v);
-                    its.mesh = mesh;
-                    f = idx;
+            BoundingBox3f bboxRight[BVHAccel::MAX_BIN_COUNT];
+            bboxRight[binCount - 1] = bins[binCount - 1];
+            for (int i = binCount - 2; i >= 0; --i)
+                bboxRight[i] = BoundingBox3f::merge(bboxRight[i + 1], bins[i]);
+
+            BoundingBox3f bboxLeft;
+            uint32_t countLeft = 0;
+            for (int i = 0; i < binCount - 1; ++i) {
+                bboxLeft.expandBy(bins[i]);
+                countLeft += counts[i];
+                float cost = splitCost(invArea, countLeft, bboxLeft,
+                    size - countLeft, bboxRight[i + 1]);
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.bin = i;
+                    best.min = min;
+                    best.invBinSize = invBinSize;
+                    best.bboxLeft = bboxLeft;
+                    best.bboxRight = bboxRight[i + 1];
                 }
             }
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
         }
+        return best;
     }
 
-    if (foundIntersection) {
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1 - its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh* mesh = its.mesh;
-        const MatrixXf& V = mesh->getVertexPositions();
-        const MatrixXf& N = mesh->getVertexNormals();
-        const MatrixXf& UV = mesh->getVertexTexCoords();
-        const MatrixXu& F = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+    /// Binned SAH spatial split with triangle clipping on all axes
+    Split findSpatialSplit(const std::vector<Reference>& refs, const BoundingBox3f& bbox) const {
+        Split best;
+        best.cost = std::numeric_limits<float>::infinity();
+        best.spatial = true;
+        float invArea = 1.0f / bbox.getSurfaceArea();
 
-        Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
+        for (int axis = 0; axis < 3; ++axis) {
+            float min = bbox.min[axis], binSize = (bbox.max[axis] - min) / binCount;
+            if (!(binSize > 0))
+                continue;
+            float invBinSize = 1.0f / binSize;
+
+            uint32_t entries[BVHAccel::MAX_BIN_COUNT] = { 0 }, exits[BVHAccel::MAX_BIN_COUNT] = { 0 };
+            BoundingBox3f bins[BVHAccel::MAX_BIN_COUNT];
+            for (const Reference& ref : refs) {
+                int first = binIndex(ref.bbox.min[axis], min, invBinSize);
+                int last = std::max(first, binIndex(ref.bbox.max[axis], min, invBinSize));
+
+                /* Chop the reference into the bins that it overlaps */
+                Reference current = ref;
+                for (int i = first; i < last; ++i) {
+                    Reference left, right;
+                    splitReference(current, axis, min + binSize * (i + 1), left, right);
+                    bins[i].expandBy(left.bbox);
+                    current = right;
+                }
+                bins[last].expandBy(current.bbox);
+                entries[first]++;
+                exits[last]++;
+            }
 
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+            BoundingBox3f bboxRight[BVHAccel::MAX_BIN_COUNT];
+            uint32_t countRight[BVHAccel::MAX_BIN_COUNT];
+            bboxRight[binCount - 1] = bins[binCount - 1];
+            countRight[binCount - 1] = exits[binCount - 1];
+            for (int i = binCount - 2; i >= 0; --i) {
+                bboxRight[i] = BoundingBox3f::merge(bboxRight[i + 1], bins[i]);
+                countRight[i] = countRight[i + 1] + exits[i];
+            }
 
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(idx0) +
-            bary.y() * UV.col(idx1) +
-            bary.z() * UV.col(idx2);
+            BoundingBox3f bboxLeft;
+            uint32_t countLeft = 0;
+            for (int i = 0; i < binCount - 1; ++i) {
+                bboxLeft.expandBy(bins[i]);
+                countLeft += entries[i];
+                float cost = splitCost(invArea, countLeft, bboxLeft,
+                    countRight[i + 1], bboxRight[i + 1]);
+                if (cost < best.cost) {
+                    best.cost = cost;
+                    best.axis = axis;
+                    best.position = min + binSize * (i + 1);
+                    best.bboxLeft = bboxLeft;
+                    best.bboxRight = bboxRight[i + 1];
+                }
+            }
+        }
+        return best;
+    }
 
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
+    /// Partition the references based on the bins of their centroids
+    void performObjectSplit(std::vector<Reference>& refs, const Split& split,
+        std::vector<Reference>& left, std::vector<Reference>& right) const {
+        for (const Reference& ref : refs) {
+            int index = binIndex(ref.bbox.getCenter()[split.axis], split.min, split.invBinSize);
+            (index <= split.bin ? left : right).push_back(ref);
+        }
+    }
 
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
+    /**
+     * \brief Partition the references at a split plane
+     *
+     * References that straddle the plane are clipped and duplicated,
+     * unless moving them entirely to one side is cheaper ("reference
+     * unsplitting") or the budget of \c maxRefs references is used up.
+     */
+    void performSpatialSplit(std::vector<Reference>& refs, const Split& split,
+        size_t maxRefs, std::vector<Reference>& left, std::vector<Reference>& right) const {
+        int axis = split.axis;
+        float pos = split.position;
+        BoundingBox3f bboxLeft, bboxRight;
+        std::vector<Reference> straddling;
+
+        for (const Reference& ref : refs) {
+            if (ref.bbox.max[axis] <= pos) {
+                left.push_back(ref);
+                bboxLeft.expandBy(ref.bbox);
+            }
+            else if (ref.bbox.min[axis] >= pos) {
+                right.push_back(ref);
+                bboxRight.expandBy(ref.bbox);
+            }
+            else {
+                straddling.push_back(ref);
+            }
+        }
 
-            its.shFrame = Frame(
-                (bary.x() * N.col(idx0) +
-                    bary.y() * N.col(idx1) +
-                    bary.z() * N.col(idx2)).normalized());
+        size_t count = refs.size();
+        for (const Reference& ref : straddling) {
+            Reference refLeft, refRight;
+            splitReference(ref, axis, pos, refLeft, refRight);
+
+            float nl = (float)left.size(), nr = (float)right.size();
+            float unsplitLeft = surfaceArea(BoundingBox3f::merge(bboxLeft, ref.bbox)) * (nl + 1) +
+                surfaceArea(bboxRight) * nr;
+            float unsplitRight = surfaceArea(bboxLeft) * nl +
+                surfaceArea(BoundingBox3f::merge(bboxRight, ref.bbox)) * (nr + 1);
+            float duplicate = std::numeric_limits<float>::infinity();
+            if (count < maxRefs && refLeft.bbox.isValid() && refRight.bbox.isValid())
+                duplicate = surfaceArea(BoundingBox3f::merge(bboxLeft, refLeft.bbox)) * (nl + 1) +
+                    surfaceArea(BoundingBox3f::merge(bboxRight, refRight.bbox)) * (nr + 1);
+
+            if (duplicate < unsplitLeft && duplicate < unsplitRight) {
+                left.push_back(refLeft);
+                right.push_back(refRight);
+                bboxLeft.expandBy(refLeft.bbox);
+                bboxRight.expandBy(refRight.bbox);
+                count++;
+            }
+            else if (unsplitLeft <= unsplitRight) {
+                left.push_back(ref);
+                bboxLeft.expandBy(ref.bbox);
+            }
+            else {
+                right.push_back(ref);
+                bboxRight.expandBy(ref.bbox);
+            }
         }
-        else {
-            its.shFrame = its.geoFrame;
+    }
+
+    /**
+     * \brief Split a reference at an axis-aligned plane
+     *
+     * Computes the bounds of the parts of the triangle on both sides of the
+     * plane and clips them against the bounds of the reference.
+     */
+    void splitReference(const Reference& ref, int axis, float pos,
+        Reference& left, Reference& right) const {
+        left.index = right.index = ref.index;
+        left.bbox.reset();
+        right.bbox.reset();
+
+        uint32_t idx = ref.index;
+        uint32_t meshIdx = bvh.findMesh(idx);
+        Point3f v[3];
+        bvh.m_meshes[meshIdx]->getTriangle(idx, v[0], v[1], v[2]);
+
+        for (int i = 0; i < 3; ++i) {
+            const Point3f& v0 = v[i], & v1 = v[(i + 1) % 3];
+            float p0 = v0[axis], p1 = v1[axis];
+            if (p0 <= pos)
+                left.bbox.expandBy(v0);
+            if (p0 >= pos)
+                right.bbox.expandBy(v0);
+
+            /* The edge crosses the plane */
+            if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos)) {
+                float t = std::min(std::max((pos - p0) / (p1 - p0), 0.0f), 1.0f);
+                Point3f p = (1.0f - t) * v0 + t * v1;
+                p[axis] = pos;
+                left.bbox.expandBy(p);
+                right.bbox.expandBy(p);
+            }
         }
+
+        left.bbox.max[axis] = pos;
+        right.bbox.min[axis] = pos;
+        left.bbox.clip(ref.bbox);
+        right.bbox.clip(ref.bbox);
     }
 
-    return foundIntersection;
+    int binIndex(float value, float min, float invBinSize) const {
+        return std::min(std::max((int)((value - min) * invBinSize), 0), binCount - 1);
+    }
+
+private:
+    const BVHAccel& bvh;
+    int binCount;
+    float minOverlap;
+    std::atomic<uint32_t> spatialSplits;
+};
+
+/**
+ * \brief Linear BVH builder based on Morton codes (LBVH / HLBVH)
+ *
+ * The triangle centroids are quantized to a regular grid, and the
+ * triangles are ordered along the resulting Z-order curve with a parallel
+ * radix sort. The hierarchy then follows directly from the bits of the
+ * sorted codes: every node is split where the highest differing bit of
+ * its range changes. Small subtrees are collapsed into leaves when the
+ * SAH deems this cheaper.
+ *
+ * In the hierarchical variant (HLBVH), triangles whose codes share the
+ * top 15 bits form a cluster. A binned SAH build over the clusters
+ * creates the top levels of the tree, and the clusters themselves are
+ * built as LBVHs.
+ *
+ * The nodes are allocated from the same \ref BVHNodePool as those of
+ * \ref BVHBuildTask. Whether a small subtree is collapsed is decided
+ * before its nodes are allocated, so that the pool holds no unused nodes.
+ *
+ * "Fast BVH Construction on GPUs" by Lauterbach et al. (Computer Graphics
+ * Forum, 2009) and "HLBVH: Hierarchical LBVH Construction for Real-Time
+ * Ray Tracing of Dynamic Geometry" by Pantaleoni and Luebke (Proc. High
+ * Performance Graphics, 2010)
+ */
+class LBVHBuilder {
+public:
+    typedef BVHAccel::BVHNode BVHNode;
+
+    /// Build-related parameters
+    enum {
+        /// Build subtrees with more triangles than this in parallel
+        PARALLEL_THRESHOLD = 4096,
+
+        /// Consider collapsing subtrees with up to this many triangles into leaves
+        MAX_LEAF_SIZE = 16,
+
+        /// Number of Morton code bits that identify an HLBVH cluster
+        CLUSTER_BITS = 15,
+
+        /// Number of bins for the SAH build over the clusters
+        CLUSTER_BIN_COUNT = 32,
+
+        /// Split at the median below this depth, which bounds the traversal stack size
+        MEDIAN_DEPTH = 32,
+
+        /// Rebuild HLBVHs deeper than this without clusters, as the traversal stacks could overflow
+        MAX_DEPTH = 60
+    };
+
+    LBVHBuilder(BVHAccel& bvh, BVHNodePool& nodes) : bvh(bvh), nodes(nodes) { }
+
+    /// Build the hierarchy below node 0 of the pool
+    void build(bool hierarchical) {
+        uint32_t size = bvh.getTriangleCount();
+
+        /* 30-bit codes (a 1024^3 grid) suffice for moderately sized
+           scenes, larger ones use 63 bits */
+        bits = size < (1u << 20) ? 30 : 63;
+        computeMortonCodes(size);
+        radixSort(codes, indices, bits);
+
+        if (!hierarchical) {
+            memcpy(bvh.m_indices.data(), indices.data(), sizeof(uint32_t) * size);
+            emit(0u, codes.data(), bvh.m_indices.data(), size, 0);
+            return;
+        }
+
+        /* Group the triangles into clusters of equal code prefixes */
+        int shift = bits - CLUSTER_BITS;
+        std::vector<Cluster> clusters;
+        for (uint32_t i = 0; i < size; ) {
+            uint32_t j = i + 1;
+            while (j < size && (codes[j] >> shift) == (codes[i] >> shift))
+                ++j;
+            clusters.push_back(Cluster{ i, j, 0, 0, 0, BoundingBox3f() });
+            i = j;
+        }
+
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0u, clusters.size()),
+            [&](const tbb::blocked_range<size_t>& range) {
+                for (size_t c = range.begin(); c != range.end(); ++c)
+                    for (uint32_t i = clusters[c].begin; i != clusters[c].end; ++i)
+                        clusters[c].bbox.expandBy(bvh.getBoundingBox(indices[i]));
+            }
+        );
+
+        /* SAH build over the clusters, which assigns them to top-level leaves */
+        buildTopLevel(clusters.data(), clusters.data() + clusters.size(), 0u, 0u, 0);
+
+        /* Build an LBVH for every cluster */
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0u, clusters.size()),
+            [&](const tbb::blocked_range<size_t>& range) {
+                for (size_t c = range.begin(); c != range.end(); ++c) {
+                    const Cluster& cluster = clusters[c];
+                    uint32_t count = cluster.end - cluster.begin;
+                    uint32_t* target = bvh.m_indices.data() + cluster.offset;
+                    memcpy(target, indices.data() + cluster.begin, sizeof(uint32_t) * count);
+                    emit(cluster.node_idx, codes.data() + cluster.begin, target, count, cluster.depth);
+                }
+            }
+        );
+    }
+
+protected:
+    /// Range of triangles in Morton order that share a code prefix
+    struct Cluster {
+        uint32_t begin, end;   ///< Range in the sorted arrays
+        uint32_t node_idx;     ///< Node that receives the LBVH of the cluster
+        uint32_t offset;       ///< Position of the triangles in \c m_indices
+        int depth;             ///< Depth of that node
+        BoundingBox3f bbox;
+    };
+
+    /// Subtree properties that are needed to decide whether to collapse its parent
+    struct SubtreeInfo {
+        BoundingBox3f bbox;
+        float cost;            ///< SAH cost, normalized as in \ref BVHAccel::statistics()
+        bool leaf = false;     ///< Is the subtree collapsed into a leaf?
+    };
+
+    /// Spread the lower 21 bits of \c v so that they occupy every third bit
+    static uint64_t expandBits(uint64_t v) {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffull;
+        v = (v | v << 16) & 0x1f0000ff0000ffull;
+        v = (v | v << 8) & 0x100f00f00f00f00full;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+
+    void computeMortonCodes(uint32_t size) {
+        BoundingBox3f centroids = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t>& range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    result.expandBy(bvh.getCentroid(i));
+                return result;
+            },
+            [](const BoundingBox3f& b1, const BoundingBox3f& b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
+
+        /* Use cubical grid cells, so that thin axes are not split
+           as often as the long ones */
+        int bitsPerAxis = bits / 3;
+        float cells = (float)((1u << bitsPerAxis) - 1);
+        float extent = centroids.getExtents().maxCoeff();
+        float scale = extent > 0 ? cells / extent : 0.0f;
+
+        codes.resize(size);
+        indices.resize(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t>& range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    Point3f p = bvh.getCentroid(i);
+                    uint64_t code = 0;
+                    for (int a = 0; a < 3; ++a) {
+                        float cell = std::min(std::max((p[a] - centroids.min[a]) * scale, 0.0f), cells);
+                        code |= expandBits((uint64_t)cell) << (2 - a);
+                    }
+                    codes[i] = code;
+                    indices[i] = i;
+                }
+            }
+        );
+    }
+
+    /**
+     * \brief Stable parallel LSD radix sort of key/value pairs
+     *
+     * Sorts 8 bits per pass, considering only the lowest \c bits bits of
+     * the keys. Every pass builds per-block digit histograms, turns them
+     * into scatter offsets and then scatters the blocks independently.
+     */
+    static void radixSort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int bits) {
+        const uint32_t BLOCK_SIZE = 1 << 16, DIGITS = 256;
+        uint32_t size = (uint32_t)keys.size();
+        uint32_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        std::vector<uint64_t> keysTemp(size);
+        std::vector<uint32_t> valuesTemp(size);
+        std::vector<uint32_t> offsets(blocks * DIGITS);
+
+        for (int shift = 0; shift < bits; shift += 8) {
+            tbb::parallel_for(
+                tbb::blocked_range<uint32_t>(0u, blocks, 1),
+                [&](const tbb::blocked_range<uint32_t>& range) {
+                    for (uint32_t b = range.begin(); b != range.end(); ++b) {
+                        uint32_t* histogram = offsets.data() + b * DIGITS;
+                        std::fill(histogram, histogram + DIGITS, 0u);
+                        for (uint32_t i = b * BLOCK_SIZE; i < std::min(size, (b + 1) * BLOCK_SIZE); ++i)
+                            histogram[(keys[i] >> shift) & (DIGITS - 1)]++;
+                    }
+                }
+            );
+
+            /* Exclusive prefix sum in digit-major order */
+            uint32_t sum = 0;
+            for (uint32_t d = 0; d < DIGITS; ++d) {
+                for (uint32_t b = 0; b < blocks; ++b) {
+                    uint32_t count = offsets[b * DIGITS + d];
+                    offsets[b * DIGITS + d] = sum;
+                    sum += count;
+                }
+            }
+
+            tbb::parallel_for(
+                tbb::blocked_range<uint32_t>(0u, blocks, 1),
+                [&](const tbb::blocked_range<uint32_t>& range) {
+                    for (uint32_t b = range.begin(); b != range.end(); ++b) {
+                        uint32_t* offset = offsets.data() + b * DIGITS;
+                        for (uint32_t i = b * BLOCK_SIZE; i < std::min(size, (b + 1) * BLOCK_SIZE); ++i) {
+                            uint32_t target = offset[(keys[i] >> shift) & (DIGITS - 1)]++;
+                            keysTemp[target] = keys[i];
+                            valuesTemp[target] = values[i];
+                        }
+                    }
+                }
+            );
+
+            keys.swap(keysTemp);
+            values.swap(valuesTemp);
+        }
+    }
+
+    /**
+     * \brief Binned SAH build over the clusters <tt>[begin, end)</tt>
+     *
+     * Assigns every cluster the node and the \c m_indices position that
+     * its LBVH will occupy.
+     */
+    void buildTopLevel(Cluster* begin, Cluster* end, uint32_t node_idx, uint32_t offset, int depth) {
+        BVHNode& node = nodes[node_idx];
+        node.bbox.reset();
+        for (Cluster* c = begin; c != end; ++c)
+            node.bbox.expandBy(c->bbox);
+
+        if (end - begin == 1) {
+            begin->node_idx = node_idx;
+            begin->offset = offset;
+            begin->depth = depth;
+            return;
+        }
+
+        BoundingBox3f centroids;
+        for (Cluster* c = begin; c != end; ++c)
+            centroids.expandBy(c->bbox.getCenter());
+
+        /* Find the split with the lowest SAH cost on all axes (only
+           above MEDIAN_DEPTH, which bounds the depth of the top level) */
+        int best_axis = -1, best_index = 0;
+        float best_cost = std::numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3 && depth < MEDIAN_DEPTH; ++axis) {
+            float min = centroids.min[axis], extent = centroids.max[axis] - min;
+            if (!(extent > 0))
+                continue;
+            float scale = CLUSTER_BIN_COUNT / extent;
+
+            uint32_t counts[CLUSTER_BIN_COUNT] = { 0 };
+            BoundingBox3f bins[CLUSTER_BIN_COUNT];
+            for (Cluster* c = begin; c != end; ++c) {
+                int index = std::min((int)((c->bbox.getCenter()[axis] - min) * scale), CLUSTER_BIN_COUNT - 1);
+                counts[index] += c->end - c->begin;
+                bins[index].expandBy(c->bbox);
+            }
+
+            float area_right[CLUSTER_BIN_COUNT];
+            BoundingBox3f bbox_right, bbox_left;
+            uint32_t count_right[CLUSTER_BIN_COUNT], total = 0, count_left = 0;
+            for (int i = CLUSTER_BIN_COUNT - 1; i > 0; --i) {
+                bbox_right.expandBy(bins[i]);
+                total += counts[i];
+                area_right[i] = bbox_right.getSurfaceArea();
+                count_right[i] = total;
+            }
+            for (int i = 0; i < CLUSTER_BIN_COUNT - 1; ++i) {
+                bbox_left.expandBy(bins[i]);
+                count_left += counts[i];
+                if (count_left == 0 || count_right[i + 1] == 0)
+                    continue;
+                float cost = count_left * bbox_left.getSurfaceArea() +
+                    count_right[i + 1] * area_right[i + 1];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_index = i;
+                }
+            }
+        }
+
+        Cluster* middle;
+        int axis;
+        if (best_axis != -1) {
+            axis = best_axis;
+            float min = centroids.min[axis], scale = CLUSTER_BIN_COUNT / (centroids.max[axis] - min);
+            middle = std::partition(begin, end, [&](const Cluster& c) {
+                return std::min((int)((c.bbox.getCenter()[axis] - min) * scale), CLUSTER_BIN_COUNT - 1) <= best_index;
+            });
+        }
+        else {
+            /* Split the clusters in half at the median centroid along the
+               largest axis (in any order if all centroids coincide) */
+            axis = centroids.getMajorAxis();
+            middle = begin + (end - begin) / 2;
+            std::nth_element(begin, middle, end, [axis](const Cluster& c1, const Cluster& c2) {
+                return c1.bbox.getCenter()[axis] < c2.bbox.getCenter()[axis];
+            });
+        }
+
+        uint32_t left_count = 0;
+        for (Cluster* c = begin; c != middle; ++c)
+            left_count += c->end - c->begin;
+
+        uint32_t node_idx_left = nodes.allocateChildren();
+        node.inner.flag = 0;
+        node.inner.axis = axis;
+        node.inner.rightChild = node_idx_left;
+
+        buildTopLevel(begin, middle, node_idx_left, offset, depth + 1);
+        buildTopLevel(middle, end, node_idx_left + 1, offset + left_count, depth + 1);
+    }
+
+    /**
+     * \brief Emit the LBVH over \c count triangles in Morton order
+     *
+     * \param codes
+     *    Sorted Morton codes of the triangles
+     *
+     * \param indices
+     *    Triangle indices (a range of \c m_indices) in the same order
+     */
+    SubtreeInfo emit(uint32_t node_idx, const uint64_t* codes, uint32_t* indices, uint32_t count, int depth) {
+        BVHNode& node = nodes[node_idx];
+
+        if (count <= MAX_LEAF_SIZE) {
+            /* Decide whether to collapse the subtree before allocating its nodes */
+            SubtreeInfo info = evaluate(codes, indices, count, depth);
+            if (info.leaf) {
+                makeLeaf(node, info.bbox, indices, count);
+                return info;
+            }
+        }
+
+        int axis;
+        uint32_t left_count = splitPosition(codes, count, depth, axis);
+        uint32_t node_idx_left = nodes.allocateChildren();
+        uint32_t node_idx_right = node_idx_left + 1;
+        SubtreeInfo left, right;
+        if (count > PARALLEL_THRESHOLD) {
+            tbb::parallel_invoke(
+                [&] { left = emit(node_idx_left, codes, indices, left_count, depth + 1); },
+                [&] { right = emit(node_idx_right, codes + left_count, indices + left_count, count - left_count, depth + 1); }
+            );
+        }
+        else {
+            left = emit(node_idx_left, codes, indices, left_count, depth + 1);
+            right = emit(node_idx_right, codes + left_count, indices + left_count, count - left_count, depth + 1);
+        }
+
+        SubtreeInfo result = merge(left, right);
+        node.bbox = result.bbox;
+        node.inner.flag = 0;
+        node.inner.axis = axis;
+        node.inner.rightChild = node_idx_left;
+        return result;
+    }
+
+    /**
+     * \brief Compute the bounds and cost of a small subtree without
+     * emitting it, collapsing it into a leaf where the SAH deems this cheaper
+     */
+    SubtreeInfo evaluate(const uint64_t* codes, const uint32_t* indices, uint32_t count, int depth) const {
+        SubtreeInfo result;
+        if (count == 1) {
+            result.bbox = bvh.getBoundingBox(indices[0]);
+            result.cost = (float)BVHBuildTask::INTERSECTION_COST;
+            result.leaf = true;
+            return result;
+        }
+
+        int axis;
+        uint32_t left_count = splitPosition(codes, count, depth, axis);
+        result = merge(evaluate(codes, indices, left_count, depth + 1),
+            evaluate(codes + left_count, indices + left_count, count - left_count, depth + 1));
+
+        float leaf_cost = (float)BVHBuildTask::INTERSECTION_COST * count;
+        if (leaf_cost <= result.cost || !(result.bbox.getSurfaceArea() > 0)) {
+            result.cost = leaf_cost;
+            result.leaf = true;
+        }
+        return result;
+    }
+
+    /// Bounds and SAH cost of an inner node with the given children
+    static SubtreeInfo merge(const SubtreeInfo& left, const SubtreeInfo& right) {
+        SubtreeInfo result;
+        result.bbox = BoundingBox3f::merge(left.bbox, right.bbox);
+        result.cost = 2.0f * BVHBuildTask::TRAVERSAL_COST +
+            (left.bbox.getSurfaceArea() * left.cost + right.bbox.getSurfaceArea() * right.cost)
+            / result.bbox.getSurfaceArea();
+        return result;
+    }
+
+    /// Split a range where the highest differing bit of its codes changes
+    static uint32_t splitPosition(const uint64_t* codes, uint32_t count, int depth, int& axis) {
+        uint32_t left_count = 0;
+        uint64_t delta = codes[0] ^ codes[count - 1];
+        axis = 0;
+        if (delta != 0) {
+            int bit = 63;
+            while (!((delta >> bit) & 1))
+                --bit;
+            axis = 2 - bit % 3;
+            left_count = (uint32_t)(std::partition_point(codes, codes + count,
+                [bit](uint64_t code) { return ((code >> bit) & 1) == 0; }) - codes);
+        }
+        if (delta == 0 || depth >= MEDIAN_DEPTH)
+            left_count = count / 2;
+        return left_count;
+    }
+
+    void makeLeaf(BVHNode& node, const BoundingBox3f& bbox, uint32_t* indices, uint32_t count) {
+        node.bbox = bbox;
+        node.leaf.flag = 1;
+        node.leaf.start = (uint32_t)(indices - bvh.m_indices.data());
+        node.leaf.size = count;
+    }
+
+private:
+    BVHAccel& bvh;
+    BVHNodePool& nodes;
+    int bits;
+    std::vector<uint64_t> codes;
+    std::vector<uint32_t> indices;
+};
+
+/**
+ * \brief Post-build optimization of the BVH topology
+ *
+ * Performs treelet restructuring: for every inner node, a treelet is formed
+ * by repeatedly opening the treelet leaf with the largest surface area,
+ * until it has up to \ref TREELET_SIZE leaves. Dynamic programming over all
+ * subsets of these leaves then finds the topology with the lowest SAH cost,
+ * which replaces the treelet if it is cheaper. Nodes are processed bottom-up,
+ * and disjoint subtrees are processed in parallel. Each pass can only lower
+ * the cost, and running several passes improves the tree further.
+ *
+ * The optimizer works on a pointer-based copy of the hierarchy and writes
+ * the result back in the usual depth-first layout, gathering the triangle
+ * indices of every leaf into a new \c m_indices array.
+ *
+ * "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies"
+ * by Tero Karras and Timo Aila (Proc. High Performance Graphics, 2013)
+ */
+class BVHOptimizer {
+public:
+    typedef BVHAccel::BVHNode BVHNode;
+
+    /// Optimization-related parameters
+    enum {
+        /// Maximum number of leaves of a treelet
+        TREELET_SIZE = 7,
+
+        /// Process subtrees with more triangles than this in parallel
+        PARALLEL_THRESHOLD = 4096,
+
+        /// Reject the result if it would overflow the traversal stacks
+        MAX_DEPTH = 60
+    };
+
+    BVHOptimizer(BVHAccel& bvh) : bvh(bvh), nodes(bvh.m_nodes.size()) {
+        load(0u);
+    }
+
+    /// Return the SAH cost of the tree (normalized as in \ref BVHAccel::statistics())
+    float cost() const {
+        return nodes[0].cost / nodes[0].bbox.getSurfaceArea();
+    }
+
+    /// Perform one pass of treelet restructuring over the whole tree
+    void optimize() {
+        optimize(0u);
+    }
+
+    /**
+     * \brief Write the optimized tree back into the BVH
+     *
+     * \return \c false if the tree exceeded the maximum depth,
+     *    in which case the BVH is left unchanged
+     */
+    bool store() {
+        std::vector<BVHNode> result;
+        std::vector<uint32_t> indices;
+        result.reserve(nodes.size());
+        indices.reserve(bvh.m_indices.size());
+        if (!store(0u, 0, result, indices))
+            return false;
+        bvh.m_nodes = std::move(result);
+        bvh.m_indices = std::move(indices);
+        return true;
+    }
+
+protected:
+    /// Node of the pointer-based copy of the hierarchy
+    struct Node {
+        BoundingBox3f bbox;
+        uint32_t left, right;  ///< Children of inner nodes
+        uint32_t start, size;  ///< Triangle range of leaves (in the original \c m_indices)
+        uint32_t count;        ///< Number of triangles in the subtree
+        float cost;            ///< SAH cost of the subtree times the surface area of the node
+
+        bool isLeaf() const { return size > 0; }
+    };
+
+    void load(uint32_t idx) {
+        const BVHNode& src = bvh.m_nodes[idx];
+        Node& node = nodes[idx];
+        node.bbox = src.bbox;
+        if (src.isLeaf()) {
+            node.start = src.start();
+            node.size = node.count = src.leaf.size;
+            node.cost = (float)BVHBuildTask::INTERSECTION_COST * node.size * src.bbox.getSurfaceArea();
+        }
+        else {
+            node.left = idx + 1;
+            node.right = src.inner.rightChild;
+            node.size = 0;
+            load(node.left);
+            load(node.right);
+            node.count = nodes[node.left].count + nodes[node.right].count;
+            node.cost = 2.0f * BVHBuildTask::TRAVERSAL_COST * src.bbox.getSurfaceArea() +
+                nodes[node.left].cost + nodes[node.right].cost;
+        }
+    }
+
+    void optimize(uint32_t idx) {
+        const Node& node = nodes[idx];
+        if (node.isLeaf())
+            return;
+        if (node.count > PARALLEL_THRESHOLD) {
+            tbb::parallel_invoke(
+                [&] { optimize(node.left); },
+                [&] { optimize(node.right); }
+            );
+        }
+        else {
+            optimize(node.left);
+            optimize(node.right);
+        }
+        restructure(idx);
+    }
+
+    /// Find the optimal topology of the treelet rooted at \c root
+    void restructure(uint32_t root) {
+        uint32_t leaves[TREELET_SIZE], internals[TREELET_SIZE - 1];
+        int leafCount = 2, internalCount = 1;
+        internals[0] = root;
+        leaves[0] = nodes[root].left;
+        leaves[1] = nodes[root].right;
+
+        /* Grow the treelet by opening the leaf with the largest surface area */
+        while (leafCount < TREELET_SIZE) {
+            int best = -1;
+            float bestArea = -1.0f;
+            for (int i = 0; i < leafCount; ++i) {
+                const Node& node = nodes[leaves[i]];
+                float area = node.bbox.getSurfaceArea();
+                if (!node.isLeaf() && area > bestArea) {
+                    best = i;
+                    bestArea = area;
+                }
+            }
+            if (best == -1)
+                break;
+            uint32_t opened = leaves[best];
+            internals[internalCount++] = opened;
+            leaves[best] = nodes[opened].left;
+            leaves[leafCount++] = nodes[opened].right;
+        }
+        if (leafCount < 3)
+            return;
+
+        /* Dynamic programming over all subsets of the treelet leaves. Any
+           subset of 's' is numerically smaller than 's', hence a single
+           sweep in increasing order visits the parts before the whole */
+        const uint32_t subsets = 1u << leafCount;
+        BoundingBox3f bbox[1 << TREELET_SIZE];
+        float cost[1 << TREELET_SIZE];
+        uint8_t partition[1 << TREELET_SIZE];
+
+        for (uint32_t s = 1; s < subsets; ++s) {
+            uint32_t low = s & (0u - s);
+            int lowIndex = 0;
+            while (!((low >> lowIndex) & 1))
+                ++lowIndex;
+            const Node& leaf = nodes[leaves[lowIndex]];
+
+            if (s == low) {
+                bbox[s] = leaf.bbox;
+                cost[s] = leaf.cost;
+                continue;
+            }
+            bbox[s] = BoundingBox3f::merge(bbox[s ^ low], leaf.bbox);
+
+            /* Consider all partitions where the first part holds the lowest leaf */
+            float bestCost = std::numeric_limits<float>::infinity();
+            uint32_t bestPart = low;
+            for (uint32_t p = (s - 1) & s; p != 0; p = (p - 1) & s) {
+                if (!(p & low))
+                    continue;
+                float c = cost[p] + cost[s ^ p];
+                if (c < bestCost) {
+                    bestCost = c;
+                    bestPart = p;
+                }
+            }
+            cost[s] = 2.0f * BVHBuildTask::TRAVERSAL_COST * bbox[s].getSurfaceArea() + bestCost;
+            partition[s] = (uint8_t)bestPart;
+        }
+
+        const uint32_t all = subsets - 1;
+        if (!(cost[all] < nodes[root].cost * (1.0f - 1e-5f)))
+            return;
+
+        /* Reuse the internal nodes of the treelet for the new topology */
+        int next = 1;
+        rebuild(root, all, leaves, internals, next, bbox, cost, partition);
+    }
+
+    /// Recreate the treelet subtree for the leaf subset \c s at node \c idx
+    uint32_t rebuild(uint32_t idx, uint32_t s, const uint32_t* leaves, const uint32_t* internals,
+        int& next, const BoundingBox3f* bbox, const float* cost, const uint8_t* partition) {
+        uint32_t parts[2] = { partition[s], s ^ partition[s] }, children[2];
+        for (int i = 0; i < 2; ++i) {
+            if ((parts[i] & (parts[i] - 1)) == 0) {
+                int leafIndex = 0;
+                while (!((parts[i] >> leafIndex) & 1))
+                    ++leafIndex;
+                children[i] = leaves[leafIndex];
+            }
+            else {
+                children[i] = rebuild(internals[next++], parts[i], leaves, internals,
+                    next, bbox, cost, partition);
+            }
+        }
+        Node& node = nodes[idx];
+        node.left = children[0];
+        node.right = children[1];
+        node.bbox = bbox[s];
+        node.cost = cost[s];
+        node.count = nodes[children[0]].count + nodes[children[1]].count;
+        return idx;
+    }
+
+    bool store(uint32_t idx, int depth, std::vector<BVHNode>& result, std::vector<uint32_t>& indices) const {
+        if (depth > MAX_DEPTH)
+            return false;
+        const Node& node = nodes[idx];
+        uint32_t out = (uint32_t)result.size();
+        result.emplace_back();
+        result[out].data = 0;
+        result[out].bbox = node.bbox;
+
+        if (node.isLeaf()) {
+            result[out].leaf.flag = 1;
+            result[out].leaf.start = (uint32_t)indices.size();
+            result[out].leaf.size = node.size;
+            indices.insert(indices.end(), bvh.m_indices.begin() + node.start,
+                bvh.m_indices.begin() + node.start + node.size);
+            return true;
+        }
+
+        /* Use the axis along which the children are furthest apart, and
+           put the lower child on the left as the other builders do (the
+           sign-based traversal order depends on this) */
+        uint32_t left = node.left, right = node.right;
+        Vector3f offset = nodes[right].bbox.getCenter() - nodes[left].bbox.getCenter();
+        int axis;
+        offset.cwiseAbs().maxCoeff(&axis);
+        if (offset[axis] < 0)
+            std::swap(left, right);
+
+        if (!store(left, depth + 1, result, indices))
+            return false;
+        result[out].inner.flag = 0;
+        result[out].inner.axis = axis;
+        result[out].inner.rightChild = (uint32_t)result.size();
+        return store(right, depth + 1, result, indices);
+    }
+
+private:
+    BVHAccel& bvh;
+    std::vector<Node> nodes;
+};
+
+BVHAccel::BVHAccel(const PropertyList& propList) {
+    m_meshOffset.push_back(0u);
+
+    /* Child visiting order: "fixed", "sign" or "distance" */
+    std::string order = propList.getString("traversal", "sign");
+    if (order == "fixed")
+        m_traversalOrder = EFixedOrder;
+    else if (order == "sign")
+        m_traversalOrder = ESignOrder;
+    else if (order == "distance")
+        m_traversalOrder = EDistanceOrder;
+    else
+        throw NoriException("BVHAccel: unknown traversal order \"%s\"!", order);
+
+    /* Construction algorithm: "sah", "lbvh" or "hlbvh" */
+    std::string builder = propList.getString("builder", "sah");
+    if (builder == "sah")
+        m_builder = ESAHBuilder;
+    else if (builder == "lbvh")
+        m_builder = ELBVHBuilder;
+    else if (builder == "hlbvh")
+        m_builder = EHLBVHBuilder;
+    else
+        throw NoriException("BVHAccel: unknown builder \"%s\"!", builder);
+
+    /* Number of SAH bins per axis, and size below which subtrees are built serially */
+    setBinCount(propList.getInteger("binCount", 32));
+    m_serialThreshold = (uint32_t) std::max(propList.getInteger("serialThreshold", 32), 1);
+
+    /* Optional directory that caches built hierarchies across runs */
+    m_cacheDirectory = propList.getString("cache", "");
+    if (!m_cacheDirectory.empty())
+        m_cacheDirectory = getFileResolver()->resolve(m_cacheDirectory).str();
+
+    /* Optional post-build optimization passes, limited by a time budget in seconds */
+    m_optimizationPasses = propList.getInteger("optimizationPasses", 0);
+    m_optimizationTime = propList.getFloat("optimizationTime", 0.0f);
+
+    /* Optional spatial splits, which may duplicate up to the given fraction of triangles */
+    m_spatialSplits = propList.getBoolean("spatialSplits", false);
+    m_duplicationBudget = propList.getFloat("duplicationBudget", 0.3f);
+
+    /* Relative SAH cost increase at which refit() rebuilds the hierarchy */
+    m_refitThreshold = propList.getFloat("refitThreshold", 1.5f);
+
+    /* Optional compressed nodes with 8- or 16-bit bounds */
+    setQuantizationBits(propList.getInteger("quantization", 0));
+}
+
+void BVHAccel::addMesh(Mesh* mesh) {
+    if (mesh->isMoving()) {
+        if (m_keyframeCount > 1 && mesh->getKeyframeCount() != m_keyframeCount)
+            throw NoriException("BVHAccel: all moving meshes must have the same number of keyframes!");
+        m_keyframeCount = mesh->getKeyframeCount();
+    }
+    m_meshes.push_back(mesh);
+    m_meshOffset.push_back(m_meshOffset.back() + mesh->getTriangleCount());
+    m_bbox.expandBy(mesh->getBoundingBox());
+}
+
+void BVHAccel::clear() {
+    m_meshes.clear();
+    m_meshOffset.clear();
+    m_meshOffset.push_back(0u);
+    m_nodes.clear();
+    m_indices.clear();
+    m_packets.clear();
+    m_nodes8.clear();
+    m_nodes16.clear();
+    m_motionBounds.clear();
+    m_keyframeCount = 1;
+    m_bbox.reset();
+    m_nodes.shrink_to_fit();
+    m_meshes.shrink_to_fit();
+    m_meshOffset.shrink_to_fit();
+    m_indices.shrink_to_fit();
+    m_packets.shrink_to_fit();
+    m_nodes8.shrink_to_fit();
+    m_nodes16.shrink_to_fit();
+    m_motionBounds.shrink_to_fit();
+}
+
+size_t BVHAccel::getMemoryUsage() const {
+    return sizeof(BVHNode) * m_nodes.size() + sizeof(BVHNode8) * m_nodes8.size()
+        + sizeof(BVHNode16) * m_nodes16.size() + sizeof(uint32_t) * m_indices.size()
+        + sizeof(BVHTrianglePacket) * m_packets.size()
+        + sizeof(BoundingBox3f) * m_motionBounds.size();
+}
+
+std::string BVHAccel::toString() const {
+    static const char* orderNames[] = { "fixed", "sign", "distance" };
+    static const char* builderNames[] = { "sah", "lbvh", "hlbvh" };
+    return tfm::format(
+        "BVHAccel[\n"
+        "  traversal = %s,\n"
+        "  builder = %s,\n"
+        "  binCount = %i,\n"
+        "  spatialSplits = %s,\n"
+        "  optimizationPasses = %i,\n"
+        "  refitThreshold = %f,\n"
+        "  quantization = %i,\n"
+        "  cache = \"%s\"\n"
+        "]",
+        orderNames[m_traversalOrder],
+        builderNames[m_builder],
+        m_binCount,
+        m_spatialSplits ? "true" : "false",
+        m_optimizationPasses,
+        m_refitThreshold,
+        m_quantizationBits,
+        m_cacheDirectory
+    );
+}
+
+void BVHAccel::build() {
+    uint32_t size = getTriangleCount();
+    if (size == 0)
+        return;
+    Timer timer;
+
+    /* Try to reuse a previously built hierarchy of the same meshes */
+    std::string cacheFile;
+    uint64_t cacheKey = 0;
+    if (!m_cacheDirectory.empty()) {
+        cacheKey = computeCacheKey();
+        std::ostringstream oss;
+        oss << m_cacheDirectory << "/" << std::hex << std::setw(16) << std::setfill('0') << cacheKey << ".bvh";
+        cacheFile = oss.str();
+
+        if (loadCache(cacheFile, cacheKey)) {
+            computeOcclusionOrder();
+            buildPackets();
+            computeMotionBounds();
+            m_buildCost = statistics().first;
+            cout << "Loading a cached BVHAccel (" << m_meshes.size()
+                << (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
+                << size << " triangles) .. done (took " << timer.elapsedString() << " and "
+                << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t) * m_indices.size())
+                << " + " << memString(sizeof(BVHTrianglePacket) * m_packets.size())
+                << " of triangle packets, SAH cost = " << m_buildCost << ")." << endl;
+            compressNodes();
+            return;
+        }
+    }
+
+    static const char* builderNames[] = { "SAH BVHAccel", "LBVH", "HLBVH" };
+    bool spatialSplitBuild = m_spatialSplits && m_builder == ESAHBuilder;
+    cout << "Constructing a" << (m_builder == ESAHBuilder ? " " : "n ") << builderNames[m_builder]
+        << (spatialSplitBuild ? " with spatial splits (" : " (")
+        << m_meshes.size() << (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
+        << size << " triangles) .. ";
+    cout.flush();
+
+    if (sizeof(BVHNode) != 32)
+        throw NoriException("BVHAccel Node is not packed! Investigate compiler settings.");
+
+    std::pair<float, uint32_t> stats;
+    uint32_t spatialSplits = 0;
+
+    if (spatialSplitBuild) {
+        std::vector<SBVHBuilder::Reference> refs(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t>& range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    refs[i] = SBVHBuilder::Reference{ i, getBoundingBox(i) };
+            }
+        );
+
+        SBVHBuilder builder(*this, m_bbox.getSurfaceArea());
+        SBVHBuilder::Subtree tree;
+        builder.build(refs, m_bbox,
+            (size_t)(size * (1.0f + std::max(m_duplicationBudget, 0.0f))), 0, tree);
+        m_nodes = std::move(tree.nodes);
+        m_indices = std::move(tree.indices);
+        spatialSplits = builder.getSpatialSplitCount();
+        stats = statistics();
+    }
+    else {
+        /* Nodes are allocated on demand and stored depth-first afterwards */
+        BVHNodePool pool;
+        pool.allocate(1);
+        pool[0].bbox = m_bbox;
+        m_indices.resize(size);
+
+        if (m_builder != ESAHBuilder) {
+            LBVHBuilder builder(*this, pool);
+            builder.build(m_builder == EHLBVHBuilder);
+
+            /* The median splits bound the depth of a plain LBVH, but lopsided
+               HLBVH cluster splits can still add up to a very deep tree */
+            if (m_builder == EHLBVHBuilder && pool.depth() > LBVHBuilder::MAX_DEPTH) {
+                pool.clear();
+                pool.allocate(1);
+                pool[0].bbox = m_bbox;
+                LBVHBuilder(*this, pool).build(false);
+            }
+        }
+        else {
+            for (uint32_t i = 0; i < size; ++i)
+                m_indices[i] = i;
+
+            BoundingBox3f centroids = tbb::parallel_reduce(
+                tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+                BoundingBox3f(),
+                [&](const tbb::blocked_range<uint32_t>& range, BoundingBox3f result) {
+                    for (uint32_t i = range.begin(); i != range.end(); ++i)
+                        result.expandBy(getCentroid(i));
+                    return result;
+                },
+                [](const BoundingBox3f& b1, const BoundingBox3f& b2) {
+                    return BoundingBox3f::merge(b1, b2);
+                }
+            );
+
+            uint32_t* indices = m_indices.data(), * temp = new uint32_t[size];
+            BVHBuildTask& task = *new(tbb::task::allocate_root())
+                BVHBuildTask(*this, pool, 0u, indices, indices + size, temp, centroids);
+            tbb::task::spawn_root_and_wait(task);
+            delete[] temp;
+        }
+        pool.store(m_nodes);
+        stats = statistics();
+    }
+
+    /* Optionally improve the tree until the pass count or time budget is used up */
+    float unoptimizedCost = stats.first;
+    int passes = 0;
+    if (m_optimizationPasses > 0) {
+        Timer optimizationTimer;
+        BVHOptimizer optimizer(*this);
+        float cost = optimizer.cost();
+        while (passes < m_optimizationPasses) {
+            optimizer.optimize();
+            passes++;
+            float newCost = optimizer.cost();
+            bool converged = newCost > cost * 0.999f;
+            cost = newCost;
+            if (converged || (m_optimizationTime > 0 &&
+                    optimizationTimer.elapsed() > 1000.0 * m_optimizationTime))
+                break;
+        }
+        if (optimizer.store())
+            stats = statistics();
+        else
+            passes = 0;
+    }
+
+    computeOcclusionOrder();
+    buildPackets();
+    computeMotionBounds();
+    m_buildCost = stats.first;
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t) * m_indices.size())
+        << " + " << memString(sizeof(BVHTrianglePacket) * m_packets.size())
+        << " of triangle packets, SAH cost = " << stats.first;
+    if (passes > 0)
+        cout << " after " << passes << (passes == 1 ? " optimization pass" : " optimization passes")
+            << " from " << unoptimizedCost;
+    if (spatialSplitBuild)
+        cout << ", " << spatialSplits << " spatial splits, "
+            << tfm::format("%.1f", 100.0f * (m_indices.size() - size) / size)
+            << "% duplicated references";
+    if (!m_motionBounds.empty())
+        cout << ", " << m_keyframeCount << " keyframes using "
+            << memString(sizeof(BoundingBox3f) * m_motionBounds.size());
+    cout << ")." << endl;
+
+    if (!cacheFile.empty())
+        saveCache(cacheFile, cacheKey);
+
+    compressNodes();
+}
+
+bool BVHAccel::refit() {
+    uint32_t size = getTriangleCount();
+    if (size == 0)
+        return true;
+    if (m_nodes.empty() && m_nodes8.empty() && m_nodes16.empty()) {
+        build();
+        return false;
+    }
+
+    cout << "Refitting the BVH (" << m_meshes.size() << (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
+        << size << " triangles) .. ";
+    cout.flush();
+    Timer timer;
+
+    m_bbox.reset();
+    for (const Mesh* mesh : m_meshes)
+        m_bbox.expandBy(mesh->getBoundingBox());
+
+    /* Quantized bounds are relative to the old parent bounds and cannot be
+       updated in place -- refit uncompressed nodes and quantize them again */
+    if (!m_nodes8.empty())
+        decompressTopology(m_nodes8);
+    else if (!m_nodes16.empty())
+        decompressTopology(m_nodes16);
+
+    refitSubtree(0u);
+
+    float cost = statistics().first;
+    if (m_refitThreshold > 0 && cost > m_refitThreshold * m_buildCost) {
+        cout << "SAH cost increased from " << m_buildCost << " to " << cost
+            << ", rebuilding." << endl;
+        build();
+        return false;
+    }
+
+    computeOcclusionOrder();
+    buildPackets();
+    computeMotionBounds();
+
+    cout << "done (took " << timer.elapsedString() << ", SAH cost = " << cost
+        << " after " << m_buildCost << " at the last build)." << endl;
+
+    compressNodes();
+    return true;
+}
+
+void BVHAccel::refitSubtree(uint32_t node_idx) {
+    BVHNode& node = m_nodes[node_idx];
+
+    if (node.isLeaf()) {
+        node.bbox.reset();
+        for (uint32_t i = node.start(); i < node.end(); ++i)
+            node.bbox.expandBy(getBoundingBox(m_indices[i]));
+        return;
+    }
+
+    /* The left subtree occupies the nodes up to the right child */
+    uint32_t left = node_idx + 1, right = node.inner.rightChild;
+    if (right - left > REFIT_PARALLEL_THRESHOLD) {
+        tbb::parallel_invoke(
+            [&] { refitSubtree(left); },
+            [&] { refitSubtree(right); }
+        );
+    }
+    else {
+        refitSubtree(left);
+        refitSubtree(right);
+    }
+    node.bbox = BoundingBox3f::merge(m_nodes[left].bbox, m_nodes[right].bbox);
+}
+
+void BVHAccel::computeMotionBounds() {
+    m_motionBounds.clear();
+    if (m_keyframeCount == 1 || m_quantizationBits != 0 || m_nodes.empty())
+        return;
+    m_motionBounds.resize(m_nodes.size() * m_keyframeCount);
+    motionBoundsSubtree(0u);
+}
+
+void BVHAccel::motionBoundsSubtree(uint32_t node_idx) {
+    const BVHNode& node = m_nodes[node_idx];
+    const uint32_t K = m_keyframeCount;
+    BoundingBox3f* bounds = &m_motionBounds[node_idx * K];
+
+    if (node.isLeaf()) {
+        for (uint32_t k = 0; k < K; ++k)
+            bounds[k].reset();
+        for (uint32_t i = node.start(); i < node.end(); ++i) {
+            uint32_t idx = m_indices[i];
+            const Mesh* mesh = m_meshes[findMesh(idx)];
+
+            /* Static meshes only have the first keyframe */
+            for (uint32_t k = 0; k < K; ++k)
+                bounds[k].expandBy(mesh->getBoundingBox(idx, std::min(k, mesh->getKeyframeCount() - 1)));
+        }
+        return;
+    }
+
+    uint32_t left = node_idx + 1, right = node.inner.rightChild;
+    if (right - left > REFIT_PARALLEL_THRESHOLD) {
+        tbb::parallel_invoke(
+            [&] { motionBoundsSubtree(left); },
+            [&] { motionBoundsSubtree(right); }
+        );
+    }
+    else {
+        motionBoundsSubtree(left);
+        motionBoundsSubtree(right);
+    }
+    for (uint32_t k = 0; k < K; ++k)
+        bounds[k] = BoundingBox3f::merge(m_motionBounds[left * K + k], m_motionBounds[right * K + k]);
+}
+
+template <typename T>
+void BVHAccel::decompressTopology(const std::vector<BVHQuantizedNode<T>>& nodes) {
+    m_nodes.resize(nodes.size());
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        BVHNode& node = m_nodes[i];
+        node.data = 0;
+        if (nodes[i].leaf) {
+            node.leaf.flag = 1;
+            node.leaf.size = nodes[i].size;
+            node.leaf.start = nodes[i].offset;
+        }
+        else {
+            node.inner.rightChild = nodes[i].offset;
+        }
+    }
+}
+
+void BVHAccel::compressNodes() {
+    m_nodes8.clear();
+    m_nodes16.clear();
+    if (m_quantizationBits == 0 || m_nodes.empty())
+        return;
+
+    cout << "Quantizing the BVH nodes to " << m_quantizationBits << " bits .. ";
+    cout.flush();
+    Timer timer;
+    size_t size = sizeof(BVHNode) * m_nodes.size();
+
+    if (m_quantizationBits == 8)
+        quantize(m_nodes8);
+    else
+        quantize(m_nodes16);
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(getMemoryUsage() - sizeof(uint32_t) * m_indices.size()
+            - sizeof(BVHTrianglePacket) * m_packets.size())
+        << " instead of " << memString(size) << ")." << endl;
+}
+
+template <typename T> void BVHAccel::quantize(std::vector<BVHQuantizedNode<T>>& result) {
+    const uint32_t maxValue = std::numeric_limits<T>::max();
+
+    result.resize(m_nodes.size());
+    m_rootBBox = m_nodes[0].bbox;
+
+    /* Top-down pass: every node is quantized relative to the decoded
+       (rather than the exact) bounds of its parent */
+    std::vector<std::pair<uint32_t, BoundingBox3f>> stack;
+    stack.push_back({ 0u, m_rootBBox });
+    while (!stack.empty()) {
+        uint32_t node_idx = stack.back().first;
+        BoundingBox3f parent = stack.back().second;
+        stack.pop_back();
+
+        const BVHNode& node = m_nodes[node_idx];
+        BVHQuantizedNode<T>& qnode = result[node_idx];
+        qnode.leaf = node.isLeaf() ? 1 : 0;
+        qnode.rightLarger = node.isLeaf() ? 0 : node.inner.rightLarger;
+        qnode.size = node.isLeaf() ? node.leaf.size : 0;
+        qnode.offset = node.isLeaf() ? node.leaf.start : node.inner.rightChild;
+
+        if (node_idx == 0) {
+            /* The root is stored exactly */
+            for (int a = 0; a < 3; ++a)
+                qnode.lower[a] = qnode.upper[a] = 0;
+        }
+        else {
+            for (int a = 0; a < 3; ++a) {
+                float extent = parent.max[a] - parent.min[a];
+                float scale = extent > 0 ? maxValue / extent : 0.0f;
+                qnode.lower[a] = (T) std::min(std::max(
+                    std::floor((node.bbox.min[a] - parent.min[a]) * scale), 0.0f), (float) maxValue);
+                qnode.upper[a] = (T) std::min(std::max(
+                    std::floor((parent.max[a] - node.bbox.max[a]) * scale), 0.0f), (float) maxValue);
+
+                /* Round conservatively with the exact decoding arithmetic */
+                while (qnode.lower[a] > 0 && qnode.decode(parent).min[a] > node.bbox.min[a])
+                    qnode.lower[a]--;
+                while (qnode.upper[a] > 0 && qnode.decode(parent).max[a] < node.bbox.max[a])
+                    qnode.upper[a]--;
+            }
+        }
+
+        if (node.isInner()) {
+            BoundingBox3f bbox = qnode.decode(parent);
+            stack.push_back({ node.inner.rightChild, bbox });
+            stack.push_back({ node_idx + 1, bbox });
+        }
+    }
+
+    std::vector<BVHNode>().swap(m_nodes);
+}
+
+void BVHAccel::computeOcclusionOrder() {
+    for (BVHNode& node : m_nodes) {
+        if (node.isInner()) {
+            const BVHNode& left = *(&node + 1);
+            const BVHNode& right = m_nodes[node.inner.rightChild];
+            node.inner.rightLarger = right.bbox.getSurfaceArea() > left.bbox.getSurfaceArea();
+        }
+    }
+}
+
+void BVHAccel::buildPackets() {
+    /* Moving triangles are intersected one by one at the time of the ray */
+    if (m_keyframeCount > 1) {
+        std::vector<BVHTrianglePacket>().swap(m_packets);
+        return;
+    }
+
+    /* Gather the triangles into packets in leaf order, so that the
+       traversal can stream through them without any indirection */
+    const uint32_t W = NORI_PACKET_WIDTH;
+    uint32_t refCount = (uint32_t)m_indices.size();
+    m_packets.resize((refCount + W - 1) / W);
+    memset(m_packets.data(), 0, sizeof(BVHTrianglePacket) * m_packets.size());
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, (uint32_t)m_packets.size(), BVHBuildTask::GRAIN_SIZE / W),
+        [&](const tbb::blocked_range<uint32_t>& range) {
+            for (uint32_t p = range.begin(); p != range.end(); ++p) {
+                BVHTrianglePacket& packet = m_packets[p];
+                for (uint32_t lane = 0; lane < W && p * W + lane < refCount; ++lane) {
+                    uint32_t idx = m_indices[p * W + lane];
+                    uint32_t meshIdx = findMesh(idx);
+                    Point3f p0, p1, p2;
+                    m_meshes[meshIdx]->getTriangle(idx, p0, p1, p2);
+
+                    for (int i = 0; i < 3; ++i) {
+                        packet.p0[i][lane] = p0[i];
+#if defined(NORI_WATERTIGHT)
+                        packet.p1[i][lane] = p1[i];
+                        packet.p2[i][lane] = p2[i];
+#else
+                        packet.edge1[i][lane] = p1[i] - p0[i];
+                        packet.edge2[i][lane] = p2[i] - p0[i];
+#endif
+                    }
+                    packet.mesh[lane] = meshIdx;
+                    packet.index[lane] = idx;
+                }
+            }
+        }
+    );
+}
+
+/// Header of a BVH cache file, followed by the mesh offsets, nodes and indices
+struct BVHCacheHeader {
+    char magic[4];        ///< "NBVH"
+    uint32_t version;     ///< \ref BVHAccel::CACHE_VERSION
+    uint64_t key;         ///< Hash of the meshes and build settings
+    uint32_t meshCount;
+    uint32_t nodeCount;
+    uint32_t indexCount;
+    uint32_t padding;
+    uint64_t checksum;    ///< \ref FNVHash of everything after the header
+};
+
+/// Byte offset of the nodes within a cache file
+static size_t cacheNodeOffset(uint32_t meshCount) {
+    size_t offset = sizeof(BVHCacheHeader) + sizeof(uint32_t) * (meshCount + 1);
+    return (offset + 31) / 32 * 32;
+}
+
+uint64_t BVHAccel::computeCacheKey() const {
+    FNVHash hash;
+    hash.add((uint32_t)CACHE_VERSION);
+    hash.add((uint32_t)sizeof(BVHNode));
+
+    /* Build settings that influence the resulting tree */
+    hash.add((uint32_t)m_builder);
+    hash.add(m_binCount);
+    hash.add(m_serialThreshold);
+    hash.add(m_spatialSplits);
+    hash.add(m_duplicationBudget);
+    hash.add(m_optimizationPasses);
+    hash.add(m_optimizationTime);
+
+    hash.add((uint32_t)m_meshes.size());
+    for (const Mesh* mesh : m_meshes) {
+        const MatrixXfView& V = mesh->getVertexPositions();
+        const MatrixXuView& F = mesh->getIndices();
+        hash.add((uint64_t)V.cols());
+        hash.add((uint64_t)F.cols());
+        hash.add(V.data(), sizeof(float) * V.size());
+        hash.add(F.data(), sizeof(uint32_t) * F.size());
+
+        /* Moving triangles are placed according to all keyframes */
+        hash.add(mesh->getKeyframeCount());
+        for (uint32_t k = 1; k < mesh->getKeyframeCount(); ++k)
+            hash.add(mesh->getKeyframe(k).data(), sizeof(float) * V.size());
+    }
+    return hash.get();
+}
+
+bool BVHAccel::loadCache(const std::string& filename, uint64_t key) {
+    std::unique_ptr<MemoryMappedFile> file;
+    try {
+        file.reset(new MemoryMappedFile(filename));
+    }
+    catch (const NoriException&) {
+        return false; /* Not cached yet */
+    }
+
+    const uint8_t* data = (const uint8_t*)file->data();
+    if (file->size() < sizeof(BVHCacheHeader))
+        return false;
+    BVHCacheHeader header;
+    memcpy(&header, data, sizeof(BVHCacheHeader));
+    uint32_t meshCount = (uint32_t)m_meshes.size();
+    size_t nodeOffset = cacheNodeOffset(meshCount);
+    size_t indexOffset = nodeOffset + sizeof(BVHNode) * header.nodeCount;
+
+    if (memcmp(header.magic, "NBVH", 4) != 0 || header.version != CACHE_VERSION ||
+        header.key != key || header.meshCount != meshCount || header.nodeCount == 0 ||
+        file->size() != indexOffset + sizeof(uint32_t) * header.indexCount ||
+        memcmp(data + sizeof(BVHCacheHeader), m_meshOffset.data(), sizeof(uint32_t) * (meshCount + 1)) != 0)
+        return false;
+
+    /* Reject corrupted files, which would make the traversal read out of bounds */
+    FNVHash hash;
+    hash.add(data + sizeof(BVHCacheHeader), file->size() - sizeof(BVHCacheHeader));
+    if (hash.get() != header.checksum)
+        return false;
+
+    const BVHNode* nodes = (const BVHNode*)(data + nodeOffset);
+    const uint32_t* indices = (const uint32_t*)(data + indexOffset);
+    for (uint32_t i = 0; i < header.nodeCount; ++i) {
+        const BVHNode& node = nodes[i];
+        if (node.isLeaf() ? (uint64_t)node.leaf.start + node.leaf.size > header.indexCount
+                          : (node.inner.rightChild <= i + 1 || node.inner.rightChild >= header.nodeCount ||
+                             node.inner.axis > 2))
+            return false;
+    }
+    uint32_t triangleCount = getTriangleCount();
+    for (uint32_t i = 0; i < header.indexCount; ++i) {
+        if (indices[i] >= triangleCount)
+            return false;
+    }
+
+    m_nodes.assign(nodes, nodes + header.nodeCount);
+    m_indices.assign(indices, indices + header.indexCount);
+    return true;
+}
+
+void BVHAccel::saveCache(const std::string& filename, uint64_t key) const {
+    BVHCacheHeader header;
+    memset(&header, 0, sizeof(BVHCacheHeader));
+    memcpy(header.magic, "NBVH", 4);
+    header.version = CACHE_VERSION;
+    header.key = key;
+    header.meshCount = (uint32_t)m_meshes.size();
+    header.nodeCount = (uint32_t)m_nodes.size();
+    header.indexCount = (uint32_t)m_indices.size();
+
+    /* The mesh offsets and their padding fill whole 8-byte words, so
+       that hashing the parts one by one matches hashing the file */
+    std::vector<char> offsets(cacheNodeOffset(header.meshCount) - sizeof(BVHCacheHeader), 0);
+    memcpy(offsets.data(), m_meshOffset.data(), sizeof(uint32_t) * m_meshOffset.size());
+    FNVHash hash;
+    hash.add(offsets.data(), offsets.size());
+    hash.add(m_nodes.data(), sizeof(BVHNode) * m_nodes.size());
+    hash.add(m_indices.data(), sizeof(uint32_t) * m_indices.size());
+    header.checksum = hash.get();
+
+    /* Write to a temporary file with a unique name first, and atomically
+       replace the cache file with it. Concurrent invocations then never
+       observe (or produce) a partially written cache */
+    std::random_device random;
+    std::string tempFilename = tfm::format("%s.%08x%08x.tmp", filename, random(), random());
+    {
+        std::ofstream os(tempFilename, std::ios::binary);
+        os.write((const char*)&header, sizeof(BVHCacheHeader));
+        os.write(offsets.data(), offsets.size());
+        os.write((const char*)m_nodes.data(), sizeof(BVHNode) * m_nodes.size());
+        os.write((const char*)m_indices.data(), sizeof(uint32_t) * m_indices.size());
+        if (os.fail()) {
+            cerr << "BVHAccel: unable to write the cache file \"" << filename << "\"!" << endl;
+            os.close();
+            std::remove(tempFilename.c_str());
+            return;
+        }
+    }
+
+    bool success = std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+#if defined(_WIN32)
+    /* Windows does not replace existing files when renaming */
+    if (!success) {
+        std::remove(filename.c_str());
+        success = std::rename(tempFilename.c_str(), filename.c_str()) == 0;
+    }
+#endif
+    if (!success) {
+        cerr << "BVHAccel: unable to write the cache file \"" << filename << "\"!" << endl;
+        std::remove(tempFilename.c_str());
+    }
+}
+
+std::pair<float, uint32_t> BVHAccel::statistics(uint32_t node_idx) const {
+    const BVHNode& node = m_nodes[node_idx];
+    if (node.isLeaf()) {
+        return std::make_pair((float)BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
+    }
+    else {
+        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
+        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
+        float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
+        float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
+        float saCur = node.bbox.getSurfaceArea();
+        float sahCost =
+            2 * BVHBuildTask::TRAVERSAL_COST +
+            (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
+        return std::make_pair(
+            sahCost,
+            stats_left.second + stats_right.second + 1u
+        );
+    }
+}
+
+#if defined(__AVX__)
+typedef __m256 PacketFloat;
+static inline PacketFloat pset1(float f) { return _mm256_set1_ps(f); }
+static inline PacketFloat pload(const float* p) { return _mm256_load_ps(p); }
+static inline PacketFloat padd(PacketFloat a, PacketFloat b) { return _mm256_add_ps(a, b); }
+static inline PacketFloat psub(PacketFloat a, PacketFloat b) { return _mm256_sub_ps(a, b); }
+static inline PacketFloat pmul(PacketFloat a, PacketFloat b) { return _mm256_mul_ps(a, b); }
+static inline PacketFloat pdiv(PacketFloat a, PacketFloat b) { return _mm256_div_ps(a, b); }
+static inline PacketFloat pand(PacketFloat a, PacketFloat b) { return _mm256_and_ps(a, b); }
+static inline PacketFloat por(PacketFloat a, PacketFloat b) { return _mm256_or_ps(a, b); }
+static inline PacketFloat pmin(PacketFloat a, PacketFloat b) { return _mm256_min_ps(a, b); }
+static inline PacketFloat pmax(PacketFloat a, PacketFloat b) { return _mm256_max_ps(a, b); }
+static inline PacketFloat ple(PacketFloat a, PacketFloat b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+static inline PacketFloat pge(PacketFloat a, PacketFloat b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+static inline PacketFloat plt(PacketFloat a, PacketFloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline PacketFloat pgt(PacketFloat a, PacketFloat b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+static inline PacketFloat peq(PacketFloat a, PacketFloat b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+static inline PacketFloat pandnot(PacketFloat a, PacketFloat b) { return _mm256_andnot_ps(a, b); }
+static inline int pmovemask(PacketFloat a) { return _mm256_movemask_ps(a); }
+static inline void pstore(float* p, PacketFloat a) { _mm256_store_ps(p, a); }
+#elif defined(__SSE2__) || defined(_M_X64)
+typedef __m128 PacketFloat;
+static inline PacketFloat pset1(float f) { return _mm_set1_ps(f); }
+static inline PacketFloat pload(const float* p) { return _mm_load_ps(p); }
+static inline PacketFloat padd(PacketFloat a, PacketFloat b) { return _mm_add_ps(a, b); }
+static inline PacketFloat psub(PacketFloat a, PacketFloat b) { return _mm_sub_ps(a, b); }
+static inline PacketFloat pmul(PacketFloat a, PacketFloat b) { return _mm_mul_ps(a, b); }
+static inline PacketFloat pdiv(PacketFloat a, PacketFloat b) { return _mm_div_ps(a, b); }
+static inline PacketFloat pand(PacketFloat a, PacketFloat b) { return _mm_and_ps(a, b); }
+static inline PacketFloat por(PacketFloat a, PacketFloat b) { return _mm_or_ps(a, b); }
+static inline PacketFloat pmin(PacketFloat a, PacketFloat b) { return _mm_min_ps(a, b); }
+static inline PacketFloat pmax(PacketFloat a, PacketFloat b) { return _mm_max_ps(a, b); }
+static inline PacketFloat ple(PacketFloat a, PacketFloat b) { return _mm_cmple_ps(a, b); }
+static inline PacketFloat pge(PacketFloat a, PacketFloat b) { return _mm_cmpge_ps(a, b); }
+static inline PacketFloat plt(PacketFloat a, PacketFloat b) { return _mm_cmplt_ps(a, b); }
+static inline PacketFloat pgt(PacketFloat a, PacketFloat b) { return _mm_cmpgt_ps(a, b); }
+static inline PacketFloat peq(PacketFloat a, PacketFloat b) { return _mm_cmpeq_ps(a, b); }
+static inline PacketFloat pandnot(PacketFloat a, PacketFloat b) { return _mm_andnot_ps(a, b); }
+static inline int pmovemask(PacketFloat a) { return _mm_movemask_ps(a); }
+static inline void pstore(float* p, PacketFloat a) { _mm_store_ps(p, a); }
+#endif
+
+int BVHAccel::BVHTrianglePacket::rayIntersect(const Ray3f& ray, const TriangleRay& tray,
+    int mask, float& u, float& v, float& t) const {
+    const int W = NORI_PACKET_WIDTH;
+    alignas(W * sizeof(float)) float tt[W], uu[W], vv[W];
+    int hits = hitMask(ray, tray, mask, tt, uu, vv);
+    if (!hits)
+        return -1;
+
+    /* Select the closest of the hit lanes */
+    int best = -1;
+    for (int i = 0; i < W; ++i) {
+        if ((hits & (1 << i)) && (best == -1 || tt[i] < tt[best]))
+            best = i;
+    }
+    u = uu[best];
+    v = vv[best];
+    t = tt[best];
+    return best;
+}
+
+bool BVHAccel::BVHTrianglePacket::occluded(const Ray3f& ray, const TriangleRay& tray,
+    int mask) const {
+    const int W = NORI_PACKET_WIDTH;
+    alignas(W * sizeof(float)) float tt[W], uu[W], vv[W];
+    return hitMask(ray, tray, mask, tt, uu, vv) != 0;
+}
+
+int BVHAccel::BVHTrianglePacket::hitMask(const Ray3f& ray, const TriangleRay& tray,
+    int mask, float* tt, float* uu, float* vv) const {
+    int hits = 0;
+
+#if defined(NORI_WATERTIGHT)
+    const WatertightRay& wray = tray;
+#if defined(__SSE2__) || defined(_M_X64)
+    const int kx = wray.kx, ky = wray.ky, kz = wray.kz;
+    PacketFloat zero = pset1(0.0f), Sx = pset1(wray.Sx), Sy = pset1(wray.Sy);
+    PacketFloat ox = pset1(wray.o[kx]), oy = pset1(wray.o[ky]), oz = pset1(wray.o[kz]);
+
+    /* Vertices relative to the ray origin, sheared and scaled */
+    PacketFloat Az = psub(pload(p0[kz]), oz), Bz = psub(pload(p1[kz]), oz), Cz = psub(pload(p2[kz]), oz);
+    PacketFloat Ax = psub(psub(pload(p0[kx]), ox), pmul(Sx, Az));
+    PacketFloat Ay = psub(psub(pload(p0[ky]), oy), pmul(Sy, Az));
+    PacketFloat Bx = psub(psub(pload(p1[kx]), ox), pmul(Sx, Bz));
+    PacketFloat By = psub(psub(pload(p1[ky]), oy), pmul(Sy, Bz));
+    PacketFloat Cx = psub(psub(pload(p2[kx]), ox), pmul(Sx, Cz));
+    PacketFloat Cy = psub(psub(pload(p2[ky]), oy), pmul(Sy, Cz));
+
+    /* Scaled barycentric coordinates */
+    PacketFloat U = psub(pmul(Cx, By), pmul(Cy, Bx));
+    PacketFloat V = psub(pmul(Ax, Cy), pmul(Ay, Cx));
+    PacketFloat Wc = psub(pmul(Bx, Ay), pmul(By, Ax));
+
+    /* Reject rays outside of an edge and edge-on triangles */
+    PacketFloat anyNeg = por(por(plt(U, zero), plt(V, zero)), plt(Wc, zero));
+    PacketFloat anyPos = por(por(pgt(U, zero), pgt(V, zero)), pgt(Wc, zero));
+    PacketFloat det = padd(padd(U, V), Wc);
+    PacketFloat invalid = por(pand(anyNeg, anyPos), peq(det, zero));
+
+    PacketFloat invDet = pdiv(pset1(1.0f), det);
+    PacketFloat T = pmul(pset1(wray.Sz), padd(padd(pmul(U, Az), pmul(V, Bz)), pmul(Wc, Cz)));
+    PacketFloat pt = pmul(T, invDet);
+    PacketFloat valid = pandnot(invalid, pand(pge(pt, pset1(ray.mint)), ple(pt, pset1(ray.maxt))));
+
+    hits = pmovemask(valid) & mask;
+    pstore(tt, pt);
+    pstore(uu, pmul(V, invDet));
+    pstore(vv, pmul(Wc, invDet));
+
+    /* Lanes with an edge function of exactly zero are repeated with the
+       double precision fallback of the scalar test */
+    int zeroLanes = pmovemask(por(por(peq(U, zero), peq(V, zero)), peq(Wc, zero))) & mask;
+    for (int i = 0; zeroLanes; ++i, zeroLanes >>= 1) {
+        if (!(zeroLanes & 1))
+            continue;
+        hits &= ~(1 << i);
+        if (rayIntersectWatertight(wray, Point3f(p0[0][i], p0[1][i], p0[2][i]),
+                Point3f(p1[0][i], p1[1][i], p1[2][i]), Point3f(p2[0][i], p2[1][i], p2[2][i]),
+                ray.mint, ray.maxt, uu[i], vv[i], tt[i]))
+            hits |= 1 << i;
+    }
+#else
+    const int W = NORI_PACKET_WIDTH;
+    for (int i = 0; i < W; ++i) {
+        if ((mask & (1 << i)) && rayIntersectWatertight(wray,
+                Point3f(p0[0][i], p0[1][i], p0[2][i]), Point3f(p1[0][i], p1[1][i], p1[2][i]),
+                Point3f(p2[0][i], p2[1][i], p2[2][i]), ray.mint, ray.maxt, uu[i], vv[i], tt[i]))
+            hits |= 1 << i;
+    }
+#endif
+#elif defined(__SSE2__) || defined(_M_X64)
+    PacketFloat dx = pset1(ray.d.x()), dy = pset1(ray.d.y()), dz = pset1(ray.d.z());
+    PacketFloat e1x = pload(edge1[0]), e1y = pload(edge1[1]), e1z = pload(edge1[2]);
+    PacketFloat e2x = pload(edge2[0]), e2y = pload(edge2[1]), e2z = pload(edge2[2]);
+    PacketFloat zero = pset1(0.0f), one = pset1(1.0f);
+
+    /* Begin calculating determinant - also used to calculate U parameter */
+    PacketFloat px = psub(pmul(dy, e2z), pmul(dz, e2y));
+    PacketFloat py = psub(pmul(dz, e2x), pmul(dx, e2z));
+    PacketFloat pz = psub(pmul(dx, e2y), pmul(dy, e2x));
+
+    /* If determinant is near zero, ray lies in plane of triangle */
+    PacketFloat det = padd(padd(pmul(e1x, px), pmul(e1y, py)), pmul(e1z, pz));
+    PacketFloat valid = por(ple(det, pset1(-1e-8f)), pge(det, pset1(1e-8f)));
+    PacketFloat inv_det = pdiv(one, det);
+
+    /* Calculate distance from v[0] to ray origin */
+    PacketFloat tx = psub(pset1(ray.o.x()), pload(p0[0]));
+    PacketFloat ty = psub(pset1(ray.o.y()), pload(p0[1]));
+    PacketFloat tz = psub(pset1(ray.o.z()), pload(p0[2]));
+
+    /* Calculate U parameter and test bounds */
+    PacketFloat pu = pmul(padd(padd(pmul(tx, px), pmul(ty, py)), pmul(tz, pz)), inv_det);
+    valid = pand(valid, pand(pge(pu, zero), ple(pu, one)));
+
+    /* Prepare to test V parameter */
+    PacketFloat qx = psub(pmul(ty, e1z), pmul(tz, e1y));
+    PacketFloat qy = psub(pmul(tz, e1x), pmul(tx, e1z));
+    PacketFloat qz = psub(pmul(tx, e1y), pmul(ty, e1x));
+
+    /* Calculate V parameter and test bounds */
+    PacketFloat pv = pmul(padd(padd(pmul(dx, qx), pmul(dy, qy)), pmul(dz, qz)), inv_det);
+    valid = pand(valid, pand(pge(pv, zero), ple(padd(pu, pv), one)));
+
+    /* Ray intersects triangle -> compute t */
+    PacketFloat pt = pmul(padd(padd(pmul(e2x, qx), pmul(e2y, qy)), pmul(e2z, qz)), inv_det);
+    valid = pand(valid, pand(pge(pt, pset1(ray.mint)), ple(pt, pset1(ray.maxt))));
+
+    hits = pmovemask(valid) & mask;
+    if (!hits)
+        return 0;
+    pstore(tt, pt);
+    pstore(uu, pu);
+    pstore(vv, pv);
+#else
+    /* Scalar fallback: same test, one lane at a time */
+    const int W = NORI_PACKET_WIDTH;
+    for (int i = 0; i < W; ++i) {
+        if (!(mask & (1 << i)))
+            continue;
+        Vector3f e1(edge1[0][i], edge1[1][i], edge1[2][i]);
+        Vector3f e2(edge2[0][i], edge2[1][i], edge2[2][i]);
+        Vector3f pvec = ray.d.cross(e2);
+        float det = e1.dot(pvec);
+        if (det > -1e-8f && det < 1e-8f)
+            continue;
+        float inv_det = 1.0f / det;
+        Vector3f tvec = ray.o - Point3f(p0[0][i], p0[1][i], p0[2][i]);
+        uu[i] = tvec.dot(pvec) * inv_det;
+        if (uu[i] < 0.0 || uu[i] > 1.0)
+            continue;
+        Vector3f qvec = tvec.cross(e1);
+        vv[i] = ray.d.dot(qvec) * inv_det;
+        if (vv[i] < 0.0 || uu[i] + vv[i] > 1.0)
+            continue;
+        tt[i] = e2.dot(qvec) * inv_det;
+        if (tt[i] >= ray.mint && tt[i] <= ray.maxt)
+            hits |= 1 << i;
+    }
+#endif
+
+    return hits;
+}
+
+/// Mask of the lanes of triangle packet \c p that belong to the index range <tt>[start, end)</tt>
+static inline int packetLaneMask(uint32_t p, uint32_t start, uint32_t end) {
+    const uint32_t W = NORI_PACKET_WIDTH;
+    uint32_t lo = std::max(start, p * W) - p * W,
+             hi = std::min(end, p * W + W) - p * W;
+    return ((1 << hi) - 1) & ~((1 << lo) - 1);
+}
+
+bool BVHAccel::intersectTriangles(uint32_t start, uint32_t end, Ray3f& ray,
+    const TriangleRay& tray, Intersection& its, bool shadowRay, uint32_t& f) const {
+    const uint32_t W = NORI_PACKET_WIDTH;
+    bool foundIntersection = false;
+
+    if (m_packets.empty()) {
+        /* Moving meshes: interpolate the vertices to the time of the ray */
+        for (uint32_t i = start; i < end; ++i) {
+            uint32_t idx = m_indices[i];
+            uint32_t meshIdx = findMesh(idx);
+            float u, v, t;
+            if (m_meshes[meshIdx]->rayIntersect(idx, ray, tray, u, v, t)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+                ray.maxt = its.t = t;
+                its.uv = Point2f(u, v);
+                its.mesh = m_meshes[meshIdx];
+                f = idx;
+            }
+        }
+        return foundIntersection;
+    }
+
+    for (uint32_t p = start / W, p_end = (end + W - 1) / W; p < p_end; ++p) {
+        /* Only test the lanes that belong to the index range */
+        int mask = packetLaneMask(p, start, end);
+
+        const BVHTrianglePacket& packet = m_packets[p];
+        float u, v, t;
+        int lane = packet.rayIntersect(ray, tray, mask, u, v, t);
+        if (lane >= 0) {
+            if (shadowRay)
+                return true;
+            foundIntersection = true;
+            ray.maxt = its.t = t;
+            its.uv = Point2f(u, v);
+            its.mesh = m_meshes[packet.mesh[lane]];
+            f = packet.index[lane];
+        }
+    }
+
+    return foundIntersection;
+}
+
+bool BVHAccel::occludedTriangles(uint32_t start, uint32_t end, const Ray3f& ray,
+    const TriangleRay& tray) const {
+    const uint32_t W = NORI_PACKET_WIDTH;
+    if (m_packets.empty()) {
+        for (uint32_t i = start; i < end; ++i) {
+            uint32_t idx = m_indices[i];
+            uint32_t meshIdx = findMesh(idx);
+            float u, v, t;
+            if (m_meshes[meshIdx]->rayIntersect(idx, ray, tray, u, v, t))
+                return true;
+        }
+        return false;
+    }
+    for (uint32_t p = start / W, p_end = (end + W - 1) / W; p < p_end; ++p) {
+        if (m_packets[p].occluded(ray, tray, packetLaneMask(p, start, end)))
+            return true;
+    }
+    return false;
+}
+
+void BVHAccel::finalizeIntersection(uint32_t f, float time, Intersection& its) const {
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1 - its.uv.sum(), its.uv;
+
+    /* References to all relevant mesh buffers */
+    const Mesh* mesh = its.mesh;
+    const MatrixXuView& F = mesh->getIndices();
+
+    /* Vertex indices of the triangle */
+    uint32_t idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+
+    /* Vertex positions at the time of the ray (moving meshes) */
+    Point3f p0 = mesh->getVertexPosition(idx0, time),
+            p1 = mesh->getVertexPosition(idx1, time),
+            p2 = mesh->getVertexPosition(idx2, time);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (mesh->hasVertexTexCoords())
+        its.uv = bary.x() * mesh->getVertexTexCoord(idx0) +
+        bary.y() * mesh->getVertexTexCoord(idx1) +
+        bary.z() * mesh->getVertexTexCoord(idx2);
+
+    /* Compute the geometry frame */
+    its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
+
+    if (mesh->hasVertexNormals()) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        its.shFrame = Frame(
+            (bary.x() * mesh->getVertexNormal(idx0, time) +
+                bary.y() * mesh->getVertexNormal(idx1, time) +
+                bary.z() * mesh->getVertexNormal(idx2, time)).normalized());
+    }
+    else {
+        its.shFrame = its.geoFrame;
+    }
+}
+
+bool BVHAccel::rayIntersect(const Ray3f& _ray, Intersection& its, bool shadowRay) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    float stack_t[64];
+
+    its.t = std::numeric_limits<float>::infinity();
+
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (ray.maxt < ray.mint)
+        return false;
+
+    if (!m_nodes8.empty() || !m_nodes16.empty()) {
+        uint32_t f = 0;
+        bool found = m_nodes8.empty()
+            ? rayIntersectQuantized(m_nodes16, ray, its, shadowRay, f)
+            : rayIntersectQuantized(m_nodes8, ray, its, shadowRay, f);
+        if (found && !shadowRay)
+            finalizeIntersection(f, ray.time, its);
+        return found;
+    }
+
+    if (m_nodes.empty())
+        return false;
+
+    bool foundIntersection = false;
+    uint32_t f = 0;
+    NodeVisitCounter visits;
+
+    if (!m_motionBounds.empty()) {
+        foundIntersection = rayIntersectMotion(ray, its, shadowRay, f);
+        if (foundIntersection && !shadowRay)
+            finalizeIntersection(f, ray.time, its);
+        return foundIntersection;
+    }
+
+    /* Entry distance of a box along the current ray segment (or infinity on a miss) */
+    auto entryT = [&](const BoundingBox3f& bbox) {
+        float nearT, farT;
+        if (!bbox.rayIntersect(ray, nearT, farT) || nearT > ray.maxt || farT < ray.mint)
+            return std::numeric_limits<float>::infinity();
+        return std::max(nearT, ray.mint);
+    };
+
+    /* Pop the next node whose entry distance does not exceed 'ray.maxt' */
+    auto pop = [&]() {
+        while (stack_idx > 0) {
+            --stack_idx;
+            if (stack_t[stack_idx] <= ray.maxt) {
+                node_idx = stack[stack_idx];
+                return true;
+            }
+        }
+        return false;
+    };
+
+    bool dirIsNeg[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+    bool distanceOrder = m_traversalOrder == EDistanceOrder;
+    TriangleRay tray(ray);
+
+    /* With distance ordering, children are tested before they are pushed */
+    if (distanceOrder && entryT(m_nodes[0].bbox) == std::numeric_limits<float>::infinity())
+        return false;
+
+    while (true) {
+        const BVHNode& node = m_nodes[node_idx];
+        visits++;
+
+        if (!distanceOrder && !node.bbox.rayIntersect(ray)) {
+            if (!pop())
+                break;
+            continue;
+        }
+
+        if (node.isInner()) {
+            uint32_t near_idx = node_idx + 1, far_idx = node.inner.rightChild;
+            float far_t = -std::numeric_limits<float>::infinity();
+
+            if (m_traversalOrder == ESignOrder) {
+                /* The left child holds the primitives with smaller
+                   centroids along the split axis */
+                if (dirIsNeg[node.inner.axis])
+                    std::swap(near_idx, far_idx);
+            }
+            else if (distanceOrder) {
+                float near_t = entryT(m_nodes[near_idx].bbox);
+                far_t = entryT(m_nodes[far_idx].bbox);
+                if (far_t < near_t) {
+                    std::swap(near_idx, far_idx);
+                    std::swap(near_t, far_t);
+                }
+                if (near_t == std::numeric_limits<float>::infinity()) {
+                    /* Neither child is hit */
+                    if (!pop())
+                        break;
+                    continue;
+                }
+                if (far_t == std::numeric_limits<float>::infinity()) {
+                    /* Only the near child is hit */
+                    node_idx = near_idx;
+                    continue;
+                }
+            }
+
+            stack_t[stack_idx] = far_t;
+            stack[stack_idx++] = far_idx;
+            node_idx = near_idx;
+            assert(stack_idx < 64);
+        }
+        else {
+            if (intersectTriangles(node.start(), node.end(), ray, tray, its, shadowRay, f)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+            if (!pop())
+                break;
+            continue;
+        }
+    }
+
+    if (foundIntersection)
+        finalizeIntersection(f, ray.time, its);
+
+    return foundIntersection;
+}
+
+template <typename T>
+bool BVHAccel::rayIntersectQuantized(const std::vector<BVHQuantizedNode<T>>& nodes,
+    Ray3f& ray, Intersection& its, bool shadowRay, uint32_t& f) const {
+    /* The child boxes have to be decoded before they can be tested, so
+       both children are always tested and visited in the order of their
+       entry distances. Stack entries keep the decoded box of the node. */
+    struct StackEntry {
+        uint32_t node_idx;
+        float t;
+        BoundingBox3f bbox;
+    };
+    StackEntry stack[64];
+    uint32_t node_idx = 0, stack_idx = 0;
+    NodeVisitCounter visits;
+    BoundingBox3f bbox = m_rootBBox;
+    bool foundIntersection = false;
+    TriangleRay tray(ray);
+
+    /* Entry distance of a box along the current ray segment (or infinity on a miss) */
+    auto entryT = [&](const BoundingBox3f& bbox) {
+        float nearT, farT;
+        if (!bbox.rayIntersect(ray, nearT, farT) || nearT > ray.maxt || farT < ray.mint)
+            return std::numeric_limits<float>::infinity();
+        return std::max(nearT, ray.mint);
+    };
+
+    /* Pop the next node whose entry distance does not exceed 'ray.maxt' */
+    auto pop = [&]() {
+        while (stack_idx > 0) {
+            const StackEntry& entry = stack[--stack_idx];
+            if (entry.t <= ray.maxt) {
+                node_idx = entry.node_idx;
+                bbox = entry.bbox;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    if (entryT(bbox) == std::numeric_limits<float>::infinity())
+        return false;
+
+    while (true) {
+        const BVHQuantizedNode<T>& node = nodes[node_idx];
+        visits++;
+
+        if (!node.leaf) {
+            uint32_t near_idx = node_idx + 1, far_idx = node.offset;
+            BoundingBox3f near_bbox = nodes[near_idx].decode(bbox),
+                          far_bbox = nodes[far_idx].decode(bbox);
+            float near_t = entryT(near_bbox), far_t = entryT(far_bbox);
+            if (far_t < near_t) {
+                std::swap(near_idx, far_idx);
+                std::swap(near_bbox, far_bbox);
+                std::swap(near_t, far_t);
+            }
+
+            if (near_t == std::numeric_limits<float>::infinity()) {
+                if (!pop())
+                    break;
+                continue;
+            }
+            if (far_t != std::numeric_limits<float>::infinity()) {
+                stack[stack_idx++] = StackEntry{ far_idx, far_t, far_bbox };
+                assert(stack_idx < 64);
+            }
+            node_idx = near_idx;
+            bbox = near_bbox;
+        }
+        else {
+            if (intersectTriangles(node.offset, node.offset + node.size, ray, tray, its, shadowRay, f)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+            if (!pop())
+                break;
+        }
+    }
+
+    return foundIntersection;
+}
+
+/// Per-ray and interval data of a ray packet during BVH traversal
+struct BVHRayPacket {
+    enum { Size = RayPacket8::Size };
+
+    alignas(32) float o[3][Size];     ///< Ray origins
+    alignas(32) float dRcp[3][Size];  ///< Reciprocal ray directions
+    alignas(32) float mint[Size];     ///< Minimum positions on the ray segments
+    alignas(32) float maxt[Size];     ///< Current maximum positions on the ray segments
+
+    float oMin[3], oMax[3];           ///< Bounds of the ray origins
+    float rcpMin[3], rcpMax[3];       ///< Bounds of the reciprocal directions
+    bool coherent[3];                 ///< Do all directions share their sign along an axis?
+
+    /// Compute the interval bounds of the rays selected by \c mask
+    void updateBounds(int mask) {
+        for (int a = 0; a < 3; ++a) {
+            oMin[a] = rcpMin[a] = std::numeric_limits<float>::infinity();
+            oMax[a] = rcpMax[a] = -std::numeric_limits<float>::infinity();
+            for (int i = 0; i < Size; ++i) {
+                if (!(mask & (1 << i)))
+                    continue;
+                oMin[a] = std::min(oMin[a], o[a][i]);
+                oMax[a] = std::max(oMax[a], o[a][i]);
+                rcpMin[a] = std::min(rcpMin[a], dRcp[a][i]);
+                rcpMax[a] = std::max(rcpMax[a], dRcp[a][i]);
+            }
+            coherent[a] = std::isfinite(rcpMin[a]) && std::isfinite(rcpMax[a]) &&
+                (rcpMin[a] > 0 || rcpMax[a] < 0);
+        }
+    }
+
+    /**
+     * \brief Conservative test whether none of the rays selected by
+     * \c mask can hit the box
+     *
+     * Interval arithmetic yields a lower bound of the entry distance and an
+     * upper bound of the exit distance over all rays of the packet. Axes
+     * along which the directions differ in sign are not used.
+     */
+    bool frustumMisses(const BoundingBox3f& bbox, int mask) const {
+        float tnear = std::numeric_limits<float>::infinity(),
+              tfar = -std::numeric_limits<float>::infinity();
+        for (int i = 0; i < Size; ++i) {
+            if (mask & (1 << i)) {
+                tnear = std::min(tnear, mint[i]);
+                tfar = std::max(tfar, maxt[i]);
+            }
+        }
+
+        for (int a = 0; a < 3; ++a) {
+            if (!coherent[a])
+                continue;
+            bool positive = rcpMin[a] > 0;
+            float nearPlane = positive ? bbox.min[a] : bbox.max[a];
+            float farPlane = positive ? bbox.max[a] : bbox.min[a];
+
+            /* Bounds of (plane - o) * rcp over all rays */
+            float n0 = nearPlane - oMax[a], n1 = nearPlane - oMin[a];
+            float f0 = farPlane - oMax[a], f1 = farPlane - oMin[a];
+            float entry = std::min(std::min(n0 * rcpMin[a], n0 * rcpMax[a]),
+                                   std::min(n1 * rcpMin[a], n1 * rcpMax[a]));
+            float exit = std::max(std::max(f0 * rcpMin[a], f0 * rcpMax[a]),
+                                  std::max(f1 * rcpMin[a], f1 * rcpMax[a]));
+            tnear = std::max(tnear, entry);
+            tfar = std::min(tfar, exit * SlabFarScale);
+        }
+
+        return tnear > tfar;
+    }
+
+    /// Slab test of the rays selected by \c mask against a box
+    int boxTest(const BoundingBox3f& bbox, int mask) const {
+        int result = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+        const int W = NORI_PACKET_WIDTH;
+        for (int c = 0; c < Size; c += W) {
+            if (!((mask >> c) & ((1 << W) - 1)))
+                continue;
+            PacketFloat tn = pload(mint + c), tf = pload(maxt + c);
+            for (int a = 0; a < 3; ++a) {
+                PacketFloat org = pload(o[a] + c), rcp = pload(dRcp[a] + c);
+                PacketFloat t0 = pmul(psub(pset1(bbox.min[a]), org), rcp);
+                PacketFloat t1 = pmul(psub(pset1(bbox.max[a]), org), rcp);
+                tn = pmax(pmin(t0, t1), tn);
+                tf = pmin(pmul(pmax(t0, t1), pset1(SlabFarScale)), tf);
+            }
+            result |= pmovemask(ple(tn, tf)) << c;
+        }
+#else
+        for (int i = 0; i < Size; ++i) {
+            float tn = mint[i], tf = maxt[i];
+            for (int a = 0; a < 3; ++a) {
+                float t0 = (bbox.min[a] - o[a][i]) * dRcp[a][i];
+                float t1 = (bbox.max[a] - o[a][i]) * dRcp[a][i];
+                if (t0 > t1)
+                    std::swap(t0, t1);
+                t1 *= SlabFarScale;
+                tn = t0 > tn ? t0 : tn;
+                tf = t1 < tf ? t1 : tf;
+            }
+            result |= (tn <= tf) << i;
+        }
+#endif
+        return result & mask;
+    }
+};
+
+bool BVHAccel::occluded(const Ray3f& _ray) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    NodeVisitCounter visits;
+
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (ray.maxt < ray.mint)
+        return false;
+
+    if (!m_nodes8.empty())
+        return occludedQuantized(m_nodes8, ray);
+    else if (!m_nodes16.empty())
+        return occludedQuantized(m_nodes16, ray);
+    else if (m_nodes.empty())
+        return false;
+
+    if (!m_motionBounds.empty()) {
+        Intersection its;
+        uint32_t f;
+        return rayIntersectMotion(ray, its, true, f);
+    }
+
+    TriangleRay tray(ray);
+    while (true) {
+        const BVHNode& node = m_nodes[node_idx];
+        visits++;
+
+        if (node.bbox.rayIntersect(ray)) {
+            if (node.isInner()) {
+                uint32_t first = node_idx + 1, second = node.inner.rightChild;
+                if (node.inner.rightLarger)
+                    std::swap(first, second);
+                stack[stack_idx++] = second;
+                node_idx = first;
+                assert(stack_idx < 64);
+                continue;
+            }
+            if (occludedTriangles(node.start(), node.end(), ray, tray))
+                return true;
+        }
+
+        if (stack_idx == 0)
+            break;
+        node_idx = stack[--stack_idx];
+    }
+
+    return false;
+}
+
+bool BVHAccel::rayIntersectMotion(Ray3f& ray, Intersection& its, bool shadowRay, uint32_t& f) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    NodeVisitCounter visits;
+    bool foundIntersection = false;
+
+    /* Keyframes around the time of the ray (same arithmetic as the meshes,
+       so that the interpolated bounds contain the interpolated vertices) */
+    const uint32_t K = m_keyframeCount;
+    float x = std::min(std::max(ray.time, 0.0f), 1.0f) * (K - 1);
+    uint32_t k = std::min((uint32_t) x, K - 2);
+    float alpha = x - k;
+
+    bool dirIsNeg[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+    TriangleRay tray(ray);
+
+    while (true) {
+        const BVHNode& node = m_nodes[node_idx];
+        const BoundingBox3f& b0 = m_motionBounds[node_idx * K + k],
+                           & b1 = m_motionBounds[node_idx * K + k + 1];
+        BoundingBox3f bbox((1 - alpha) * b0.min + alpha * b1.min,
+                           (1 - alpha) * b0.max + alpha * b1.max);
+        visits++;
+
+        if (bbox.rayIntersect(ray)) {
+            if (node.isInner()) {
+                uint32_t near_idx = node_idx + 1, far_idx = node.inner.rightChild;
+                if (dirIsNeg[node.inner.axis])
+                    std::swap(near_idx, far_idx);
+                stack[stack_idx++] = far_idx;
+                node_idx = near_idx;
+                assert(stack_idx < 64);
+                continue;
+            }
+            if (intersectTriangles(node.start(), node.end(), ray, tray, its, shadowRay, f)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+        }
+
+        if (stack_idx == 0)
+            break;
+        node_idx = stack[--stack_idx];
+    }
+
+    return foundIntersection;
+}
+
+template <typename T>
+bool BVHAccel::occludedQuantized(const std::vector<BVHQuantizedNode<T>>& nodes,
+    const Ray3f& ray) const {
+    struct StackEntry {
+        uint32_t node_idx;
+        BoundingBox3f bbox;
+    };
+    StackEntry stack[64];
+    uint32_t node_idx = 0, stack_idx = 0;
+    NodeVisitCounter visits;
+    BoundingBox3f bbox = m_rootBBox;
+
+    if (!bbox.rayIntersect(ray))
+        return false;
+    TriangleRay tray(ray);
+
+    while (true) {
+        const BVHQuantizedNode<T>& node = nodes[node_idx];
+        visits++;
+
+        if (!node.leaf) {
+            /* Push the hit children so that the larger one is visited first */
+            uint32_t first = node_idx + 1, second = node.offset;
+            if (node.rightLarger)
+                std::swap(first, second);
+            BoundingBox3f first_bbox = nodes[first].decode(bbox),
+                          second_bbox = nodes[second].decode(bbox);
+            if (second_bbox.rayIntersect(ray))
+                stack[stack_idx++] = StackEntry{ second, second_bbox };
+            if (first_bbox.rayIntersect(ray))
+                stack[stack_idx++] = StackEntry{ first, first_bbox };
+            assert(stack_idx < 64);
+        }
+        else if (occludedTriangles(node.offset, node.offset + node.size, ray, tray))
+            return true;
+
+        if (stack_idx == 0)
+            break;
+        --stack_idx;
+        node_idx = stack[stack_idx].node_idx;
+        bbox = stack[stack_idx].bbox;
+    }
+
+    return false;
+}
+
+int BVHAccel::rayIntersect8(const RayPacket8& packet, int active,
+    Intersection* its, bool shadowRay) const {
+    /* The packet traversal works on uncompressed nodes of static meshes only */
+    if (!m_nodes8.empty() || !m_nodes16.empty() || m_packets.empty())
+        return Accel::rayIntersect8(packet, active, its, shadowRay);
+
+    const int N = RayPacket8::Size;
+    BVHRayPacket rp;
+    Ray3f rays[N];
+    TriangleRay trays[N];
+    uint32_t f[N];
+    Intersection unused[N];
+    if (!its)
+        its = unused;
+
+    active &= (1 << N) - 1;
+    for (int i = 0; i < N; ++i) {
+        /* Inactive lanes get an empty segment */
+        rp.mint[i] = 1.0f;
+        rp.maxt[i] = 0.0f;
+        for (int a = 0; a < 3; ++a)
+            rp.o[a][i] = rp.dRcp[a][i] = 0.0f;
+        if (!(active & (1 << i)))
+            continue;
+
+        /* Use an adaptive ray epsilon */
+        rays[i] = packet.get(i);
+        if (rays[i].mint == Epsilon)
+            rays[i].mint = std::max(rays[i].mint, rays[i].mint * rays[i].o.array().abs().maxCoeff());
+        if (rays[i].maxt < rays[i].mint) {
+            active &= ~(1 << i);
+            continue;
+        }
+        its[i].t = std::numeric_limits<float>::infinity();
+        trays[i] = TriangleRay(rays[i]);
+
+        for (int a = 0; a < 3; ++a) {
+            rp.o[a][i] = rays[i].o[a];
+            rp.dRcp[a][i] = rays[i].dRcp[a];
+        }
+        rp.mint[i] = rays[i].mint;
+        rp.maxt[i] = rays[i].maxt;
+    }
+
+    if (m_nodes.empty() || !active)
+        return 0;
+
+    rp.updateBounds(active);
+
+    struct StackEntry {
+        uint32_t node_idx;
+        int mask;
+    } stack[64];
+    uint32_t node_idx = 0, stack_idx = 0;
+    NodeVisitCounter visits;
+    int mask = active, hits = 0;
+
+    while (true) {
+        /* Shadow rays leave the packet once they are blocked */
+        mask &= active;
+
+        if (mask) {
+            const BVHNode& node = m_nodes[node_idx];
+
+            /* Count the node once per ray, like the single ray traversals */
+            for (int m = mask; m; m &= m - 1)
+                visits++;
+
+            mask = rp.frustumMisses(node.bbox, mask) ? 0 : rp.boxTest(node.bbox, mask);
+
+            if (mask && node.isInner()) {
+                /* Order the children based on the first active ray */
+                int first = 0;
+                while (!(mask & (1 << first)))
+                    ++first;
+                uint32_t near_idx = node_idx + 1, far_idx = node.inner.rightChild;
+                if (rp.dRcp[node.inner.axis][first] < 0)
+                    std::swap(near_idx, far_idx);
+
+                stack[stack_idx++] = StackEntry{ far_idx, mask };
+                node_idx = near_idx;
+                assert(stack_idx < 64);
+                continue;
+            }
+            else if (mask) {
+                /* Test each triangle packet of the leaf against all rays in turn */
+                const uint32_t W = NORI_PACKET_WIDTH;
+                uint32_t start = node.start(), end = node.end();
+                for (uint32_t p = start / W, p_end = (end + W - 1) / W; p < p_end && (mask & active); ++p) {
+                    const BVHTrianglePacket& triangles = m_packets[p];
+                    int lanes = packetLaneMask(p, start, end);
+                    for (int i = 0; i < N; ++i) {
+                        if (!(mask & active & (1 << i)))
+                            continue;
+                        float u, v, t;
+                        int lane = triangles.rayIntersect(rays[i], trays[i], lanes, u, v, t);
+                        if (lane < 0)
+                            continue;
+                        hits |= 1 << i;
+                        if (shadowRay) {
+                            active &= ~(1 << i);
+                            continue;
+                        }
+                        rp.maxt[i] = rays[i].maxt = its[i].t = t;
+                        its[i].uv = Point2f(u, v);
+                        its[i].mesh = m_meshes[triangles.mesh[lane]];
+                        f[i] = triangles.index[lane];
+                    }
+                }
+                if (!active)
+                    break;
+            }
+        }
+
+        if (stack_idx == 0)
+            break;
+        --stack_idx;
+        node_idx = stack[stack_idx].node_idx;
+        mask = stack[stack_idx].mask;
+    }
+
+    if (!shadowRay) {
+        for (int i = 0; i < N; ++i) {
+            if (hits & (1 << i))
+                finalizeIntersection(f[i], rays[i].time, its[i]);
+        }
+    }
+
+    return hits;
 }
 
+NORI_REGISTER_CLASS(BVHAccel, "bvh");
 NORI_NAMESPACE_END
\ No newline at end of file
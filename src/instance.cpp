@@ -0,0 +1,45 @@
+#include <nori/instance.h>
+
+NORI_NAMESPACE_BEGIN
+
+Instance::Instance(const PropertyList &propList) {
+    m_toWorld = propList.getTransform("toWorld", Transform());
+}
+
+void Instance::addChild(NoriObject *obj) {
+    switch (obj->getClassType()) {
+        case EMesh:
+            if (m_mesh)
+                throw NoriException("Instance: tried to register multiple meshes!");
+            m_mesh = static_cast<Mesh *>(obj);
+            break;
+
+        default:
+            throw NoriException("Instance::addChild(<%s>) is not supported!",
+                                classTypeName(obj->getClassType()));
+    }
+}
+
+void Instance::activate() {
+    if (!m_mesh)
+        throw NoriException("Instance: no mesh was specified!");
+
+    /* Emitters sample positions on their mesh, which are not transformed */
+    if (m_mesh->isEmitter())
+        throw NoriException("Instance: the emitting mesh \"%s\" cannot be instanced!",
+                            m_mesh->getName());
+}
+
+std::string Instance::toString() const {
+    return tfm::format(
+        "Instance[\n"
+        "  mesh = \"%s\",\n"
+        "  toWorld = %s\n"
+        "]",
+        m_mesh ? m_mesh->getName() : std::string("null"),
+        indent(m_toWorld.toString(), 12)
+    );
+}
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
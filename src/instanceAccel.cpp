@@ -0,0 +1,331 @@
+#include <nori/instanceAccel.h>
+#include <nori/timer.h>
+#include <algorithm>
+
+NORI_NAMESPACE_BEGIN
+
+/// Number of SAH bins used by the top-level build
+static const int TOP_LEVEL_BINS = 16;
+
+/// Maximum depth of the top-level BVH (bounds the traversal stack)
+static const int TOP_LEVEL_MAX_DEPTH = 48;
+
+/// Maximum number of instances in a top-level leaf
+static const uint32_t MAX_LEAF_SIZE = 8;
+
+InstanceAccel::~InstanceAccel() {
+    delete m_base;
+    for (auto blas : m_blas)
+        delete blas;
+}
+
+void InstanceAccel::addMesh(Mesh *mesh) {
+    m_base->addMesh(mesh);
+}
+
+uint32_t InstanceAccel::addInstance(Mesh *mesh, const Transform &toWorld) {
+    auto it = m_blasIndex.find(mesh);
+    if (it == m_blasIndex.end()) {
+        /* First instance of this mesh: create its bottom-level hierarchy */
+        BVHAccel *blas = new BVHAccel();
+        blas->setTraversalOrder(m_base->getTraversalOrder());
+        blas->setBuilder(m_base->getBuilder());
+        blas->setBinCount(m_base->getBinCount());
+        blas->setSerialThreshold(m_base->getSerialThreshold());
+        blas->setSpatialSplits(m_base->getSpatialSplits());
+        blas->setDuplicationBudget(m_base->getDuplicationBudget());
+        blas->setOptimizationPasses(m_base->getOptimizationPasses());
+        blas->setOptimizationTime(m_base->getOptimizationTime());
+        blas->setCacheDirectory(m_base->getCacheDirectory());
+        blas->setQuantizationBits(m_base->getQuantizationBits());
+        blas->addMesh(mesh);
+        it = m_blasIndex.insert({ mesh, (uint32_t) m_blas.size() }).first;
+        m_blas.push_back(blas);
+    }
+
+    m_instances.emplace_back();
+    m_instances.back().blas = it->second;
+    setTransform((uint32_t) m_instances.size() - 1, toWorld);
+    return (uint32_t) m_instances.size() - 1;
+}
+
+void InstanceAccel::setTransform(uint32_t index, const Transform &toWorld) {
+    InstanceRecord &instance = m_instances[index];
+    instance.toWorld = toWorld;
+    instance.toObject = toWorld.inverse();
+    instance.flip = toWorld.getMatrix().topLeftCorner<3, 3>().determinant() < 0;
+
+    const BoundingBox3f &bbox = m_blas[instance.blas]->Accel::getBoundingBox();
+    instance.bbox.reset();
+    for (int i = 0; i < 8; ++i)
+        instance.bbox.expandBy(toWorld * bbox.getCorner(i));
+}
+
+void InstanceAccel::build() {
+    if (!m_baseBuilt) {
+        for (uint32_t i = 0; i < m_base->getMeshCount(); ++i) {
+            if (m_blasIndex.find(m_base->getMesh(i)) != m_blasIndex.end())
+                throw NoriException("InstanceAccel: the mesh \"%s\" is both instanced "
+                    "and placed directly!", m_base->getMesh(i)->getName());
+        }
+        m_base->build();
+        m_baseBuilt = true;
+    }
+
+    /* Bottom-level hierarchies are only built for newly added meshes */
+    for (; m_blasBuilt < m_blas.size(); ++m_blasBuilt)
+        m_blas[m_blasBuilt]->build();
+
+    m_bbox = m_base->Accel::getBoundingBox();
+    m_nodes.clear();
+    m_order.resize(m_instances.size());
+    if (m_instances.empty())
+        return;
+
+    cout << "Constructing the top-level BVH (" << m_instances.size()
+        << " instances of " << m_blas.size() << (m_blas.size() == 1 ? " mesh) .. " : " meshes) .. ");
+    cout.flush();
+    Timer timer;
+
+    for (uint32_t i = 0; i < (uint32_t) m_order.size(); ++i) {
+        m_order[i] = i;
+        m_bbox.expandBy(m_instances[i].bbox);
+    }
+    m_nodes.reserve(2 * m_instances.size());
+    buildTopLevel(0u, (uint32_t) m_order.size(), 0);
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(Node) * m_nodes.size() + sizeof(InstanceRecord) * m_instances.size())
+        << ", " << m_nodes.size() << " nodes)." << endl;
+}
+
+void InstanceAccel::buildTopLevel(uint32_t start, uint32_t end, int depth) {
+    uint32_t node_idx = (uint32_t) m_nodes.size();
+    m_nodes.emplace_back();
+
+    BoundingBox3f bbox, centroids;
+    for (uint32_t i = start; i < end; ++i) {
+        const BoundingBox3f &instanceBox = m_instances[m_order[i]].bbox;
+        bbox.expandBy(instanceBox);
+        centroids.expandBy(instanceBox.getCenter());
+    }
+    m_nodes[node_idx].bbox = bbox;
+
+    /* Binned SAH split over the instance centroids */
+    uint32_t count = end - start;
+    float bestCost = (float) count;
+    int bestAxis = -1, bestBin = 0;
+    if (count > 2 && depth < TOP_LEVEL_MAX_DEPTH) {
+        for (int axis = 0; axis < 3; ++axis) {
+            float extent = centroids.max[axis] - centroids.min[axis];
+            if (extent <= 0)
+                continue;
+            BoundingBox3f binBox[TOP_LEVEL_BINS];
+            uint32_t binCount[TOP_LEVEL_BINS] = { 0 };
+            for (uint32_t i = start; i < end; ++i) {
+                const BoundingBox3f &instanceBox = m_instances[m_order[i]].bbox;
+                int bin = std::min((int) ((instanceBox.getCenter()[axis] - centroids.min[axis])
+                    / extent * TOP_LEVEL_BINS), TOP_LEVEL_BINS - 1);
+                binBox[bin].expandBy(instanceBox);
+                binCount[bin]++;
+            }
+
+            /* Sweep from the right, then evaluate all splits from the left */
+            float rightArea[TOP_LEVEL_BINS];
+            BoundingBox3f right;
+            for (int i = TOP_LEVEL_BINS - 1; i > 0; --i) {
+                right.expandBy(binBox[i]);
+                rightArea[i] = right.isValid() ? right.getSurfaceArea() : 0.0f;
+            }
+            BoundingBox3f left;
+            uint32_t leftCount = 0;
+            for (int i = 0; i < TOP_LEVEL_BINS - 1; ++i) {
+                left.expandBy(binBox[i]);
+                leftCount += binCount[i];
+                if (leftCount == 0 || leftCount == count)
+                    continue;
+                float cost = 0.5f + (left.getSurfaceArea() * leftCount
+                    + rightArea[i + 1] * (count - leftCount)) / bbox.getSurfaceArea();
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = i;
+                }
+            }
+        }
+    }
+
+    if (bestAxis == -1 && (count <= MAX_LEAF_SIZE || depth >= TOP_LEVEL_MAX_DEPTH)) {
+        m_nodes[node_idx].start = start;
+        m_nodes[node_idx].count = (uint16_t) count;
+        m_nodes[node_idx].axis = 0;
+        return;
+    }
+
+    uint32_t mid;
+    if (bestAxis == -1) {
+        /* No split beats a leaf, but the leaf is too large: split at the median */
+        bestAxis = centroids.getLargestAxis();
+        mid = (start + end) / 2;
+        std::nth_element(m_order.begin() + start, m_order.begin() + mid, m_order.begin() + end,
+            [&](uint32_t a, uint32_t b) {
+                return m_instances[a].bbox.getCenter()[bestAxis] < m_instances[b].bbox.getCenter()[bestAxis];
+            });
+    }
+    else {
+        float extent = centroids.max[bestAxis] - centroids.min[bestAxis];
+        mid = (uint32_t) (std::partition(m_order.begin() + start, m_order.begin() + end,
+            [&](uint32_t i) {
+                int bin = std::min((int) ((m_instances[i].bbox.getCenter()[bestAxis] - centroids.min[bestAxis])
+                    / extent * TOP_LEVEL_BINS), TOP_LEVEL_BINS - 1);
+                return bin <= bestBin;
+            }) - m_order.begin());
+    }
+
+    buildTopLevel(start, mid, depth + 1);
+    m_nodes[node_idx].start = (uint32_t) m_nodes.size();
+    m_nodes[node_idx].count = 0;
+    m_nodes[node_idx].axis = (uint16_t) bestAxis;
+    buildTopLevel(mid, end, depth + 1);
+}
+
+size_t InstanceAccel::getMemoryUsage() const {
+    size_t size = m_base->getMemoryUsage() + sizeof(Node) * m_nodes.size()
+        + sizeof(InstanceRecord) * m_instances.size() + sizeof(uint32_t) * m_order.size();
+    for (auto blas : m_blas)
+        size += blas->getMemoryUsage();
+    return size;
+}
+
+std::string InstanceAccel::toString() const {
+    return tfm::format(
+        "InstanceAccel[\n"
+        "  instances = %i,\n"
+        "  meshes = %i,\n"
+        "  base = %s\n"
+        "]",
+        m_instances.size(),
+        m_blas.size(),
+        indent(m_base->toString())
+    );
+}
+
+void InstanceAccel::toWorld(const InstanceRecord &instance, Intersection &its) const {
+    its.p = instance.toWorld * its.p;
+
+    /* Normals transform with the inverse transpose. A reflection reverses the
+       winding of the transformed triangles, and thus their geometric normal. */
+    Normal3f n = (instance.toWorld * Normal3f(its.geoFrame.n)).normalized();
+    its.geoFrame = Frame(instance.flip ? Vector3f(-n) : Vector3f(n));
+
+    if (its.mesh->hasVertexNormals())
+        its.shFrame = Frame((instance.toWorld * Normal3f(its.shFrame.n)).normalized());
+    else
+        its.shFrame = its.geoFrame;
+}
+
+bool InstanceAccel::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
+    /* Use an adaptive ray epsilon, chosen in world space for all instances */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    bool foundIntersection = false;
+
+    if (m_base->getTriangleCount() > 0 && m_base->rayIntersect(ray, its, shadowRay)) {
+        if (shadowRay)
+            return true;
+        foundIntersection = true;
+        ray.maxt = its.t;
+    }
+
+    if (m_nodes.empty())
+        return foundIntersection;
+
+    uint32_t stack[TOP_LEVEL_MAX_DEPTH + 1], stack_idx = 0;
+    NodeVisitCounter visits;
+    const InstanceRecord *hitInstance = nullptr;
+    bool dirIsNeg[3] = { ray.dRcp.x() < 0, ray.dRcp.y() < 0, ray.dRcp.z() < 0 };
+    Intersection local;
+
+    stack[stack_idx++] = 0u;
+    while (stack_idx > 0) {
+        const Node &node = m_nodes[stack[--stack_idx]];
+        visits++;
+        float nearT, farT;
+        if (!node.bbox.rayIntersect(ray, nearT, farT) || nearT > ray.maxt || farT < ray.mint)
+            continue;
+
+        if (node.count == 0) {
+            /* Visit the child on the side the ray comes from first */
+            uint32_t left = (uint32_t) (&node - m_nodes.data()) + 1;
+            if (dirIsNeg[node.axis]) {
+                stack[stack_idx++] = left;
+                stack[stack_idx++] = node.start;
+            }
+            else {
+                stack[stack_idx++] = node.start;
+                stack[stack_idx++] = left;
+            }
+            continue;
+        }
+
+        for (uint32_t i = node.start; i < node.start + node.count; ++i) {
+            const InstanceRecord &instance = m_instances[m_order[i]];
+
+            /* The ray parameterization is unchanged by the (affine) transformation */
+            Ray3f localRay = instance.toObject * ray;
+            if (m_blas[instance.blas]->rayIntersect(localRay, local, shadowRay)) {
+                if (shadowRay)
+                    return true;
+                its = local;
+                ray.maxt = local.t;
+                hitInstance = &instance;
+                foundIntersection = true;
+            }
+        }
+    }
+
+    if (hitInstance)
+        toWorld(*hitInstance, its);
+
+    return foundIntersection;
+}
+
+bool InstanceAccel::occluded(const Ray3f &_ray) const {
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (m_base->getTriangleCount() > 0 && m_base->occluded(ray))
+        return true;
+
+    if (m_nodes.empty())
+        return false;
+
+    uint32_t stack[TOP_LEVEL_MAX_DEPTH + 1], stack_idx = 0;
+    NodeVisitCounter visits;
+    stack[stack_idx++] = 0u;
+    while (stack_idx > 0) {
+        const Node &node = m_nodes[stack[--stack_idx]];
+        visits++;
+        if (!node.bbox.rayIntersect(ray))
+            continue;
+
+        if (node.count == 0) {
+            stack[stack_idx++] = node.start;
+            stack[stack_idx++] = (uint32_t) (&node - m_nodes.data()) + 1;
+            continue;
+        }
+
+        for (uint32_t i = node.start; i < node.start + node.count; ++i) {
+            const InstanceRecord &instance = m_instances[m_order[i]];
+            if (m_blas[instance.blas]->occluded(instance.toObject * ray))
+                return true;
+        }
+    }
+
+    return false;
+}
+
+NORI_NAMESPACE_END
@@ -25,16 +25,27 @@
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
+#include <nori/warp.h>
+#include <nori/instance.h>
+#include <nori/instanceAccel.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 #include <tbb/task_scheduler_init.h>
 #include <filesystem/resolver.h>
+#include <pcg32.h>
 #include <thread>
 
 using namespace nori;
 
 static int threadCount = -1;
 static bool gui = true;
+static bool benchAccel = false;
+
+/// Number of rays of each kind that are traced by \c --bench-accel
+static const int BENCH_RAY_COUNT = 1 << 18;
+
+/// The brute force accelerator is only benchmarked on smaller scenes
+static const uint32_t BENCH_BRUTE_FORCE_LIMIT = 10000;
 
 static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
     const Camera *camera = scene->getCamera();
@@ -57,6 +68,10 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
                 Ray3f ray;
                 Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
 
+                /* Sample a time within the shutter interval (motion blur) */
+                if (scene->isMoving())
+                    ray.time = sampler->next1D();
+
                 /* Compute the incident radiance */
                 value *= integrator->Li(scene, sampler, ray);
 
@@ -161,9 +176,119 @@ static void render(Scene *scene, const std::string &filename) {
     bitmap->savePNG(outputName);
 }
 
+/// Trace a set of rays and print the throughput and average number of visited nodes
+static void benchRays(const Accel *accel, const char *name,
+                      const std::vector<Ray3f> &rays, bool shadowRay) {
+    Intersection its;
+    size_t hits = 0;
+    Accel::resetNodeVisits();
+    Timer timer;
+    for (const Ray3f &ray : rays) {
+        if (shadowRay ? accel->occluded(ray) : accel->rayIntersect(ray, its, false))
+            hits++;
+    }
+    double elapsed = timer.elapsed();
+
+    cout << tfm::format("  %-7s %7i rays, %7i hits, %7.2f Mrays/s",
+        name, rays.size(), hits, rays.size() / (1000.0 * std::max(elapsed, 1e-3)));
+#if defined(NORI_ACCEL_STATS)
+    cout << tfm::format(", %6.1f nodes/ray",
+        (double) Accel::getNodeVisits() / std::max(rays.size(), (size_t) 1));
+#endif
+    cout << endl;
+}
+
+/**
+ * \brief Build all acceleration data structures over the geometry of a
+ * scene and compare them using the same (seeded) camera, shadow and
+ * random rays. The rays are traced on a single thread.
+ *
+ * The number of visited nodes per ray is only reported when Nori is
+ * compiled with \c NORI_ACCEL_STATS (CMake option of the same name).
+ */
+static void benchmark(const Scene *scene) {
+    const Camera *camera = scene->getCamera();
+    Vector2i outputSize = camera->getOutputSize();
+    const BoundingBox3f &bbox = scene->getBoundingBox();
+    pcg32 random;
+
+    auto pointInBox = [&]() {
+        return Point3f(bbox.min + (bbox.max - bbox.min).cwiseProduct(
+            Vector3f(random.nextFloat(), random.nextFloat(), random.nextFloat())));
+    };
+
+    std::vector<Ray3f> cameraRays, shadowRays, randomRays;
+    for (int i = 0; i < BENCH_RAY_COUNT; ++i) {
+        Ray3f ray;
+        Point2f pixelSample(random.nextFloat() * outputSize.x(), random.nextFloat() * outputSize.y());
+        camera->sampleRay(ray, pixelSample, Point2f(random.nextFloat(), random.nextFloat()));
+        cameraRays.push_back(ray);
+
+        /* Connect the visible surfaces to random points within the scene */
+        Intersection its;
+        if (scene->rayIntersect(ray, its)) {
+            Vector3f d = pointInBox() - its.p;
+            float dist = d.norm();
+            if (dist > Epsilon)
+                shadowRays.push_back(Ray3f(its.p, d / dist, Epsilon, dist * (1 - 1e-4f)));
+        }
+
+        randomRays.push_back(Ray3f(pointInBox(),
+            Warp::squareToUniformSphere(Point2f(random.nextFloat(), random.nextFloat()))));
+    }
+
+    uint32_t triangleCount = 0;
+    for (auto mesh : scene->getMeshes())
+        triangleCount += mesh->getTriangleCount();
+    for (auto instance : scene->getInstances())
+        triangleCount += instance->getMesh()->getTriangleCount();
+
+    const char *types[] = { "bruteforce", "bvh", "qbvh", "obvh", "octree" };
+    for (const char *type : types) {
+        cout << endl << "Benchmarking the \"" << type << "\" accelerator .." << endl;
+        if (std::string(type) == "bruteforce" && triangleCount > BENCH_BRUTE_FORCE_LIMIT) {
+            cout << "  skipped (more than " << BENCH_BRUTE_FORCE_LIMIT << " triangles)" << endl;
+            continue;
+        }
+
+        std::unique_ptr<Accel> accel;
+        try {
+            accel.reset(static_cast<Accel *>(
+                NoriObjectFactory::createInstance(type, PropertyList())));
+
+            if (!scene->getInstances().empty()) {
+                if (!dynamic_cast<BVHAccel *>(accel.get())) {
+                    cout << "  skipped (the scene contains instances)" << endl;
+                    continue;
+                }
+                InstanceAccel *instanceAccel =
+                    new InstanceAccel(static_cast<BVHAccel *>(accel.release()));
+                accel.reset(instanceAccel);
+                for (auto instance : scene->getInstances())
+                    instanceAccel->addInstance(instance->getMesh(), instance->getTransform());
+            }
+
+            for (auto mesh : scene->getMeshes())
+                accel->addMesh(mesh);
+        } catch (const std::exception &e) {
+            cout << "  skipped (" << e.what() << ")" << endl;
+            continue;
+        }
+
+        Timer timer;
+        accel->build();
+        cout << "  build   " << timer.elapsedString(true) << ", "
+             << memString(accel->getMemoryUsage()) << endl;
+
+        benchRays(accel.get(), "camera", cameraRays, false);
+        benchRays(accel.get(), "shadow", shadowRays, true);
+        benchRays(accel.get(), "random", randomRays, false);
+    }
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml> [--no-gui] [--threads N]" <<  endl;
+        cerr << "Syntax: " << argv[0] << " <scene.xml> [--no-gui] [--threads N] [--bench-accel]" <<  endl;
         return -1;
     }
 
@@ -190,6 +315,10 @@ int main(int argc, char **argv) {
             gui = false;
             continue;
         }
+        else if (token == "--bench-accel") {
+            benchAccel = true;
+            continue;
+        }
 
         filesystem::path path(argv[i]);
 
@@ -248,8 +377,12 @@ int main(int argc, char **argv) {
         try {
             std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
             /* When the XML root object is a scene, start rendering it .. */
-            if (root->getClassType() == NoriObject::EScene)
-                render(static_cast<Scene *>(root.get()), sceneName);
+            if (root->getClassType() == NoriObject::EScene) {
+                if (benchAccel)
+                    benchmark(static_cast<Scene *>(root.get()));
+                else
+                    render(static_cast<Scene *>(root.get()), sceneName);
+            }
         } catch (const std::exception &e) {
             cerr << e.what() << endl;
             return -1;
@@ -22,6 +22,7 @@
 #include <nori/emitter.h>
 #include <nori/warp.h>
 #include <Eigen/Geometry>
+#include <tbb/tbb.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -52,6 +53,27 @@ void Mesh::activate() {
     isActivate = true;
 }
 
+void Mesh::setVertexPositions(const MatrixXf &V) {
+    if (V.rows() != 3 || V.cols() != m_V.cols())
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertices, got %i!",
+                            (int) m_V.cols(), (int) V.cols());
+    m_VData = V;
+    setView(m_V, m_VData);
+
+    m_bbox.reset();
+    for (uint32_t k = 0; k < getKeyframeCount(); ++k)
+        for (uint32_t i = 0; i < getVertexCount(); ++i)
+            m_bbox.expandBy(getKeyframe(k).col(i));
+
+    if (m_emitter && isActivate) {
+        m_dpdf.clear();
+        m_dpdf.reserve(getTriangleCount());
+        for (uint32_t i = 0; i < getTriangleCount(); ++i)
+            m_dpdf.append(surfaceArea(i));
+        m_dpdf.normalize();
+    }
+}
+
 float Mesh::surfaceArea(uint32_t index) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
 
@@ -70,9 +92,14 @@ void Mesh::getTriangleIdx(int index, uint32_t& i0, uint32_t& i1, uint32_t& i2) c
     i0 = m_F(0, index); i1 = m_F(1, index); i2 = m_F(2, index);
 }
 
-bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
-    uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, const TriangleRay &tray,
+                        float &u, float &v, float &t) const {
+    Point3f p0, p1, p2;
+    getTriangle(index, ray.time, p0, p1, p2);
+
+#if defined(NORI_WATERTIGHT)
+    return rayIntersectWatertight(tray, p0, p1, p2, ray.mint, ray.maxt, u, v, t);
+#else
 
     /* Find vectors for two edges sharing v[0] */
     Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
@@ -107,16 +134,29 @@ bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, fl
     t = edge2.dot(qvec) * inv_det;
 
     return t >= ray.mint && t <= ray.maxt;
+#endif
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    BoundingBox3f result = getBoundingBox(index, 0);
+    for (uint32_t k = 1; k < getKeyframeCount(); ++k)
+        result.expandBy(getBoundingBox(index, k));
+    return result;
+}
+
+BoundingBox3f Mesh::getBoundingBox(uint32_t index, uint32_t keyframe) const {
+    MatrixXfView V = getKeyframe(keyframe);
+    BoundingBox3f result(V.col(m_F(0, index)));
+    result.expandBy(V.col(m_F(1, index)));
+    result.expandBy(V.col(m_F(2, index)));
     return result;
 }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
+    /* Moving triangles are placed according to the volume they sweep */
+    if (isMoving())
+        return getBoundingBox(index).getCenter();
+
     return (1.0f / 3.0f) *
         (m_V.col(m_F(0, index)) +
          m_V.col(m_F(1, index)) +
@@ -156,9 +196,9 @@ Color3f Mesh::sample(EmitterQueryRecord& rec, Sampler* sampler) const
     rec.pdf = 1 / rec.invpdf;
 
     // solve normal, if exist barycentric, if not exist counterclockwise
-    if(m_N.cols() > 0)
+    if(hasVertexNormals())
 	{
-        Point3f n0 = m_N.col(i0), n1 = m_N.col(i1), n2 = m_N.col(i2);
+        Point3f n0 = getVertexNormal(i0), n1 = getVertexNormal(i1), n2 = getVertexNormal(i2);
 		rec.n = alpha * n0 + beta * n1 + gamma * n2;
 	}
 	else
@@ -194,18 +234,63 @@ void Mesh::addChild(NoriObject *obj) {
     }
 }
 
+void Mesh::compressAttributes() {
+    uint32_t vertexCount = getVertexCount();
+    bool normals = m_N.size() > 0 && m_keyframeNormals.empty(), texcoords = m_UV.size() > 0;
+    if (normals)
+        m_Nq.resize(1, vertexCount);
+    if (texcoords)
+        m_UVq.resize(2, vertexCount);
+
+    tbb::parallel_for(
+        tbb::blocked_range<uint32_t>(0u, vertexCount, 1 << 16),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                if (normals)
+                    m_Nq(i) = encodeOctahedral(Vector3f(m_N.col(i)).normalized());
+                if (texcoords) {
+                    m_UVq(0, i) = floatToHalf(m_UV(0, i));
+                    m_UVq(1, i) = floatToHalf(m_UV(1, i));
+                }
+            }
+        }
+    );
+
+    if (normals) {
+        MatrixXf().swap(m_NData);
+        setView(m_N, m_NData);
+    }
+    if (texcoords) {
+        MatrixXf().swap(m_UVData);
+        setView(m_UV, m_UVData);
+    }
+}
+
+size_t Mesh::getMemoryUsage() const {
+    size_t result = sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()) +
+                    sizeof(uint32_t) * (m_F.size() + m_Nq.size()) +
+                    sizeof(uint16_t) * m_UVq.size();
+    for (const MatrixXf &V : m_keyframes)
+        result += sizeof(float) * V.size();
+    for (const MatrixXf &N : m_keyframeNormals)
+        result += sizeof(float) * N.size();
+    return result;
+}
+
 std::string Mesh::toString() const {
     return tfm::format(
         "Mesh[\n"
         "  name = \"%s\",\n"
         "  vertexCount = %i,\n"
         "  triangleCount = %i,\n"
+        "  keyframeCount = %i,\n"
         "  bsdf = %s,\n"
         "  emitter = %s\n"
         "]",
         m_name,
         m_V.cols(),
         m_F.cols(),
+        getKeyframeCount(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null")
     );
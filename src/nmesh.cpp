@@ -0,0 +1,166 @@
+#include <nori/nmesh.h>
+#include <nori/hash.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <fstream>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+static const char NMESH_MAGIC[4] = { 'N', 'M', 'S', 'H' };
+
+size_t NMeshHeader::layout(size_t offsets[4]) const {
+    size_t sizes[4] = {
+        sizeof(float) * 3 * vertexCount,
+        (flags & EHasNormals) ? sizeof(float) * 3 * vertexCount : 0,
+        (flags & EHasTexCoords) ? sizeof(float) * 2 * vertexCount : 0,
+        sizeof(uint32_t) * 3 * triangleCount
+    };
+
+    size_t offset = sizeof(NMeshHeader);
+    for (int i = 0; i < 4; ++i) {
+        offset = (offset + NMESH_ALIGNMENT - 1) / NMESH_ALIGNMENT * NMESH_ALIGNMENT;
+        offsets[i] = offset;
+        offset += sizes[i];
+    }
+    return offset;
+}
+
+void writeNMesh(const std::string &filename, const Mesh &mesh) {
+    if (mesh.isMoving() || mesh.hasCompressedAttributes())
+        throw NoriException("writeNMesh(): moving meshes and compressed "
+                            "attributes are not supported!");
+
+    const MatrixXfView &V = mesh.getVertexPositions(), &N = mesh.getVertexNormals(),
+                       &UV = mesh.getVertexTexCoords();
+    const MatrixXuView &F = mesh.getIndices();
+
+    NMeshHeader header;
+    memset(&header, 0, sizeof(NMeshHeader));
+    memcpy(header.magic, NMESH_MAGIC, sizeof(NMESH_MAGIC));
+    header.version = NMeshHeader::NMESH_VERSION;
+    header.vertexCount = mesh.getVertexCount();
+    header.triangleCount = mesh.getTriangleCount();
+    header.flags = (N.size() > 0 ? NMeshHeader::EHasNormals : 0) |
+                   (UV.size() > 0 ? NMeshHeader::EHasTexCoords : 0);
+
+    /* Assemble the arrays with their padding, which is covered by the checksum */
+    size_t offsets[4];
+    size_t fileSize = header.layout(offsets);
+    std::vector<char> data(fileSize - sizeof(NMeshHeader), 0);
+    const size_t skip = sizeof(NMeshHeader);
+    memcpy(data.data() + offsets[0] - skip, V.data(), sizeof(float) * V.size());
+    memcpy(data.data() + offsets[1] - skip, N.data(), sizeof(float) * N.size());
+    memcpy(data.data() + offsets[2] - skip, UV.data(), sizeof(float) * UV.size());
+    memcpy(data.data() + offsets[3] - skip, F.data(), sizeof(uint32_t) * F.size());
+
+    FNVHash hash;
+    hash.add(data.data(), data.size());
+    header.checksum = hash.get();
+
+    std::ofstream os(filename, std::ios::binary);
+    os.write((const char *) &header, sizeof(NMeshHeader));
+    os.write(data.data(), (std::streamsize) data.size());
+    if (!os)
+        throw NoriException("Unable to write binary mesh file \"%s\"!", filename);
+}
+
+/**
+ * \brief Loader for binary meshes created by the \c obj2nmesh tool
+ *
+ * The file is memory-mapped and its checksum is verified. Since the file
+ * stores every array in the layout of the corresponding mesh matrix, the
+ * mesh data are views into the mapping, which the mesh keeps alive: nothing
+ * is copied, and the pages are shared with every other process (or mesh)
+ * that maps the same file. Only the data that an optional \c toWorld
+ * transformation modifies are copied, and \c compressAttributes stores
+ * the normals and texture coordinates compressed instead (see \ref
+ * Mesh::compressAttributes()).
+ */
+class BinaryMesh : public Mesh {
+public:
+    BinaryMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        Transform trafo = propList.getTransform("toWorld", Transform());
+
+        cout << "Loading \"" << filename << "\" .. ";
+        cout.flush();
+        Timer timer;
+
+        try {
+            m_file.reset(new MemoryMappedFile(filename.str()));
+        } catch (const NoriException &) {
+            throw NoriException("Unable to open binary mesh file \"%s\"!", filename);
+        }
+
+        const char *data = (const char *) m_file->data();
+        NMeshHeader header;
+        if (m_file->size() < sizeof(NMeshHeader))
+            throw NoriException("\"%s\" is not a binary mesh file!", filename);
+        memcpy(&header, data, sizeof(NMeshHeader));
+        if (memcmp(header.magic, NMESH_MAGIC, sizeof(NMESH_MAGIC)) != 0)
+            throw NoriException("\"%s\" is not a binary mesh file!", filename);
+        if (header.version != NMeshHeader::NMESH_VERSION)
+            throw NoriException("Binary mesh file \"%s\" has version %i (expected %i)!",
+                                filename, header.version, (int) NMeshHeader::NMESH_VERSION);
+
+        size_t offsets[4];
+        if (header.layout(offsets) != m_file->size())
+            throw NoriException("Binary mesh file \"%s\" is truncated!", filename);
+
+        FNVHash hash;
+        hash.add(data + sizeof(NMeshHeader), m_file->size() - sizeof(NMeshHeader));
+        if (hash.get() != header.checksum)
+            throw NoriException("Binary mesh file \"%s\" is corrupted (checksum mismatch)!",
+                                filename);
+
+        uint32_t vertexCount = header.vertexCount;
+        bool normals = header.flags & NMeshHeader::EHasNormals,
+             texcoords = header.flags & NMeshHeader::EHasTexCoords;
+        setView(m_V, (const float *) (data + offsets[0]), 3, vertexCount);
+        setView(m_N, (const float *) (data + offsets[1]), 3, normals ? vertexCount : 0);
+        setView(m_UV, (const float *) (data + offsets[2]), 2, texcoords ? vertexCount : 0);
+        setView(m_F, (const uint32_t *) (data + offsets[3]), 3, header.triangleCount);
+
+        for (Eigen::Index i = 0; i < m_F.size(); ++i) {
+            if (m_F.data()[i] >= vertexCount)
+                throw NoriException("Binary mesh file \"%s\" contains an invalid "
+                                    "vertex index!", filename);
+        }
+
+        if (!trafo.getMatrix().isIdentity()) {
+            /* The mapping is read-only: transform private copies */
+            m_VData = m_V;
+            m_NData = m_N;
+            for (uint32_t i = 0; i < vertexCount; ++i) {
+                m_VData.col(i) = trafo * Point3f(m_VData.col(i));
+                if (normals)
+                    m_NData.col(i) = (trafo * Normal3f(m_NData.col(i))).normalized();
+            }
+            setView(m_V, m_VData);
+            setView(m_N, m_NData);
+        }
+
+        for (uint32_t i = 0; i < vertexCount; ++i)
+            m_bbox.expandBy(m_V.col(i));
+
+        if (propList.getBoolean("compressAttributes", false))
+            compressAttributes();
+
+        double elapsed = timer.elapsed();
+        m_name = filename.str();
+        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+             << timeString(elapsed) << " at "
+             << tfm::format("%.1f", m_file->size() / (1000.0 * std::max(elapsed, 1e-3)))
+             << " MB/s and "
+             << memString(getMemoryUsage()) << ")" << endl;
+    }
+
+protected:
+    std::unique_ptr<MemoryMappedFile> m_file; ///< Mapped file referenced by the mesh data
+};
+
+NORI_REGISTER_CLASS(BinaryMesh, "nmesh");
+NORI_NAMESPACE_END
@@ -17,121 +17,156 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <tbb/tbb.h>
+#include <functional>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is memory-mapped and parsed in place, without copying lines or
+ * allocating memory per token. Chunks of the file are parsed in parallel
+ * and concatenated afterwards, and the face corners are deduplicated in
+ * parallel over partitions of their hash values. Small files, and loads
+ * without more than one thread, use a single sequential pass instead.
+ *
+ * Moving meshes list further OBJ files in the \c keyframes property
+ * (separated by commas). These must contain the same vertex positions
+ * (and normals) in the same order, at evenly spaced times of the shutter
+ * interval; their faces are ignored.
+ *
+ * Setting \c compressAttributes stores the normals and texture coordinates
+ * in a compressed form (see \ref Mesh::compressAttributes()).
  */
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
-
-        std::ifstream is(filename.str());
-        if (is.fail())
-            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
         Transform trafo = propList.getTransform("toWorld", Transform());
 
         cout << "Loading \"" << filename << "\" .. ";
         cout.flush();
         Timer timer;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
+        OBJBuffers buffers;
+        size_t fileSize = parseFile(filename, trafo, buffers);
+
+        const std::vector<Vector3f> &positions = buffers.positions;
+        const std::vector<Vector2f> &texcoords = buffers.texcoords;
+        const std::vector<Vector3f> &normals = buffers.normals;
         std::vector<uint32_t>   indices;
         std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
-
-            std::string prefix;
-            line >> prefix;
-
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
-                }
+
+        m_bbox = tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, positions.size(), GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<size_t> &range, BoundingBox3f result) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    result.expandBy(positions[i]);
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
             }
-        }
+        );
 
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+        /* Convert to an indexed vertex list */
+        deduplicate(buffers.corners, indices, vertices);
+        std::vector<OBJVertex>().swap(buffers.corners);
 
-        m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
+        m_FData.resize(3, indices.size()/3);
+        memcpy(m_FData.data(), indices.data(), sizeof(uint32_t)*indices.size());
 
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
-        }
+        m_VData.resize(3, vertices.size());
+        if (!normals.empty())
+            m_NData.resize(3, vertices.size());
+        if (!texcoords.empty())
+            m_UVData.resize(2, vertices.size());
+
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, (uint32_t) vertices.size(), GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    m_VData.col(i) = positions.at(vertices[i].p-1);
+                    if (!normals.empty())
+                        m_NData.col(i) = normals.at(vertices[i].n-1);
+                    if (!texcoords.empty())
+                        m_UVData.col(i) = texcoords.at(vertices[i].uv-1);
+                }
+            }
+        );
+        setView(m_V, m_VData);
+        setView(m_N, m_NData);
+        setView(m_UV, m_UVData);
+        setView(m_F, m_FData);
+
+        std::vector<std::string> keyframes = tokenize(propList.getString("keyframes", ""));
+        for (const std::string &name : keyframes) {
+            if (name.empty())
+                continue;
+            filesystem::path keyframeFilename = getFileResolver()->resolve(name);
+            OBJBuffers keyframe;
+            fileSize += parseFile(keyframeFilename, trafo, keyframe, false);
+            if (keyframe.positions.size() != positions.size() ||
+                (!keyframe.normals.empty() && keyframe.normals.size() != normals.size()))
+                throw NoriException("The vertex data of keyframe \"%s\" does not match \"%s\"!",
+                                    keyframeFilename, filename);
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
+            bool keyframeNormals = !keyframe.normals.empty() && !normals.empty();
+            MatrixXf V(3, vertices.size()), N(3, keyframeNormals ? vertices.size() : 0);
+            tbb::parallel_for(
+                tbb::blocked_range<uint32_t>(0u, (uint32_t) vertices.size(), GRAIN_SIZE),
+                [&](const tbb::blocked_range<uint32_t> &range) {
+                    for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                        V.col(i) = keyframe.positions[vertices[i].p-1];
+                        if (keyframeNormals)
+                            N.col(i) = keyframe.normals[vertices[i].n-1];
+                    }
+                }
+            );
             for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
+                m_bbox.expandBy(V.col(i));
+            m_keyframes.push_back(std::move(V));
+            if (keyframeNormals)
+                m_keyframeNormals.push_back(std::move(N));
         }
 
+        /* Interpolate the normals only if every keyframe has them */
+        if (m_keyframeNormals.size() != m_keyframes.size())
+            m_keyframeNormals.clear();
+
+        if (propList.getBoolean("compressAttributes", false))
+            compressAttributes();
+
+        double elapsed = timer.elapsed();
         m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
+        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols();
+        if (!m_keyframes.empty())
+            cout << ", " << getKeyframeCount() << " keyframes";
+        cout << ", took " << timeString(elapsed) << " at "
+             << tfm::format("%.1f", fileSize / (1000.0 * std::max(elapsed, 1e-3)))
+             << " MB/s and "
+             << memString(getMemoryUsage()) << ")" << endl;
     }
 
 protected:
+    enum {
+        /// Approximate size of the chunks of a file that are parsed in parallel
+        PARSE_CHUNK_SIZE = 1 << 20,
+
+        /// Number of partitions (a power of two) that are deduplicated in parallel
+        DEDUP_PARTITIONS = 256,
+
+        /// Number of elements per task of the parallel loops
+        GRAIN_SIZE = 1 << 16
+    };
+
     /// Vertex indices used by the OBJ format
     struct OBJVertex {
         uint32_t p = (uint32_t) -1;
@@ -140,35 +175,462 @@ protected:
 
         inline OBJVertex() { }
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+        inline bool operator==(const OBJVertex &v) const {
+            return v.p == p && v.n == n && v.uv == uv;
+        }
+    };
+
+    /// Hash function for OBJVertex (all bits of the result are well mixed)
+    struct OBJVertexHash {
+        uint64_t operator()(const OBJVertex &v) const {
+            uint64_t hash = (((uint64_t) v.p << 32) | v.n) ^ ((uint64_t) v.uv * 0x9E3779B97F4A7C15ull);
+            hash = (hash ^ (hash >> 33)) * 0xff51afd7ed558ccdull;
+            hash = (hash ^ (hash >> 33)) * 0xc4ceb9fe1a85ec53ull;
+            return hash ^ (hash >> 33);
+        }
+    };
+
+    /**
+     * \brief Hash table that maps OBJ vertices to the index of their first
+     * corner
+     *
+     * Uses open addressing with linear probing in a flat array, which is
+     * allocated once for the maximum number of entries and kept at most
+     * half full. Slots are selected by the low bits of the hash value.
+     */
+    class VertexTable {
+    public:
+        VertexTable(uint32_t maxSize) {
+            size_t capacity = 16;
+            while (capacity < 2 * (size_t) maxSize)
+                capacity *= 2;
+            m_entries.resize(capacity);
+            m_mask = capacity - 1;
+        }
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+        /// Return the value stored for \c v, or insert \c value if there is none
+        uint32_t insert(const OBJVertex &v, uint64_t hash, uint32_t value) {
+            for (size_t i = (size_t) hash & m_mask;; i = (i + 1) & m_mask) {
+                Entry &entry = m_entries[i];
+                if (entry.value == INVALID) {
+                    entry.key = v;
+                    entry.value = value;
+                    return value;
+                } else if (entry.key == v) {
+                    return entry.value;
+                }
+            }
+        }
 
-            p = toUInt(tokens[0]);
+    private:
+        static const uint32_t INVALID = (uint32_t) -1;
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+        struct Entry {
+            OBJVertex key;
+            uint32_t value = INVALID;
+        };
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+        std::vector<Entry> m_entries;
+        size_t m_mask;
+    };
+
+    /// Vertex data and face corners read from an OBJ file
+    struct OBJBuffers {
+        std::vector<Vector3f> positions;
+        std::vector<Vector2f> texcoords;
+        std::vector<Vector3f> normals;
+        std::vector<OBJVertex> corners; ///< Three consecutive corners per triangle
+    };
+
+    /**
+     * \brief Map an OBJ file and parse its contents into \c buffers
+     *
+     * \param faces
+     *    Parse the faces as well (and not only the vertex data)?
+     * \return The size of the file in bytes
+     */
+    static size_t parseFile(const filesystem::path &filename, const Transform &trafo,
+                            OBJBuffers &buffers, bool faces = true) {
+        std::unique_ptr<MemoryMappedFile> file;
+        try {
+            file.reset(new MemoryMappedFile(filename.str()));
+        } catch (const NoriException &) {
+            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
         }
 
-        inline bool operator==(const OBJVertex &v) const {
-            return v.p == p && v.n == n && v.uv == uv;
+        /* Split the file into chunks that end with a newline */
+        const char *data = (const char *) file->data(), *end = data + file->size();
+        std::vector<const char *> bounds(1, data);
+        while (isParallel() && (size_t) (end - bounds.back()) > PARSE_CHUNK_SIZE) {
+            const char *eol = (const char *) memchr(bounds.back() + PARSE_CHUNK_SIZE, '\n',
+                                                    end - bounds.back() - PARSE_CHUNK_SIZE);
+            if (!eol)
+                break;
+            bounds.push_back(eol + 1);
         }
-    };
+        bounds.push_back(end);
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+        /* Parse a single chunk directly into the result */
+        if (bounds.size() == 2) {
+            parseChunk(data, end, trafo, buffers, faces);
+            return file->size();
         }
-    };
+
+        std::vector<OBJBuffers> chunks(bounds.size() - 1);
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, chunks.size(), 1),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    parseChunk(bounds[i], bounds[i + 1], trafo, chunks[i], faces);
+            }
+        );
+
+        /* Vertex indices of the faces refer to the whole file, so the
+           chunks can simply be concatenated */
+        concatenate(chunks, &OBJBuffers::positions, buffers.positions);
+        concatenate(chunks, &OBJBuffers::texcoords, buffers.texcoords);
+        concatenate(chunks, &OBJBuffers::normals, buffers.normals);
+        concatenate(chunks, &OBJBuffers::corners, buffers.corners);
+        return file->size();
+    }
+
+    /// Can the loader use more than one thread?
+    static bool isParallel() { return tbb::this_task_arena::max_concurrency() > 1; }
+
+    /// Parse the lines of <tt>[ptr, end)</tt>
+    static void parseChunk(const char *ptr, const char *end, const Transform &trafo,
+                           OBJBuffers &buffers, bool faces) {
+        while (ptr < end) {
+            const char *eol = (const char *) memchr(ptr, '\n', end - ptr);
+            if (!eol)
+                eol = end;
+            parseLine(ptr, eol, trafo, buffers, faces);
+            ptr = eol + 1;
+        }
+    }
+
+    /// Append one of the arrays of all chunks to \c result (releasing them)
+    template <typename T> static void concatenate(std::vector<OBJBuffers> &chunks,
+            std::vector<T> OBJBuffers::*array, std::vector<T> &result) {
+        std::vector<size_t> offsets(chunks.size() + 1, 0);
+        for (size_t i = 0; i < chunks.size(); ++i)
+            offsets[i + 1] = offsets[i] + (chunks[i].*array).size();
+
+        result.resize(offsets.back());
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, chunks.size(), 1),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    std::vector<T> &chunk = chunks[i].*array;
+                    std::copy(chunk.begin(), chunk.end(), result.begin() + offsets[i]);
+                    std::vector<T>().swap(chunk);
+                }
+            }
+        );
+    }
+
+    /**
+     * \brief Convert the face corners into an indexed vertex list
+     *
+     * Vertices are numbered in the order of their first occurrence, which
+     * matches a sequential pass over the corners. The corners are sorted
+     * into partitions by their hash value (keeping their order within each
+     * partition). The partitions are then deduplicated in parallel, which
+     * links every corner to the first corner with the same indices.
+     * Finally, a prefix sum over the first occurrences numbers the
+     * vertices. Without concurrency, a single sequential pass over one
+     * hash table is used instead.
+     */
+    static void deduplicate(const std::vector<OBJVertex> &corners,
+                            std::vector<uint32_t> &indices, std::vector<OBJVertex> &vertices) {
+        const uint32_t count = (uint32_t) corners.size(), P = DEDUP_PARTITIONS;
+        const uint32_t blockCount = (count + GRAIN_SIZE - 1) / GRAIN_SIZE;
+
+        /* A single pass is faster without concurrency */
+        if (!isParallel() || blockCount <= 1) {
+            VertexTable table(count);
+            indices.resize(count);
+            for (uint32_t i = 0; i < count; ++i) {
+                uint32_t first = table.insert(corners[i], OBJVertexHash()(corners[i]), i);
+                if (first == i) {
+                    indices[i] = (uint32_t) vertices.size();
+                    vertices.push_back(corners[i]);
+                } else {
+                    indices[i] = indices[first];
+                }
+            }
+            return;
+        }
+
+        auto partition = [](const OBJVertex &v) {
+            return (uint32_t) (OBJVertexHash()(v) >> 56) & (P - 1);
+        };
+        auto forEachBlock = [&](const std::function<void(uint32_t, uint32_t, uint32_t)> &func) {
+            tbb::parallel_for(
+                tbb::blocked_range<uint32_t>(0u, blockCount, 1),
+                [&](const tbb::blocked_range<uint32_t> &range) {
+                    for (uint32_t b = range.begin(); b != range.end(); ++b)
+                        func(b, b * GRAIN_SIZE, std::min(count, (b + 1) * GRAIN_SIZE));
+                }
+            );
+        };
+
+        /* Counting sort of the corners by partition: count per block,
+           turn the counts into offsets, and scatter */
+        std::vector<uint32_t> offsets((size_t) blockCount * P, 0), partitionStart(P + 1);
+        forEachBlock([&](uint32_t b, uint32_t start, uint32_t end) {
+            for (uint32_t i = start; i < end; ++i)
+                offsets[(size_t) b * P + partition(corners[i])]++;
+        });
+        uint32_t sum = 0;
+        for (uint32_t p = 0; p < P; ++p) {
+            partitionStart[p] = sum;
+            for (uint32_t b = 0; b < blockCount; ++b) {
+                uint32_t blockSize = offsets[(size_t) b * P + p];
+                offsets[(size_t) b * P + p] = sum;
+                sum += blockSize;
+            }
+        }
+        partitionStart[P] = count;
+
+        /* Copy the corners along with their index, so that the
+           partitions can be read sequentially */
+        struct Corner {
+            OBJVertex v;
+            uint32_t index;
+        };
+        std::vector<Corner> sorted(count);
+        forEachBlock([&](uint32_t b, uint32_t start, uint32_t end) {
+            for (uint32_t i = start; i < end; ++i)
+                sorted[offsets[(size_t) b * P + partition(corners[i])]++] = Corner{ corners[i], i };
+        });
+
+        /* Link every corner to the first one with the same indices */
+        std::vector<uint32_t> first(count);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, P, 1),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t p = range.begin(); p != range.end(); ++p) {
+                    VertexTable table(partitionStart[p + 1] - partitionStart[p]);
+                    for (uint32_t j = partitionStart[p]; j < partitionStart[p + 1]; ++j) {
+                        const Corner &c = sorted[j];
+                        first[c.index] = table.insert(c.v, OBJVertexHash()(c.v), c.index);
+                    }
+                }
+            }
+        );
+        std::vector<Corner>().swap(sorted);
+
+        /* Number the first occurrences with a prefix sum over the blocks */
+        std::vector<uint32_t> blockOffset(blockCount + 1, 0);
+        forEachBlock([&](uint32_t b, uint32_t start, uint32_t end) {
+            for (uint32_t i = start; i < end; ++i)
+                blockOffset[b + 1] += first[i] == i;
+        });
+        for (uint32_t b = 0; b < blockCount; ++b)
+            blockOffset[b + 1] += blockOffset[b];
+
+        indices.resize(count);
+        vertices.resize(blockOffset[blockCount]);
+        forEachBlock([&](uint32_t b, uint32_t start, uint32_t end) {
+            uint32_t index = blockOffset[b];
+            for (uint32_t i = start; i < end; ++i) {
+                if (first[i] == i) {
+                    vertices[index] = corners[i];
+                    indices[i] = index++;
+                }
+            }
+        });
+
+        /* The first occurrence always precedes the other corners */
+        forEachBlock([&](uint32_t, uint32_t start, uint32_t end) {
+            for (uint32_t i = start; i < end; ++i)
+                indices[i] = indices[first[i]];
+        });
+    }
+
+    static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+    static void skipSpace(const char *&ptr, const char *end) {
+        while (ptr < end && isSpace(*ptr))
+            ++ptr;
+    }
+
+    /// Parse a record of the line <tt>[ptr, end)</tt> (without the newline)
+    static void parseLine(const char *ptr, const char *end, const Transform &trafo,
+                          OBJBuffers &buffers, bool faces) {
+        const char *line = ptr;
+        skipSpace(ptr, end);
+        if (end - ptr < 2 || !(ptr[0] == 'v' || ptr[0] == 'f'))
+            return;
+
+        if (ptr[0] == 'v' && isSpace(ptr[1])) {
+            Point3f p = Point3f::Zero();
+            ptr += 2;
+            for (int i = 0; i < 3; ++i)
+                parseFloat(ptr, end, p[i]);
+            buffers.positions.push_back(trafo * p);
+        } else if (ptr[0] == 'v' && ptr[1] == 't' && end - ptr > 2 && isSpace(ptr[2])) {
+            Point2f tc = Point2f::Zero();
+            ptr += 3;
+            for (int i = 0; i < 2; ++i)
+                parseFloat(ptr, end, tc[i]);
+            buffers.texcoords.push_back(tc);
+        } else if (ptr[0] == 'v' && ptr[1] == 'n' && end - ptr > 2 && isSpace(ptr[2])) {
+            Normal3f n = Normal3f::Zero();
+            ptr += 3;
+            for (int i = 0; i < 3; ++i)
+                parseFloat(ptr, end, n[i]);
+            buffers.normals.push_back((trafo * n).normalized());
+        } else if (ptr[0] == 'f' && isSpace(ptr[1]) && faces) {
+            OBJVertex verts[4];
+            int nVertices = 0;
+            ptr += 2;
+            for (; nVertices < 4; ++nVertices) {
+                skipSpace(ptr, end);
+                if (ptr == end)
+                    break;
+                parseVertex(ptr, end, verts[nVertices]);
+            }
+            if (nVertices < 3)
+                throw NoriException("Invalid face: \"%s\"", std::string(line, end));
+
+            buffers.corners.push_back(verts[0]);
+            buffers.corners.push_back(verts[1]);
+            buffers.corners.push_back(verts[2]);
+            if (nVertices == 4) {
+                /* This is a quad, split into two triangles */
+                buffers.corners.push_back(verts[3]);
+                buffers.corners.push_back(verts[0]);
+                buffers.corners.push_back(verts[2]);
+            }
+        }
+    }
+
+    /// Parse a face corner of the form <tt>p</tt>, <tt>p/uv</tt>, <tt>p//n</tt> or <tt>p/uv/n</tt>
+    static void parseVertex(const char *&ptr, const char *end, OBJVertex &v) {
+        const char *start = ptr;
+        bool valid = parseUInt(ptr, end, v.p);
+        if (valid && ptr < end && *ptr == '/') {
+            ++ptr;
+            if (ptr < end && *ptr != '/')
+                valid = parseUInt(ptr, end, v.uv);
+            if (valid && ptr < end && *ptr == '/') {
+                ++ptr;
+                valid = parseUInt(ptr, end, v.n);
+            }
+        }
+        if (!valid || (ptr < end && !isSpace(*ptr))) {
+            while (ptr < end && !isSpace(*ptr))
+                ++ptr;
+            throw NoriException("Invalid vertex data: \"%s\"", std::string(start, ptr));
+        }
+    }
+
+    /// Parse an unsigned decimal integer (returns \c false if there is none)
+    static bool parseUInt(const char *&ptr, const char *end, uint32_t &value) {
+        if (ptr == end || !isDigit(*ptr))
+            return false;
+        uint64_t result = 0;
+        for (; ptr < end && isDigit(*ptr); ++ptr) {
+            result = result * 10 + (uint64_t) (*ptr - '0');
+            if (result > 0xFFFFFFFFull)
+                return false;
+        }
+        value = (uint32_t) result;
+        return true;
+    }
+
+    /**
+     * \brief Parse a decimal floating point number after optional
+     * whitespace (returns \c false and keeps \c value if there is none)
+     *
+     * Up to 19 significant digits are accumulated in an integer, which is
+     * then scaled by an exactly representable power of ten in double
+     * precision for all common exponents. Special values like \c inf and
+     * \c nan are handed to \c strtof().
+     */
+    static bool parseFloat(const char *&ptr, const char *end, float &value) {
+        static const double powers[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        skipSpace(ptr, end);
+        const char *p = ptr;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+
+        uint64_t mantissa = 0;
+        int exponent = 0, digits = 0;
+        bool valid = false;
+        for (; p < end && isDigit(*p); ++p) {
+            valid = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+                digits += mantissa != 0;
+            } else {
+                exponent++;
+            }
+        }
+        if (p < end && *p == '.') {
+            for (++p; p < end && isDigit(*p); ++p) {
+                valid = true;
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+                    digits += mantissa != 0;
+                    exponent--;
+                }
+            }
+        }
+
+        if (!valid) {
+            char buf[32];
+            size_t length = 0;
+            while (ptr + length < end && !isSpace(ptr[length]) && length < sizeof(buf) - 1) {
+                buf[length] = ptr[length];
+                length++;
+            }
+            buf[length] = '\0';
+            char *bufEnd = nullptr;
+            float result = strtof(buf, &bufEnd);
+            if (bufEnd == buf)
+                return false;
+            ptr += bufEnd - buf;
+            value = result;
+            return true;
+        }
+
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            const char *q = p + 1;
+            bool negativeExponent = false;
+            if (q < end && (*q == '-' || *q == '+'))
+                negativeExponent = *q++ == '-';
+            if (q < end && isDigit(*q)) {
+                int e = 0;
+                for (; q < end && isDigit(*q); ++q)
+                    e = std::min(e * 10 + (*q - '0'), 100000);
+                exponent += negativeExponent ? -e : e;
+                p = q;
+            }
+        }
+
+        double result = (double) mantissa;
+        if (mantissa == 0)
+            result = 0.0;
+        else if (exponent >= 0 && exponent <= 22)
+            result *= powers[exponent];
+        else if (exponent < 0 && exponent >= -22)
+            result /= powers[-exponent];
+        else
+            result *= std::pow(10.0, (double) exponent);
+
+        value = (float) (negative ? -result : result);
+        ptr = p;
+        return true;
+    }
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
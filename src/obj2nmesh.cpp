@@ -0,0 +1,36 @@
+#include <nori/nmesh.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <memory>
+
+using namespace nori;
+
+/* Convert a Wavefront OBJ file into a binary mesh file, which the nmesh
+   plugin maps into memory and uses without parsing or copying it
+   (see \ref NMeshHeader) */
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        cerr << "Syntax: " << argv[0] << " <input.obj> <output.nmesh>" << endl;
+        return -1;
+    }
+
+    try {
+        filesystem::path path(argv[1]);
+        getFileResolver()->prepend(path.parent_path());
+
+        PropertyList propList;
+        propList.setString("filename", path.filename());
+        std::unique_ptr<Mesh> mesh(static_cast<Mesh *>(
+            NoriObjectFactory::createInstance("obj", propList)));
+
+        cout << "Writing \"" << argv[2] << "\" .. ";
+        cout.flush();
+        Timer timer;
+        writeNMesh(argv[2], *mesh);
+        cout << "done. (took " << timer.elapsedString() << ")" << endl;
+    } catch (const std::exception &e) {
+        cerr << "Error: " << e.what() << endl;
+        return -1;
+    }
+    return 0;
+}
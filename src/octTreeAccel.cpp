@@ -1,214 +1,422 @@
 #include <nori/octTreeAccel.h>
+#include <nori/timer.h>
+#include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <algorithm>
-#include <queue>
-#include <chrono>
 NORI_NAMESPACE_BEGIN
 
-int OctTreeNode::m_level = 0;
-int OctTreeNode::m_leafCount = 0;
-int OctTreeNode::m_nodeCount = 0;
-int OctTreeNode::m_elementCount[MAX_WIDTH+1] = { 0 };
-OctTreeNode* OctTreeNode::build(const BoundingBox3f& bbox, std::vector<Element*>& elements, int depth)
-{
-    if(elements.size() == 0) return nullptr;
-    OctTreeNode* node = new OctTreeNode(bbox);
-    OctTreeNode::m_level = OctTreeNode::m_level < depth ? depth : OctTreeNode::m_level;
-    if (elements.size() <= MAX_WIDTH)
-    {
-        for (int i = 0; i < elements.size(); ++i) {
-            node->m_elements[i] = elements[i];
-        }
-        OctTreeNode::m_leafCount++;
-        OctTreeNode::m_elementCount[elements.size()]++;
-		return node;
-	}
-
-    // construct 8 children's bbox & elementList
-    BoundingBox3f childrenBBox[8];
-    std::vector<Element*> childrenElements[8];
-    std::vector<Element*> parentElements;
-
-    Vector3f release = bbox.getExtents() * RELASE_CONST;
-    Vector3f center = bbox.getCenter();
-    for(int j = 0; j < 8; j++){
-        Vector3f min, max;
-        Vector3f corner = bbox.getCorner(j);
-
-        for (int i = 0; i < 3; i++) {
-            if (center[i] - corner[i] > 0) {
-				min[i] = corner[i];
-				max[i] = center[i] + release[i];
-            }
-            else {
-                min[i] = center[i] - release[i];
-                max[i] = corner[i];
-            }
-        }
+/**
+ * \brief Slab test of a ray segment against a box
+ *
+ * NaNs that arise from axis-parallel rays grazing a slab are treated
+ * as a hit.
+ */
+static inline bool intersectBox(const BoundingBox3f& bbox, const Ray3f& ray) {
+    float tn = ray.mint, tf = ray.maxt;
+    for (int a = 0; a < 3; ++a) {
+        float t0 = (bbox.min[a] - ray.o[a]) * ray.dRcp[a];
+        float t1 = (bbox.max[a] - ray.o[a]) * ray.dRcp[a];
+        if (ray.dRcp[a] < 0)
+            std::swap(t0, t1);
+        t1 *= SlabFarScale;
+        tn = t0 > tn ? t0 : tn;
+        tf = t1 < tf ? t1 : tf;
+    }
+    return tn <= tf;
+}
 
-        childrenBBox[j] = BoundingBox3f(min, max);
+/**
+ * \brief Conservative overlap test of a triangle and a box
+ *
+ * Besides the bounding boxes, this also checks that the plane of the
+ * triangle passes through the box, which rejects most false positives
+ * of large diagonal triangles.
+ */
+static bool overlaps(const OctTreeAccel& accel, uint32_t idx, const BoundingBox3f& bbox) {
+    if (!accel.getBoundingBox(idx).overlaps(bbox))
+        return false;
+
+    /* The plane of a moving triangle changes over time */
+    if (accel.isMoving(idx))
+        return true;
+
+    Point3f p0, p1, p2;
+    accel.getTriangle(idx, p0, p1, p2);
+    Vector3f n = (p1 - p0).cross(p2 - p0);
+    Point3f vmin, vmax;
+    for (int a = 0; a < 3; ++a) {
+        vmin[a] = n[a] > 0 ? bbox.min[a] : bbox.max[a];
+        vmax[a] = n[a] > 0 ? bbox.max[a] : bbox.min[a];
     }
+    return n.dot(vmin - p0) <= 0 && n.dot(vmax - p0) >= 0;
+}
 
-    while (!elements.empty()) {
-		Element* element = elements.back();
-        elements.pop_back();
+/**
+ * \brief Parallel octree construction
+ *
+ * The triangles of a node are sorted by octant in place, so that the
+ * children usually work on subranges of their parent's index array. Only
+ * straddling triangles that are passed on to several children require a
+ * new array. Large nodes build their children in parallel. The nodes and
+ * triangle references are allocated from concurrent vectors and copied
+ * into the flat arrays of the \ref OctTreeAccel at the end.
+ */
+class OctTreeBuilder {
+public:
+    typedef OctTreeAccel::OctTreeNode OctTreeNode;
+
+    enum {
+        /// Nodes with fewer triangles build their children serially
+        PARALLEL_THRESHOLD = 4096,
+
+        /// Marks straddling triangles during the partitioning
+        STRADDLING = 8
+    };
+
+    /// Build statistics (collected per thread)
+    struct Statistics {
+        uint32_t leafCount = 0;
+        uint32_t depth = 0;
+        uint32_t references = 0;
+    };
+
+    OctTreeBuilder(const OctTreeAccel& accel) : m_accel(accel) { }
+
+    /// Build the tree below a root node with the given bounds
+    void build(const BoundingBox3f& bbox, std::vector<uint32_t>& triangles) {
+        m_nodes.push_back(makeNode(bbox, OctTreeAccel::INVALID_NODE, 0));
+        subdivide(0u, triangles.data(), (uint32_t) triangles.size(), 0u);
+    }
 
-        bool poped = false;
-        for (int i = 0; i < 8; i++) {
-            if (element->inBBox(childrenBBox[i])) {
-                childrenElements[i].push_back(element);
-                poped = true;
-            }
-		}
-        if (!poped) parentElements.push_back(element);
-	}
+    /// Copy the nodes and triangle references into the given arrays
+    void store(std::vector<OctTreeNode>& nodes, std::vector<uint32_t>& indices) const {
+        nodes.assign(m_nodes.begin(), m_nodes.end());
+        indices.assign(m_indices.begin(), m_indices.end());
+    }
 
-    int crossBBox = (parentElements.size() > MAX_WIDTH) ? MAX_WIDTH : parentElements.size();
-    for (int i = 0; i < crossBBox; i++) {
-        node->m_elements[i] = parentElements[i];
+    /// Combine the statistics of all threads
+    Statistics statistics() const {
+        Statistics result;
+        for (const Statistics& local : m_stats) {
+            result.leafCount += local.leafCount;
+            result.depth = std::max(result.depth, local.depth);
+            result.references += local.references;
+        }
+        return result;
     }
 
-    for(int i = MAX_WIDTH; i < parentElements.size(); i++){
-		for (int j = 0; j < 8; j++) {
-			if(parentElements[i]->m_bbox.overlaps(childrenBBox[j])){
-				childrenElements[j].push_back(parentElements[i]);
-			}
-		}
-	}
-
-    for (int i = 0; i < 8; i++) {
-        if(childrenElements[i].size() == 0) continue;
-        node->m_children[i] = build(childrenBBox[i], childrenElements[i], depth+1);
+protected:
+    static OctTreeNode makeNode(const BoundingBox3f& bbox, uint32_t parent, int octant) {
+        OctTreeNode node;
+        node.bbox = bbox;
+        node.parent = parent;
+        node.firstChild = 0;
+        node.start = node.size = 0;
+        node.childMask = 0;
+        node.octant = (uint8_t) octant;
+        return node;
     }
 
-    OctTreeNode::m_elementCount[crossBBox]++;
-    return node;
-}
+    /// Reference the given triangles from the node \c node_idx
+    void storeTriangles(uint32_t node_idx, const uint32_t* triangles, uint32_t size) {
+        uint32_t start = 0;
+        if (size > 0) {
+            auto it = m_indices.grow_by(size);
+            std::copy(triangles, triangles + size, it);
+            start = (uint32_t) (it - m_indices.begin());
+        }
+        m_nodes[node_idx].start = start;
+        m_nodes[node_idx].size = size;
+        m_stats.local().references += size;
+    }
 
-Element* OctTreeNode::rayIntersect(Ray3f& ray, Intersection& its) const
-{
-    float nearT, farT;
-    if (!m_bbox.rayIntersect(ray, nearT, farT)) return nullptr;
-
-    Element* curHitElement = nullptr;
-    OctTreeNode* curNode = nullptr;
-    std::priority_queue<std::pair<float, OctTreeNode*>, std::vector<std::pair<float, OctTreeNode*>>, CompareOctTreeNodes> pq;
-    pq.push({ nearT, const_cast<OctTreeNode*>(this) });
-    do
-    {
-        curNode = pq.top().second;
-        pq.pop();
-
-
-        for (int i = 0; i < MAX_WIDTH; i++) {
-            if (curNode->m_elements[i] == nullptr) break;
-            if (curNode->m_elements[i]->rayIntersect(ray, its)) {
-                curHitElement = curNode->m_elements[i];
-            }
+    /// Recursively subdivide the node \c node_idx, which overlaps <tt>triangles[0..size)</tt>
+    void subdivide(uint32_t node_idx, uint32_t* triangles, uint32_t size, uint32_t depth) {
+        Statistics& stats = m_stats.local();
+        stats.depth = std::max(stats.depth, depth);
+
+        if (size <= OctTreeAccel::MAX_WIDTH || depth >= OctTreeAccel::MAX_DEPTH) {
+            storeTriangles(node_idx, triangles, size);
+            stats.leafCount++;
+            return;
         }
 
-        for (int i = 0; i < 8; i++) {
-            auto child = curNode->m_children[i];
-            if (child == nullptr || !child->m_bbox.rayIntersect(ray, nearT, farT)) continue;
-            if(nearT < ray.maxt) pq.push({ nearT, child });
+        /* Boxes of the eight octants: bit i of the octant index selects the upper half along axis i */
+        const BoundingBox3f bbox = m_nodes[node_idx].bbox;
+        BoundingBox3f childBBox[8];
+        Point3f center = bbox.getCenter();
+        for (int i = 0; i < 8; ++i) {
+            Point3f corner = bbox.getCorner(i);
+            childBBox[i] = BoundingBox3f(corner.cwiseMin(center), corner.cwiseMax(center));
         }
-    } while (!pq.empty());
 
-	return curHitElement;
-}
+        /* Classify the triangles (the scratch array is only used until the recursion starts,
+           first for the octant of every triangle, then for the overlap masks of the straddling ones) */
+        std::vector<uint8_t>& octants = m_scratch.local();
+        octants.resize(size);
+        uint32_t count[9] = { 0 };
+        for (uint32_t i = 0; i < size; ++i) {
+            BoundingBox3f triBBox = m_accel.getBoundingBox(triangles[i]);
+            int octant = 0;
+            while (octant < 8 && !childBBox[octant].contains(triBBox))
+                ++octant;
+            octants[i] = (uint8_t) octant;
+            count[octant]++;
+        }
+
+        /* Sort by octant in place: [octant 0] .. [octant 7] [straddling] */
+        uint32_t begin[9], next[9];
+        for (int b = 0, offset = 0; b < 9; offset += count[b++])
+            begin[b] = next[b] = offset;
+        for (int b = 0; b < 9; ++b) {
+            uint32_t end = begin[b] + count[b];
+            while (next[b] < end) {
+                uint8_t octant = octants[next[b]];
+                if (octant == b) {
+                    next[b]++;
+                } else {
+                    uint32_t target = next[octant]++;
+                    std::swap(triangles[next[b]], triangles[target]);
+                    std::swap(octants[next[b]], octants[target]);
+                }
+            }
+        }
 
+        /* Keep a few straddling triangles, and pass the others to all overlapping children */
+        uint32_t keep = std::min(count[STRADDLING], (uint32_t) OctTreeAccel::MAX_WIDTH);
+        uint32_t* extra = triangles + begin[STRADDLING] + keep;
+        uint32_t extraCount = count[STRADDLING] - keep;
+        uint8_t* overlapMask = octants.data() + begin[STRADDLING] + keep;
+        uint32_t childSize[8], references = 0;
+        for (int octant = 0; octant < 8; ++octant)
+            childSize[octant] = count[octant];
+        for (uint32_t i = 0; i < extraCount; ++i) {
+            overlapMask[i] = 0;
+            for (int octant = 0; octant < 8; ++octant) {
+                if (overlaps(m_accel, extra[i], childBBox[octant])) {
+                    overlapMask[i] |= (uint8_t) (1 << octant);
+                    childSize[octant]++;
+                }
+            }
+        }
+        for (int octant = 0; octant < 8; ++octant)
+            references += childSize[octant];
+
+        /* Subdividing further is pointless if most triangles end up in several children */
+        if (references > OctTreeAccel::MAX_DUPLICATION * size) {
+            storeTriangles(node_idx, triangles, size);
+            stats.leafCount++;
+            return;
+        }
+        storeTriangles(node_idx, triangles + begin[STRADDLING], keep);
+
+        /* The children work in place, unless straddling triangles are duplicated */
+        std::vector<uint32_t> buffer;
+        uint32_t* childTriangles[8];
+        if (extraCount == 0) {
+            for (int octant = 0; octant < 8; ++octant)
+                childTriangles[octant] = triangles + begin[octant];
+        }
+        else {
+            buffer.resize(references);
+            uint32_t* out = buffer.data();
+            for (int octant = 0; octant < 8; ++octant) {
+                childTriangles[octant] = out;
+                out = std::copy(triangles + begin[octant], triangles + begin[octant] + count[octant], out);
+                for (uint32_t i = 0; i < extraCount; ++i) {
+                    if (overlapMask[i] & (1 << octant))
+                        *out++ = extra[i];
+                }
+            }
+        }
 
-void OctTreeAccel::build()
-{
-    using namespace std::chrono;
-    auto start = high_resolution_clock::now();
+        /* Allocate the existing children next to each other */
+        int occupied[8], childCount = 0;
+        for (int octant = 0; octant < 8; ++octant) {
+            if (childSize[octant] > 0)
+                occupied[childCount++] = octant;
+        }
+        auto it = m_nodes.grow_by(childCount);
+        uint32_t firstChild = (uint32_t) (it - m_nodes.begin());
+        uint8_t childMask = 0;
+        for (int k = 0; k < childCount; ++k) {
+            *it++ = makeNode(childBBox[occupied[k]], node_idx, occupied[k]);
+            childMask |= (uint8_t) (1 << occupied[k]);
+        }
+        m_nodes[node_idx].firstChild = firstChild;
+        m_nodes[node_idx].childMask = childMask;
 
-	std::vector<Element*> elements;
-    int size = m_mesh->getTriangleCount();
-    elements.reserve(size);
+        auto buildChild = [&](int k) {
+            int octant = occupied[k];
+            subdivide(firstChild + k, childTriangles[octant], childSize[octant], depth + 1);
+        };
 
-    for (int i = 0; i < size; i++) {
-        elements.push_back(new Triangle(m_mesh, i));
+        if (size >= PARALLEL_THRESHOLD) {
+            tbb::parallel_for(0, childCount, buildChild);
+        }
+        else {
+            for (int k = 0; k < childCount; ++k)
+                buildChild(k);
+        }
     }
-	m_root = OctTreeNode::build(m_bbox, elements, 0);
-
-    //m_root->print(0);
-    //OctTreeNode::validate(m_root, size);
-    
-    auto end = high_resolution_clock::now();
-    std::cout << "OctTree build time:" << duration_cast<milliseconds>(end - start).count() << "ms\n";
-    std::cout << "OctTree Depth: " << OctTreeNode::m_level << std::endl;
-    std::cout << "LeafCount: " << OctTreeNode::m_leafCount << std::endl;
-    std::cout << "NodeCount: " << OctTreeNode::m_nodeCount << std::endl;
-    for(int i = 0; i <= MAX_WIDTH; i++){
-		std::cout << "\t\tElementCount[" << i << "]: " << OctTreeNode::m_elementCount[i] << std::endl;
-	}
-    //exit(0);
-}
 
-bool OctTreeAccel::rayIntersect(const Ray3f& ray_, Intersection& its, bool shadowRay) const
-{
-    bool foundIntersection = false;  // Was an intersection found so far?
-    uint32_t idx = (uint32_t)-1;      // Triangle index of the closest intersection
+private:
+    const OctTreeAccel& m_accel;
+    tbb::concurrent_vector<OctTreeNode> m_nodes;
+    tbb::concurrent_vector<uint32_t> m_indices;
+    tbb::enumerable_thread_specific<Statistics> m_stats;
+    tbb::enumerable_thread_specific<std::vector<uint8_t>> m_scratch;
+};
+
+void OctTreeAccel::addMesh(Mesh* mesh) {
+    m_meshes.push_back(mesh);
+    m_meshOffset.push_back(m_meshOffset.back() + mesh->getTriangleCount());
+    m_bbox.expandBy(mesh->getBoundingBox());
+}
 
-    Ray3f ray(ray_);
+void OctTreeAccel::build() {
+    m_nodes.clear();
+    m_indices.clear();
+    uint32_t size = getTriangleCount();
+    if (size == 0)
+        return;
+
+    cout << "Constructing an OctTreeAccel (" << m_meshes.size()
+        << (m_meshes.size() == 1 ? " mesh, " : " meshes, ") << size << " triangles) .. ";
+    cout.flush();
+    Timer timer;
+
+    std::vector<uint32_t> triangles(size);
+    for (uint32_t i = 0; i < size; ++i)
+        triangles[i] = i;
+
+    OctTreeBuilder builder(*this);
+    builder.build(m_bbox, triangles);
+    builder.store(m_nodes, m_indices);
+    OctTreeBuilder::Statistics stats = builder.statistics();
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(OctTreeNode) * m_nodes.size() + sizeof(uint32_t) * m_indices.size())
+        << ", " << m_nodes.size() << " nodes, " << stats.leafCount << " leaves, depth "
+        << stats.depth << ", " << stats.references << " triangle references)." << endl;
+}
 
-    Element* element = m_root->rayIntersect(ray, its);
-    if (element != nullptr) {
-        foundIntersection = true;
+uint32_t OctTreeAccel::nextChild(const OctTreeNode& node, int rank, const Ray3f& ray, int dirMask) const {
+    /* Visiting the octants in the order 'rank ^ dirMask' processes the
+       halves that the ray enters first before the ones it enters later */
+    for (; rank < 8; ++rank) {
+        int octant = rank ^ dirMask;
+        if (!(node.childMask & (1 << octant)))
+            continue;
+        uint32_t child = node.child(octant);
+        if (intersectBox(m_nodes[child].bbox, ray))
+            return child;
     }
+    return INVALID_NODE;
+}
 
-    if (foundIntersection) {
-        Triangle* triangle = (Triangle*)element;
-        idx = triangle->idx;
-        /* Find the barycentric coordinates */
-        Vector3f bary;
-        bary << 1 - its.uv.sum(), its.uv;
-
-        /* References to all relevant mesh buffers */
-        const Mesh* mesh = its.mesh;
-        const MatrixXf& V = mesh->getVertexPositions();
-        const MatrixXf& N = mesh->getVertexNormals();
-        const MatrixXf& UV = mesh->getVertexTexCoords();
-        const MatrixXu& F = mesh->getIndices();
-
-        /* Vertex indices of the triangle */
-        uint32_t i0 = F(0, idx), i1 = F(1, idx), i2 = F(2, idx);
-        Point3f p0 = V.col(i0), p1 = V.col(i1), p2 = V.col(i2);
-
-        /* Compute the intersection positon accurately
-           using barycentric coordinates */
-        its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-        /* Compute proper texture coordinates if provided by the mesh */
-        if (UV.size() > 0)
-            its.uv = bary.x() * UV.col(i0) +
-            bary.y() * UV.col(i1) +
-            bary.z() * UV.col(i2);
-
-        /* Compute the geometry frame */
-        its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
-
-        if (N.size() > 0) {
-            /* Compute the shading frame. Note that for simplicity,
-               the current implementation doesn't attempt to provide
-               tangents that are continuous across the surface. That
-               means that this code will need to be modified to be able
-               use anisotropic BRDFs, which need tangent continuity */
-
-            its.shFrame = Frame(
-                (bary.x() * N.col(i0) +
-                    bary.y() * N.col(i1) +
-                    bary.z() * N.col(i2)).normalized());
+bool OctTreeAccel::rayIntersect(const Ray3f& _ray, Intersection& its, bool shadowRay) const {
+    bool foundIntersection = false;  // Was an intersection found so far?
+    uint32_t f = (uint32_t) -1;      // Triangle index of the closest intersection (within its mesh)
+
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (m_nodes.empty() || !intersectBox(m_nodes[0].bbox, ray))
+        return false;
+
+    int dirMask = (ray.d.x() < 0 ? 1 : 0) | (ray.d.y() < 0 ? 2 : 0) | (ray.d.z() < 0 ? 4 : 0);
+    uint32_t node_idx = 0;
+    NodeVisitCounter visits;
+    TriangleRay tray(ray);
+
+    while (true) {
+        const OctTreeNode& node = m_nodes[node_idx];
+        visits++;
+        for (uint32_t i = node.start; i < node.start + node.size; ++i) {
+            uint32_t idx = m_indices[i];
+            uint32_t meshIdx = findMesh(idx);
+            float u, v, t;
+            if (m_meshes[meshIdx]->rayIntersect(idx, ray, tray, u, v, t)) {
+                /* An intersection was found! Can terminate
+                   immediately if this is a shadow ray query */
+                if (shadowRay)
+                    return true;
+                ray.maxt = its.t = t;
+                its.uv = Point2f(u, v);
+                its.mesh = m_meshes[meshIdx];
+                f = idx;
+                foundIntersection = true;
+            }
         }
-        else {
-            its.shFrame = its.geoFrame;
+
+        /* Descend into the first child that overlaps the (shortened) ray segment */
+        uint32_t next = nextChild(node, 0, ray, dirMask);
+
+        /* Otherwise, ascend until an ancestor has a further child left */
+        while (next == INVALID_NODE && node_idx != 0) {
+            const OctTreeNode& done = m_nodes[node_idx];
+            node_idx = done.parent;
+            next = nextChild(m_nodes[node_idx], (done.octant ^ dirMask) + 1, ray, dirMask);
         }
+
+        if (next == INVALID_NODE)
+            break;
+        node_idx = next;
     }
 
+    if (foundIntersection)
+        finalizeIntersection(f, ray.time, its);
+
     return foundIntersection;
 }
 
+void OctTreeAccel::finalizeIntersection(uint32_t f, float time, Intersection& its) const {
+    /* Find the barycentric coordinates */
+    Vector3f bary;
+    bary << 1 - its.uv.sum(), its.uv;
+
+    /* References to all relevant mesh buffers */
+    const Mesh* mesh = its.mesh;
+    const MatrixXuView& F = mesh->getIndices();
+
+    /* Vertex indices of the triangle */
+    uint32_t i0 = F(0, f), i1 = F(1, f), i2 = F(2, f);
+    Point3f p0 = mesh->getVertexPosition(i0, time),
+            p1 = mesh->getVertexPosition(i1, time),
+            p2 = mesh->getVertexPosition(i2, time);
+
+    /* Compute the intersection positon accurately
+       using barycentric coordinates */
+    its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+    /* Compute proper texture coordinates if provided by the mesh */
+    if (mesh->hasVertexTexCoords())
+        its.uv = bary.x() * mesh->getVertexTexCoord(i0) +
+        bary.y() * mesh->getVertexTexCoord(i1) +
+        bary.z() * mesh->getVertexTexCoord(i2);
+
+    /* Compute the geometry frame */
+    its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
+
+    if (mesh->hasVertexNormals()) {
+        /* Compute the shading frame. Note that for simplicity,
+           the current implementation doesn't attempt to provide
+           tangents that are continuous across the surface. That
+           means that this code will need to be modified to be able
+           use anisotropic BRDFs, which need tangent continuity */
+
+        its.shFrame = Frame(
+            (bary.x() * mesh->getVertexNormal(i0, time) +
+                bary.y() * mesh->getVertexNormal(i1, time) +
+                bary.z() * mesh->getVertexNormal(i2, time)).normalized());
+    }
+    else {
+        its.shFrame = its.geoFrame;
+    }
+}
 
+NORI_REGISTER_CLASS(OctTreeAccel, "octree");
 NORI_NAMESPACE_END
-
@@ -67,6 +67,8 @@ NoriObject *loadFromXML(const std::string &filename) {
         ESampler              = NoriObject::ESampler,
         ETest                 = NoriObject::ETest,
         EReconstructionFilter = NoriObject::EReconstructionFilter,
+        EInstance             = NoriObject::EInstance,
+        EAccel                = NoriObject::EAccel,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -83,6 +85,9 @@ NoriObject *loadFromXML(const std::string &filename) {
         EScale,
         ELookAt,
 
+        /* References to previously declared objects */
+        ERef,
+
         EInvalid
     };
 
@@ -99,6 +104,8 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["sampler"]    = ESampler;
     tags["rfilter"]    = EReconstructionFilter;
     tags["test"]       = ETest;
+    tags["instance"]   = EInstance;
+    tags["accel"]      = EAccel;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -112,6 +119,7 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["rotate"]     = ERotate;
     tags["scale"]      = EScale;
     tags["lookat"]     = ELookAt;
+    tags["ref"]        = ERef;
 
     /* Helper function to check if attributes are fully specified */
     auto check_attributes = [&](const pugi::xml_node &node, std::set<std::string> attrs) {
@@ -129,6 +137,9 @@ NoriObject *loadFromXML(const std::string &filename) {
 
     Eigen::Affine3f transform;
 
+    /* Objects that were given an 'id' attribute and can be referenced using <ref id=".."/> */
+    std::map<std::string, NoriObject *> ids;
+
     /* Helper function to parse a Nori XML node (recursive) */
     std::function<NoriObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
         pugi::xml_node &node, PropertyList &list, int parentTag) -> NoriObject * {
@@ -168,8 +179,23 @@ NoriObject *loadFromXML(const std::string &filename) {
             throw NoriException("Error while parsing \"%s\": node \"%s\" requires a Nori object as parent (at %s)",
                                 filename, node.name(), offset(node.offset_debug()));
 
-        if (tag == EScene)
-            node.append_attribute("type") = "scene";
+        if (tag == ERef) {
+            /* Add a previously declared mesh as the geometry of an instance. Other
+               objects cannot be shared, since their parent takes ownership of them */
+            check_attributes(node, { "id" });
+            auto it = ids.find(node.attribute("id").value());
+            if (it == ids.end())
+                throw NoriException("Error while parsing \"%s\": reference to unknown object \"%s\" (at %s)",
+                                    filename, node.attribute("id").value(), offset(node.offset_debug()));
+            if (it->second->getClassType() != NoriObject::EMesh || parentTag != EInstance)
+                throw NoriException("Error while parsing \"%s\": only meshes can be referenced, "
+                                    "and only from an <instance> (at %s)",
+                                    filename, offset(node.offset_debug()));
+            return it->second;
+        }
+
+        if (tag == EScene || (tag == EInstance && !node.attribute("type")))
+            node.append_attribute("type") = node.name();
         else if (tag == ETransform)
             transform.setIdentity();
 
@@ -184,7 +210,10 @@ NoriObject *loadFromXML(const std::string &filename) {
         NoriObject *result = nullptr;
         try {
             if (currentIsObject) {
-                check_attributes(node, { "type" });
+                if (node.attribute("id"))
+                    check_attributes(node, { "type", "id" });
+                else
+                    check_attributes(node, { "type" });
 
                 /* This is an object, first instantiate it */
                 result = NoriObjectFactory::createInstance(
@@ -209,6 +238,11 @@ NoriObject *loadFromXML(const std::string &filename) {
 
                 /* Activate / configure the object */
                 result->activate();
+
+                if (node.attribute("id")) {
+                    if (!ids.insert({ node.attribute("id").value(), result }).second)
+                        throw NoriException("Duplicate object id \"%s\"", node.attribute("id").value());
+                }
             } else {
                 /* This is a property */
                 switch (tag) {
@@ -39,7 +39,8 @@ public:
                 }
                 else { // direct illumination
                     Color3f Li = scene->SampleLight(lRec, sampler)->sample(lRec, sampler);
-                    if (!scene->rayIntersect(lRec.shadowRay)) {
+                    lRec.shadowRay.time = r.time;
+                    if (!scene->occluded(lRec.shadowRay)) {
                         BSDFQueryRecord bRec(its.toLocal(lRec.wi), its.toLocal(lRec.wo), ESolidAngle);
                         Color3f f = bsdf->eval(bRec);
                         Result += beta * f * Li;
@@ -55,7 +56,7 @@ public:
             eta *= bRec.eta;
             beta *= fr/* * std::abs(Frame::cosTheta(bRec.wo))*/;  // ignored cosTheta here since it's not devided in the pdf
 
-            r = Ray3f(its.p, its.toWorld(bRec.wo));
+            r = Ray3f(its.p, its.toWorld(bRec.wo), r.time);
         }
 
         return Result;
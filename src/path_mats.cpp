@@ -43,7 +43,7 @@ public:
             eta *= bRec.eta;
             beta *= fr/* * std::abs(Frame::cosTheta(bRec.wo))*/;  // ignored cosTheta here since it's not devided in the pdf
             
-            r = Ray3f(its.p, its.toWorld(bRec.wo));
+            r = Ray3f(its.p, its.toWorld(bRec.wo), r.time);
         }
 
         return Result;
@@ -41,8 +41,9 @@ public:
                 EmitterQueryRecord lRec(r.o, its.p, its.shFrame.n);
                 const Emitter* light = scene->SampleLight(lRec, sampler);
                 MC_emitter = light->sample(lRec, sampler); // Le * G / pdf
+                lRec.shadowRay.time = r.time;
 
-                if (!scene->rayIntersect(lRec.shadowRay)) {
+                if (!scene->occluded(lRec.shadowRay)) {
                     BSDFQueryRecord bRec(its.toLocal(lRec.wi), its.toLocal(lRec.wo), ESolidAngle);
                     Color3f f = its.mesh->getBSDF()->eval(bRec);
                     pdf_bsdf = its.mesh->getBSDF()->pdf(bRec);
@@ -71,7 +72,7 @@ public:
 
                 // deltaEta = bRec.eta;
 
-                r = Ray3f(its.p, its.toWorld(bRec.wo));
+                r = Ray3f(its.p, its.toWorld(bRec.wo), r.time);
                 if (!scene->rayIntersect(r, its)) stopFlag = true;
 
                 if (!stopFlag && its.mesh->isEmitter()) {
@@ -97,6 +98,7 @@ public:
                 float q = std::min(0.99f, beta.maxCoeff() * eta * eta);
                 if (sampler->next1D() > q || q == 0.0f) break;
                 beta /= (1 - q);
+            }
         }
         return Result;
     }
@@ -22,27 +22,58 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
-#include <nori/octTreeAccel.h>
 #include <nori/bvhAccel.h>
+#include <nori/instanceAccel.h>
+#include <nori/instance.h>
+#include <set>
 
 NORI_NAMESPACE_BEGIN
 
 Scene::Scene(const PropertyList &) {
-    //m_accel = new Accel();
-    //m_accel = new OctTreeAccel();
-    m_accel = new BVHAccel();
 }
 
 Scene::~Scene() {
     delete m_accel;
+
+    /* The accelerators only reference the meshes; several instances may share one */
+    std::set<Mesh *> meshes(m_meshes.begin(), m_meshes.end());
+    for (auto instance : m_instances) {
+        meshes.insert(instance->getMesh());
+        delete instance;
+    }
+    for (auto mesh : meshes)
+        delete mesh;
+
     delete m_sampler;
     delete m_camera;
     delete m_integrator;
 }
 
 void Scene::activate() {
+    /* Use the (binary) BVH unless an <accel> element selected another accelerator */
+    if (!m_accel)
+        m_accel = new BVHAccel();
+
+    /* Instances turn the accelerator into a two-level hierarchy */
+    if (!m_instances.empty()) {
+        BVHAccel *bvh = dynamic_cast<BVHAccel *>(m_accel);
+        if (!bvh)
+            throw NoriException("Scene: instancing requires a BVH accelerator!");
+        m_accel = m_instanceAccel = new InstanceAccel(bvh);
+        for (auto instance : m_instances)
+            m_instanceAccel->addInstance(instance->getMesh(), instance->getTransform());
+    }
+
+    for (auto mesh : m_meshes)
+        m_accel->addMesh(mesh);
     m_accel->build();
 
+    m_moving = false;
+    for (auto mesh : m_meshes)
+        m_moving |= mesh->isMoving();
+    for (auto instance : m_instances)
+        m_moving |= instance->getMesh()->isMoving();
+
     if (!m_integrator)
         throw NoriException("No integrator was specified!");
     if (!m_camera)
@@ -75,13 +106,22 @@ void Scene::addChild(NoriObject *obj) {
     switch (obj->getClassType()) {
         case EMesh: {
                 Mesh *mesh = static_cast<Mesh *>(obj);
-                m_accel->addMesh(mesh);
                 m_meshes.push_back(mesh);
                 if (mesh->isEmitter())
                     m_lights.push_back(mesh->getEmitter());
             }
             break;
         
+        case EInstance:
+            m_instances.push_back(static_cast<Instance *>(obj));
+            break;
+
+        case EAccel:
+            if (m_accel)
+                throw NoriException("There can only be one accelerator per scene!");
+            m_accel = static_cast<Accel *>(obj);
+            break;
+
         case EEmitter: {
                 m_lights.push_back(static_cast<Emitter *>(obj));
             }
@@ -111,6 +151,40 @@ void Scene::addChild(NoriObject *obj) {
     }
 }
 
+/// Trace a batch of rays as a stream of packets
+static void traceBatch(const Accel *accel, const std::vector<Ray3f> &rays,
+                       Intersection *its, std::vector<uint8_t> &hits, bool shadowRay) {
+    const int N = RayPacket8::Size;
+    size_t count = (rays.size() + N - 1) / N;
+    std::vector<RayPacket8> packets(count);
+    std::vector<int> active(count, 0), packetHits(count);
+
+    for (size_t i = 0; i < rays.size(); ++i) {
+        packets[i / N].set((int) (i % N), rays[i]);
+        active[i / N] |= 1 << (i % N);
+    }
+
+    accel->rayIntersectStream(packets.data(), active.data(), count, its,
+                              packetHits.data(), shadowRay);
+
+    hits.resize(rays.size());
+    for (size_t i = 0; i < rays.size(); ++i)
+        hits[i] = (packetHits[i / N] >> (i % N)) & 1;
+}
+
+void Scene::rayIntersect(const std::vector<Ray3f> &rays, std::vector<Intersection> &its,
+                         std::vector<uint8_t> &hits) const {
+    /* Pad to whole packets, since every packet writes all of its records */
+    const size_t N = RayPacket8::Size;
+    its.resize((rays.size() + N - 1) / N * N);
+    traceBatch(m_accel, rays, its.data(), hits, false);
+    its.resize(rays.size());
+}
+
+void Scene::rayIntersect(const std::vector<Ray3f> &rays, std::vector<uint8_t> &occluded) const {
+    traceBatch(m_accel, rays, nullptr, occluded, true);
+}
+
 Emitter* Scene::SampleLight(EmitterQueryRecord& rec, Sampler* sampler) const
 {
     rec.invpdf = m_lights.size();
@@ -137,12 +211,14 @@ std::string Scene::toString() const {
         "  integrator = %s,\n"
         "  sampler = %s\n"
         "  camera = %s,\n"
+        "  accel = %s,\n"
         "  meshes = {\n"
         "  %s  }\n"
         "]",
         indent(m_integrator->toString()),
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
+        indent(m_accel->toString()),
         indent(meshes, 2)
     );
 }
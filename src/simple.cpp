@@ -22,9 +22,9 @@ public:
         Point3f x = its.p, p = m_lightPos;
         Vector3f l = (p - x).normalized();
         
-        Ray3f lightRay(x, l);
+        Ray3f lightRay(x, l, ray.time);
         lightRay.mint = 0.001;
-        if( scene->rayIntersect(lightRay) ) return Color3f(0.0f);
+        if( scene->occluded(lightRay) ) return Color3f(0.0f);
         
         float r2 = (p - x).squaredNorm();
         Normal3f n = its.shFrame.n.cwiseAbs();
@@ -171,6 +171,8 @@ public:
                     Point2f pixelSample = (sampler->next2D().array()
                         * camera->getOutputSize().cast<float>().array()).matrix();
                     Color3f value = camera->sampleRay(ray, pixelSample, sampler->next2D());
+                    if (scene->isMoving())
+                        ray.time = sampler->next1D();
 
                     /* Compute the incident radiance */
                     value *= integrator->Li(scene, sampler, ray);
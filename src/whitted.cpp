@@ -23,7 +23,8 @@ public:
             }
 
             Color3f Li = scene->SampleLight(lRec, sampler)->sample(lRec, sampler);
-            if (scene->rayIntersect(lRec.shadowRay)) return Color3f(0.0f);
+            lRec.shadowRay.time = ray.time;
+            if (scene->occluded(lRec.shadowRay)) return Color3f(0.0f);
 
             BSDFQueryRecord bRec(its.toLocal(lRec.wi), its.shFrame.toLocal(-ray.d), ESolidAngle);
             Color3f f = bsdf->eval(bRec);
@@ -34,7 +35,7 @@ public:
             Color3f f = bsdf->sample(bRec, sampler->next2D());
 
             if(f.x() == 0.0f || sampler->next1D() > 0.95) return Color3f(0.0f);
-            return f * Li(scene, sampler, Ray3f(its.p, its.toWorld(bRec.wo))) / 0.95;
+            return f * Li(scene, sampler, Ray3f(its.p, its.toWorld(bRec.wo), ray.time)) / 0.95;
         }
     }
 
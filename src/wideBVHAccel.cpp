@@ -0,0 +1,316 @@
+#include <nori/wideBVHAccel.h>
+#include <nori/timer.h>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+NORI_NAMESPACE_BEGIN
+
+/// Ray data that is shared by all node tests of a traversal
+struct WideRay {
+    float org[3];    ///< Ray origin
+    float rcp[3];    ///< Componentwise reciprocal of the ray direction
+    int nearRow[3];  ///< Bounds row of the entry plane along each axis
+    int farRow[3];   ///< Bounds row of the exit plane along each axis
+
+    WideRay(const Ray3f& ray) {
+        for (int i = 0; i < 3; ++i) {
+            org[i] = ray.o[i];
+            rcp[i] = ray.dRcp[i];
+            bool negative = ray.dRcp[i] < 0;
+            nearRow[i] = negative ? i + 3 : i;
+            farRow[i] = negative ? i : i + 3;
+        }
+    }
+};
+
+/**
+ * \brief Slab test of a ray against all children of a wide node
+ *
+ * Writes the entry distance of every child to \c tnear and returns a
+ * bit mask of the children that overlap <tt>[tmin, tmax]</tt>. NaNs that
+ * arise from axis-parallel rays grazing a slab are treated as a hit.
+ */
+template <int Width>
+static inline int slabTest(const float (&bounds)[6][Width], const WideRay& r,
+    float tmin, float tmax, float* tnear) {
+    int mask = 0;
+    for (int i = 0; i < Width; ++i) {
+        float tn = tmin, tf = tmax;
+        for (int a = 0; a < 3; ++a) {
+            float t0 = (bounds[r.nearRow[a]][i] - r.org[a]) * r.rcp[a];
+            float t1 = (bounds[r.farRow[a]][i] - r.org[a]) * r.rcp[a] * SlabFarScale;
+            tn = t0 > tn ? t0 : tn;
+            tf = t1 < tf ? t1 : tf;
+        }
+        tnear[i] = tn;
+        mask |= (tn <= tf) << i;
+    }
+    return mask;
+}
+
+#if defined(__SSE2__) || defined(_M_X64)
+template <>
+inline int slabTest<4>(const float (&bounds)[6][4], const WideRay& r,
+    float tmin, float tmax, float* tnear) {
+    __m128 tn = _mm_set1_ps(tmin), tf = _mm_set1_ps(tmax);
+    for (int a = 0; a < 3; ++a) {
+        __m128 o = _mm_set1_ps(r.org[a]), rcp = _mm_set1_ps(r.rcp[a]);
+        __m128 rcpFar = _mm_set1_ps(r.rcp[a] * SlabFarScale);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[r.nearRow[a]]), o), rcp);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[r.farRow[a]]), o), rcpFar);
+        /* The second operand is returned if either one is NaN */
+        tn = _mm_max_ps(t0, tn);
+        tf = _mm_min_ps(t1, tf);
+    }
+    _mm_storeu_ps(tnear, tn);
+    return _mm_movemask_ps(_mm_cmple_ps(tn, tf));
+}
+#endif
+
+#if defined(__AVX__)
+template <>
+inline int slabTest<8>(const float (&bounds)[6][8], const WideRay& r,
+    float tmin, float tmax, float* tnear) {
+    __m256 tn = _mm256_set1_ps(tmin), tf = _mm256_set1_ps(tmax);
+    for (int a = 0; a < 3; ++a) {
+        __m256 o = _mm256_set1_ps(r.org[a]), rcp = _mm256_set1_ps(r.rcp[a]);
+        __m256 rcpFar = _mm256_set1_ps(r.rcp[a] * SlabFarScale);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[r.nearRow[a]]), o), rcp);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[r.farRow[a]]), o), rcpFar);
+        tn = _mm256_max_ps(t0, tn);
+        tf = _mm256_min_ps(t1, tf);
+    }
+    _mm256_storeu_ps(tnear, tn);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ));
+}
+#endif
+
+template <int Width> void WideBVHAccel<Width>::build() {
+    if (m_quantizationBits != 0)
+        throw NoriException("WideBVHAccel: quantized nodes are not supported!");
+    BVHAccel::build();
+    m_wideNodes.clear();
+    if (m_nodes.empty())
+        return;
+
+    cout << "Collapsing into a " << Width << "-wide BVH .. ";
+    cout.flush();
+    Timer timer;
+
+    collapse(0u);
+    m_wideNodes.shrink_to_fit();
+
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(WideNode) * m_wideNodes.size())
+        << ", " << m_wideNodes.size() << " nodes)." << endl;
+}
+
+template <int Width> bool WideBVHAccel<Width>::refit() {
+    /* A rebuild already collapsed the new hierarchy */
+    if (!BVHAccel::refit())
+        return false;
+
+    m_wideNodes.clear();
+    if (!m_nodes.empty())
+        collapse(0u);
+    return true;
+}
+
+template <int Width>
+bool WideBVHAccel<Width>::occluded(const Ray3f& _ray) const {
+    struct StackEntry {
+        uint32_t child, count;
+    } stack[64 * Width];
+    uint32_t stack_idx = 0;
+    NodeVisitCounter visits;
+
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (m_wideNodes.empty() || ray.maxt < ray.mint)
+        return false;
+
+    WideRay wray(ray);
+    TriangleRay tray(ray);
+    stack[stack_idx++] = StackEntry{ 0u, 0u };
+
+    while (stack_idx > 0) {
+        StackEntry entry = stack[--stack_idx];
+
+        if (entry.child & LEAF_FLAG) {
+            uint32_t start = entry.child & ~LEAF_FLAG;
+            if (occludedTriangles(start, start + entry.count, ray, tray))
+                return true;
+            continue;
+        }
+
+        const WideNode& node = m_wideNodes[entry.child];
+        visits++;
+        float tnear[Width];
+        int mask = slabTest<Width>(node.bounds, wray, ray.mint, ray.maxt, tnear);
+
+        /* Push in reverse, so that the largest child is popped first */
+        for (int i = Width - 1; i >= 0; --i) {
+            if ((mask & (1 << i)) && node.child[i] != EMPTY_SLOT)
+                stack[stack_idx++] = StackEntry{ node.child[i], node.count[i] };
+        }
+        assert(stack_idx < 64 * Width);
+    }
+
+    return false;
+}
+
+template <int Width> size_t WideBVHAccel<Width>::getMemoryUsage() const {
+    return BVHAccel::getMemoryUsage() + sizeof(WideNode) * m_wideNodes.size();
+}
+
+template <int Width> uint32_t WideBVHAccel<Width>::collapse(uint32_t node_idx) {
+    /* Greedily open the child with the largest surface area
+       until all slots of the wide node are used */
+    uint32_t children[Width], childCount = 0;
+    const BVHNode& root = m_nodes[node_idx];
+    if (root.isLeaf()) {
+        children[childCount++] = node_idx;
+    }
+    else {
+        children[childCount++] = node_idx + 1;
+        children[childCount++] = root.inner.rightChild;
+    }
+
+    while (childCount < Width) {
+        int best = -1;
+        float bestArea = -1.0f;
+        for (uint32_t i = 0; i < childCount; ++i) {
+            const BVHNode& node = m_nodes[children[i]];
+            float area = node.bbox.getSurfaceArea();
+            if (node.isInner() && area > bestArea) {
+                best = (int)i;
+                bestArea = area;
+            }
+        }
+        if (best == -1)
+            break;
+        uint32_t opened = children[best];
+        children[best] = opened + 1;
+        children[childCount++] = m_nodes[opened].inner.rightChild;
+    }
+
+    /* Occlusion queries visit the children with larger surface area first */
+    std::sort(children, children + childCount, [&](uint32_t a, uint32_t b) {
+        return m_nodes[a].bbox.getSurfaceArea() > m_nodes[b].bbox.getSurfaceArea();
+    });
+
+    uint32_t wide_idx = (uint32_t)m_wideNodes.size();
+    m_wideNodes.emplace_back();
+
+    for (int i = 0; i < Width; ++i) {
+        uint32_t child = EMPTY_SLOT, count = 0;
+        BoundingBox3f bbox; /* Invalid boxes are never hit */
+
+        if (i < (int)childCount) {
+            const BVHNode& node = m_nodes[children[i]];
+            bbox = node.bbox;
+            if (node.isLeaf()) {
+                child = LEAF_FLAG | node.start();
+                count = node.leaf.size;
+            }
+            else {
+                /* Note: this may reallocate 'm_wideNodes' */
+                child = collapse(children[i]);
+            }
+        }
+
+        WideNode& wide = m_wideNodes[wide_idx];
+        for (int a = 0; a < 3; ++a) {
+            wide.bounds[a][i] = bbox.min[a];
+            wide.bounds[a + 3][i] = bbox.max[a];
+        }
+        wide.child[i] = child;
+        wide.count[i] = count;
+    }
+
+    return wide_idx;
+}
+
+template <int Width>
+bool WideBVHAccel<Width>::rayIntersect(const Ray3f& _ray, Intersection& its, bool shadowRay) const {
+    struct StackEntry {
+        uint32_t child, count;
+        float t;
+    } stack[64 * Width];
+    uint32_t stack_idx = 0;
+
+    its.t = std::numeric_limits<float>::infinity();
+
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (m_wideNodes.empty() || ray.maxt < ray.mint)
+        return false;
+
+    WideRay wray(ray);
+    TriangleRay tray(ray);
+    bool foundIntersection = false;
+    uint32_t f = 0;
+    NodeVisitCounter visits;
+
+    stack[stack_idx++] = StackEntry{ 0u, 0u, ray.mint };
+
+    while (stack_idx > 0) {
+        StackEntry entry = stack[--stack_idx];
+
+        /* Skip subtrees that start behind the closest hit found so far */
+        if (entry.t > ray.maxt)
+            continue;
+
+        if (entry.child & LEAF_FLAG) {
+            uint32_t start = entry.child & ~LEAF_FLAG;
+            if (intersectTriangles(start, start + entry.count, ray, tray, its, shadowRay, f)) {
+                if (shadowRay)
+                    return true;
+                foundIntersection = true;
+            }
+            continue;
+        }
+
+        const WideNode& node = m_wideNodes[entry.child];
+        visits++;
+        float tnear[Width];
+        int mask = slabTest<Width>(node.bounds, wray, ray.mint, ray.maxt, tnear);
+
+        /* Push the hit children so that the closest one is popped first */
+        uint32_t base = stack_idx;
+        for (int i = 0; i < Width; ++i) {
+            if (!(mask & (1 << i)) || node.child[i] == EMPTY_SLOT)
+                continue;
+            StackEntry e{ node.child[i], node.count[i], tnear[i] };
+            uint32_t j = stack_idx++;
+            while (j > base && stack[j - 1].t < e.t) {
+                stack[j] = stack[j - 1];
+                --j;
+            }
+            stack[j] = e;
+        }
+        assert(stack_idx < 64 * Width);
+    }
+
+    if (foundIntersection)
+        finalizeIntersection(f, ray.time, its);
+
+    return foundIntersection;
+}
+
+template class WideBVHAccel<4>;
+template class WideBVHAccel<8>;
+
+NORI_REGISTER_CLASS(QBVHAccel, "qbvh");
+NORI_REGISTER_CLASS(OBVHAccel, "obvh");
+
+NORI_NAMESPACE_END